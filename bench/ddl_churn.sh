@@ -0,0 +1,122 @@
+#!/bin/bash
+#
+# ddl_churn.sh: Run prepared statements relying on pg_shared_plans with
+# multiple clients while another client continuously runs DDL on the objects
+# the cached plans depend on: index creation and removal, ALTER TABLE,
+# partition attach and detach and function replacement.
+#
+# The DDL either changes the result of the queries, with a table rewrite
+# multiplying the values, the attached partition rows and a function
+# filtering all rows, or makes the cached plans unusable, with the index
+# removal.  The DDL client records the outcome of each DDL in a table in the
+# same transaction, holding an advisory lock that the other clients acquire in
+# shared mode, so that they know which result to expect.
+#
+# Reports the throughput dips, an estimation of the time spent waiting on
+# locks, including the advisory lock, and fails if any wrong result was
+# detected.  The server must have pg_shared_plans in shared_preload_libraries,
+# and the connection parameters are taken from the usual libpq environment
+# variables.
+#
+# Usage: ddl_churn.sh [-c clients] [-T duration] [-s ddl_sleep_ms]
+#
+# This program is open source, licensed under the PostgreSQL license.
+# For license terms, see the LICENSE file.
+
+set -eu
+
+clients=8
+duration=60
+ddl_sleep=100
+# Interval between two samples of pg_stat_activity, in seconds
+sample=0.1
+
+while getopts "c:T:s:" opt; do
+	case "$opt" in
+		c) clients="$OPTARG" ;;
+		T) duration="$OPTARG" ;;
+		s) ddl_sleep="$OPTARG" ;;
+		*) echo "Usage: $0 [-c clients] [-T duration] [-s ddl_sleep_ms]" >&2
+		   exit 1 ;;
+	esac
+done
+
+dir=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; rm -rf "$tmp"' EXIT
+
+psql -X -q -v ON_ERROR_STOP=1 -f "$dir/ddl_churn_setup.sql"
+psql -X -q -c "SELECT pg_shared_plans_reset()" > /dev/null
+: > "$tmp/waits"
+
+# Sample the backends waiting on a heavyweight lock and on the pg_shared_plans
+# LWLocks.
+(
+	while true; do
+		psql -X -A -t -F ' ' -c "SELECT
+			count(*) FILTER (WHERE wait_event_type = 'Lock'),
+			count(*) FILTER (WHERE wait_event_type = 'LWLock'
+							 AND wait_event = 'pg_shared_plans')
+			FROM pg_stat_activity
+			WHERE pid <> pg_backend_pid()" >> "$tmp/waits" 2>/dev/null || true
+		sleep "$sample"
+	done
+) &
+
+pgbench -n -c 1 -T "$duration" -D ddl_sleep="$ddl_sleep" \
+	-f "$dir/ddl_churn_ddl.sql" > "$tmp/ddl.log" 2>&1 &
+ddl_pid=$!
+
+status=0
+pgbench -n -M prepared -c "$clients" -j "$clients" -T "$duration" -P 1 \
+	-f "$dir/ddl_churn_query.sql" > "$tmp/query.log" 2>&1 || status=$?
+
+ddl_status=0
+wait "$ddl_pid" || ddl_status=$?
+
+echo "== throughput (tps per second) =="
+awk '$1 == "progress:" { print $4 }' "$tmp/query.log" | sort -n > "$tmp/tps"
+if [ -s "$tmp/tps" ]; then
+	awk '{ v[NR] = $1 }
+		END {
+			median = v[int((NR + 1) / 2)];
+			dips = 0;
+			for (i = 1; i <= NR; i++)
+				if (v[i] < median / 2)
+					dips++;
+			printf "min: %.1f, median: %.1f, max: %.1f\n", v[1], median, v[NR];
+			printf "seconds below half the median: %d / %d\n", dips, NR;
+		}' "$tmp/tps"
+fi
+grep -E '^(number of transactions actually processed|tps)' "$tmp/query.log" || true
+
+echo "== lock waits (estimated seconds) =="
+awk -v sample="$sample" '
+	{ heavy += $1; lw += $2 }
+	END {
+		printf "heavyweight locks: %.1f\n", heavy * sample;
+		printf "pg_shared_plans lwlocks: %.1f\n", lw * sample;
+	}' "$tmp/waits"
+
+echo "== DDL stream =="
+grep -E '^number of transactions actually processed' "$tmp/ddl.log" || true
+
+echo "== pg_shared_plans =="
+psql -X -q -c "SELECT count(*) AS entries, sum(bypass) AS bypass,
+		sum(discard) AS discard, sum(num_custom_plans) AS custom_plans
+	FROM pg_shared_plans()
+	WHERE query LIKE '%churn%'"
+
+if grep -q 'wrong result' "$tmp/query.log"; then
+	echo "FAILED: wrong results detected:"
+	grep 'wrong result' "$tmp/query.log" | sort | uniq -c
+	exit 1
+fi
+
+if [ "$status" -ne 0 ] || [ "$ddl_status" -ne 0 ]; then
+	echo "FAILED: pgbench exited with status $status (queries), $ddl_status (DDL):"
+	grep -E 'ERROR|aborted' "$tmp/query.log" "$tmp/ddl.log" | sort | uniq -c
+	exit 1
+fi
+
+echo "OK"
@@ -0,0 +1,46 @@
+BEGIN;
+SELECT pg_advisory_xact_lock(42);
+CREATE INDEX churn_id_idx ON churn (id);
+COMMIT;
+\sleep :ddl_sleep ms
+BEGIN;
+SELECT pg_advisory_xact_lock(42);
+ALTER TABLE churn ATTACH PARTITION churn_extra FOR VALUES FROM (1000) TO (2000);
+UPDATE churn_state SET attached = 1;
+COMMIT;
+\sleep :ddl_sleep ms
+BEGIN;
+SELECT pg_advisory_xact_lock(42);
+ALTER TABLE churn ALTER COLUMN val TYPE bigint USING val * 10;
+UPDATE churn_state SET factor = 10;
+COMMIT;
+\sleep :ddl_sleep ms
+BEGIN;
+SELECT pg_advisory_xact_lock(42);
+DROP INDEX churn_id_idx;
+COMMIT;
+\sleep :ddl_sleep ms
+BEGIN;
+SELECT pg_advisory_xact_lock(42);
+ALTER TABLE churn ALTER COLUMN val TYPE integer USING val / 10;
+UPDATE churn_state SET factor = 1;
+COMMIT;
+\sleep :ddl_sleep ms
+BEGIN;
+SELECT pg_advisory_xact_lock(42);
+ALTER TABLE churn DETACH PARTITION churn_extra;
+UPDATE churn_state SET attached = 0;
+COMMIT;
+\sleep :ddl_sleep ms
+BEGIN;
+SELECT pg_advisory_xact_lock(42);
+CREATE OR REPLACE FUNCTION churn_fn(integer) RETURNS boolean LANGUAGE sql IMMUTABLE AS 'SELECT $1 < 0';
+UPDATE churn_state SET fn_positive = 0;
+COMMIT;
+\sleep :ddl_sleep ms
+BEGIN;
+SELECT pg_advisory_xact_lock(42);
+CREATE OR REPLACE FUNCTION churn_fn(integer) RETURNS boolean LANGUAGE sql IMMUTABLE AS 'SELECT $1 >= 0';
+UPDATE churn_state SET fn_positive = 1;
+COMMIT;
+\sleep :ddl_sleep ms
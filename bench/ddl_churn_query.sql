@@ -0,0 +1,12 @@
+\set id random(0, 1999)
+BEGIN;
+-- Wait for any DDL in progress and get its outcome
+SELECT pg_advisory_xact_lock_shared(42);
+SELECT attached, fn_positive, factor FROM churn_state \gset
+SELECT coalesce(sum(val), 0) AS total FROM churn
+    WHERE id = :id AND churn_fn(id) \gset
+COMMIT;
+\set expected CASE WHEN (:id < 1000 OR :attached = 1) AND :fn_positive = 1 THEN :id * :factor ELSE 0 END
+\if :total != :expected
+SELECT churn_wrong_result(:id, :total, :expected);
+\endif
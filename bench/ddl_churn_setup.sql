@@ -0,0 +1,37 @@
+-- Objects used by ddl_churn.sh
+DROP TABLE IF EXISTS churn, churn_extra, churn_state;
+DROP FUNCTION IF EXISTS churn_wrong_result(integer, numeric, bigint);
+DROP FUNCTION IF EXISTS churn_fn(integer);
+
+CREATE EXTENSION IF NOT EXISTS pg_shared_plans;
+
+CREATE TABLE churn (id integer, val integer) PARTITION BY RANGE (id);
+CREATE TABLE churn_1 PARTITION OF churn FOR VALUES FROM (0) TO (500);
+CREATE TABLE churn_2 PARTITION OF churn FOR VALUES FROM (500) TO (1000);
+-- Attached and detached by the DDL stream
+CREATE TABLE churn_extra (id integer, val integer);
+INSERT INTO churn SELECT i, i FROM generate_series(0, 999) i;
+INSERT INTO churn_extra SELECT i, i FROM generate_series(1000, 1999) i;
+VACUUM ANALYZE churn, churn_extra;
+
+CREATE FUNCTION churn_fn(integer) RETURNS boolean LANGUAGE sql IMMUTABLE
+    AS 'SELECT $1 >= 0';
+
+-- What the DDL stream changed, so that the expected results are known.  It's
+-- only modified while holding the advisory lock in exclusive mode.
+CREATE TABLE churn_state (
+    attached integer,       -- is churn_extra attached
+    fn_positive integer,    -- does churn_fn() return true for positive values
+    factor integer          -- val = id * factor
+);
+INSERT INTO churn_state VALUES (0, 1, 1);
+
+-- Raise an error if a cached plan returned a wrong result
+CREATE FUNCTION churn_wrong_result(p_id integer, p_total numeric,
+    p_expected bigint)
+RETURNS void LANGUAGE plpgsql AS $$
+BEGIN
+    RAISE EXCEPTION 'wrong result for %: % instead of %',
+        p_id, p_total, p_expected;
+END;
+$$;
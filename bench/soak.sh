@@ -0,0 +1,178 @@
+#!/bin/bash
+#
+# soak.sh: Long-running workload checking that the shared memory used by
+# pg_shared_plans doesn't grow unboundedly.
+#
+# Multiple clients execute queries with randomized constants on randomized
+# tables, so that entries are continuously created and evicted, while another
+# client discards entries by running DDL on random tables and sometimes resets
+# the entries.  The allocated size, the size of the DSA area (on pg17 and
+# above), the number of reverse dependencies and the size of their arrays are
+# sampled over time.  The run fails if any of them is still growing during the
+# last third of the run compared to the middle one, or if the allocated size
+# and the number of reverse dependencies don't go back to their initial values
+# once all the entries are reset.
+#
+# The size of the DSA area is reported as -1 if not available.  The server must
+# have pg_shared_plans in shared_preload_libraries, and the connection
+# parameters are taken from the usual libpq environment variables.
+# The role must be a superuser, to be able to reset the entries.
+#
+# Usage: soak.sh [-c clients] [-T duration] [-i interval] [-t tables]
+#                [-s churn_sleep_ms] [-g tolerance_pct]
+#
+# This program is open source, licensed under the PostgreSQL license.
+# For license terms, see the LICENSE file.
+
+set -eu
+
+clients=8
+duration=3600
+interval=10
+tables=20
+churn_sleep=10
+tolerance=10
+
+while getopts "c:T:i:t:s:g:" opt; do
+	case "$opt" in
+		c) clients="$OPTARG" ;;
+		T) duration="$OPTARG" ;;
+		i) interval="$OPTARG" ;;
+		t) tables="$OPTARG" ;;
+		s) churn_sleep="$OPTARG" ;;
+		g) tolerance="$OPTARG" ;;
+		*) echo "Usage: $0 [-c clients] [-T duration] [-i interval] [-t tables] [-s churn_sleep_ms] [-g tolerance_pct]" >&2
+		   exit 1 ;;
+	esac
+done
+
+dir=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; rm -rf "$tmp"' EXIT
+
+export PGOPTIONS="${PGOPTIONS:-} -c plan_cache_mode=force_custom_plan \
+-c pg_shared_plans.threshold=1 -c pg_shared_plans.min_plan_time=0"
+
+psql -X -q -v ON_ERROR_STOP=1 -v tables="$tables" -f "$dir/soak_setup.sql"
+
+# Use 4 times more distinct queries than the maximum number of entries, so
+# that entries keep being evicted.
+max=$(psql -X -A -t -c "SHOW pg_shared_plans.max")
+consts=$(( (4 * max + tables - 1) / tables ))
+
+sample_query="SELECT extract(epoch FROM now())::bigint,
+		(SELECT count(*) FROM pg_shared_plans()),
+		i.alloced_size,
+		coalesce((SELECT bytes FROM pg_shared_plans_memory()
+				  WHERE component = 'dsa total'), -1),
+		i.rdepend_num,
+		(SELECT coalesce(sum(num_keys), 0) FROM pg_shared_plans_rdepends()),
+		(SELECT coalesce(sum(max_keys), 0) FROM pg_shared_plans_rdepends())
+	FROM pg_shared_plans_info() i"
+
+psql -X -q -c "SELECT pg_shared_plans_reset()" > /dev/null
+baseline=$(psql -X -A -t -F ' ' -c \
+	"SELECT alloced_size, rdepend_num FROM pg_shared_plans_info()")
+
+echo "== $clients clients, $tables tables, $consts constants, pg_shared_plans.max = $max =="
+echo "time entries alloced_size dsa_total rdepend_num rdepend_keys rdepend_max_keys"
+
+start=$(date +%s)
+(
+	while true; do
+		psql -X -A -t -F ' ' -c "$sample_query" 2>/dev/null |
+			awk -v start="$start" '{ $1 = $1 - start; print }' |
+			tee -a "$tmp/samples" || true
+		sleep "$interval"
+	done
+) &
+sampler_pid=$!
+
+pgbench -n -c 1 -T "$duration" -D tables="$tables" \
+	-D churn_sleep="$churn_sleep" -f "$dir/soak_churn.sql" \
+	> "$tmp/churn.log" 2>&1 &
+churn_pid=$!
+
+status=0
+pgbench -n -M prepared -c "$clients" -j "$clients" -T "$duration" \
+	-D tables="$tables" -D consts="$consts" -f "$dir/soak_query.sql" \
+	> "$tmp/query.log" 2>&1 || status=$?
+
+churn_status=0
+wait "$churn_pid" || churn_status=$?
+kill "$sampler_pid" 2>/dev/null || true
+wait "$sampler_pid" 2>/dev/null || true
+
+echo "== transactions =="
+grep -E '^number of transactions actually processed' "$tmp/query.log" \
+	"$tmp/churn.log" || true
+
+failed=0
+
+if [ "$status" -ne 0 ] || [ "$churn_status" -ne 0 ]; then
+	echo "FAILED: pgbench exited with status $status (queries), $churn_status (churn):"
+	grep -E 'ERROR|aborted' "$tmp/query.log" "$tmp/churn.log" | sort | uniq -c
+	failed=1
+fi
+
+# Compare the maximum of each metric during the last third of the run with the
+# one during the middle third, the first third being the warmup.
+echo "== growth =="
+if ! awk -v tolerance="$tolerance" '
+	BEGIN {
+		split("alloced_size dsa_total rdepend_num rdepend_keys rdepend_max_keys",
+			  names, " ");
+		failed = 0;
+	}
+	{ for (c = 3; c <= 7; c++) v[NR, c] = $c }
+	END {
+		if (NR < 6) {
+			print "not enough samples, increase the duration";
+			exit 1;
+		}
+		for (c = 3; c <= 7; c++) {
+			mid = -1; last = -1;
+			for (i = int(NR / 3) + 1; i <= NR; i++) {
+				# not exposed before pg17
+				if (v[i, c] < 0)
+					continue;
+				if (i <= int(2 * NR / 3)) {
+					if (v[i, c] + 0 > mid)
+						mid = v[i, c] + 0;
+				}
+				else if (v[i, c] + 0 > last)
+					last = v[i, c] + 0;
+			}
+			if (mid < 0 || last < 0) {
+				printf "%s: not available\n", names[c - 2];
+				continue;
+			}
+			printf "%s: %d -> %d", names[c - 2], mid, last;
+			if (last > mid * (1 + tolerance / 100) && last > mid + 1) {
+				printf " GROWING";
+				failed = 1;
+			}
+			printf "\n";
+		}
+		exit failed;
+	}' "$tmp/samples"; then
+	echo "FAILED: unbounded growth detected"
+	failed=1
+fi
+
+# Once everything is reset, all the memory should have been released.
+echo "== after reset =="
+psql -X -q -c "SELECT pg_shared_plans_reset()" > /dev/null
+final=$(psql -X -A -t -F ' ' -c \
+	"SELECT alloced_size, rdepend_num FROM pg_shared_plans_info()")
+echo "alloced_size rdepend_num: $baseline -> $final"
+if [ "$final" != "$baseline" ]; then
+	echo "FAILED: memory not released after reset"
+	failed=1
+fi
+
+if [ "$failed" -ne 0 ]; then
+	exit 1
+fi
+
+echo "OK"
@@ -0,0 +1,11 @@
+\set action random(1, 100)
+\set t random(1, :tables)
+\if :action <= 90
+SELECT soak_ddl(:t, :action);
+\elif :action <= 99
+SELECT pg_shared_plans_reset(0, (SELECT oid FROM pg_database
+    WHERE datname = current_database()), 0);
+\else
+SELECT pg_shared_plans_reset();
+\endif
+\sleep :churn_sleep ms
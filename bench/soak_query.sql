@@ -0,0 +1,4 @@
+\set t random(1, :tables)
+\set c random(1, :consts)
+\set id random(1, 1000)
+SELECT soak_query(:t, :c, :id);
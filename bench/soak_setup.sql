@@ -0,0 +1,50 @@
+-- Objects used by soak.sh
+DROP FUNCTION IF EXISTS soak_query(integer, integer, integer);
+DROP FUNCTION IF EXISTS soak_ddl(integer, integer);
+
+CREATE EXTENSION IF NOT EXISTS pg_shared_plans;
+
+SELECT format('DROP TABLE IF EXISTS soak_%s', i)
+    FROM generate_series(1, :tables) i \gexec
+SELECT format('CREATE TABLE soak_%s (id integer, val integer)', i)
+    FROM generate_series(1, :tables) i \gexec
+SELECT format('INSERT INTO soak_%s SELECT i, i FROM generate_series(1, 1000) i', i)
+    FROM generate_series(1, :tables) i \gexec
+
+-- Each (table, constant) pair leads to a different entry
+CREATE FUNCTION soak_query(p_table integer, p_const integer, p_id integer)
+RETURNS bigint LANGUAGE plpgsql AS $$
+DECLARE
+    v_count bigint;
+BEGIN
+    EXECUTE format('SELECT count(*) FROM soak_%s WHERE id = $1 AND val <> %s',
+        p_table, p_const)
+    INTO v_count USING p_id;
+    RETURN v_count;
+END;
+$$;
+
+-- Discard the entries depending on the given table, either by creating or
+-- dropping an index or by adding or dropping a column
+CREATE FUNCTION soak_ddl(p_table integer, p_action integer)
+RETURNS void LANGUAGE plpgsql AS $$
+DECLARE
+    v_rel regclass := format('soak_%s', p_table)::regclass;
+BEGIN
+    IF p_action % 2 = 0 THEN
+        IF to_regclass(format('soak_%s_val_idx', p_table)) IS NULL THEN
+            EXECUTE format('CREATE INDEX ON %s (val)', v_rel);
+        ELSE
+            EXECUTE format('DROP INDEX soak_%s_val_idx', p_table);
+        END IF;
+    ELSE
+        IF EXISTS (SELECT 1 FROM pg_attribute
+                   WHERE attrelid = v_rel AND attname = 'extra'
+                   AND NOT attisdropped) THEN
+            EXECUTE format('ALTER TABLE %s DROP COLUMN extra', v_rel);
+        ELSE
+            EXECUTE format('ALTER TABLE %s ADD COLUMN extra integer', v_rel);
+        END IF;
+    END IF;
+END;
+$$;
@@ -18,9 +18,43 @@
 #include "datatype/timestamp.h"
 #include "lib/dshash.h"
 #include "miscadmin.h"
+#include "nodes/params.h"
+#include "nodes/parsenodes.h"
+#include "nodes/plannodes.h"
 #include "storage/s_lock.h"
 #include "utils/hsearch.h"
 
+#define PGSP_MAX_ENTRIES		(1 << 30)	/* upper bound of pg_shared_plans.max */
+#define PGSP_USAGE_INIT			(1.0)
+#define USAGE_DECREASE_FACTOR	(0.99)	/* decreased every entry_dealloc */
+#define USAGE_DEALLOC_PERCENT	5		/* free this % of entries at once */
+
+#define PLANCACHE_THRESHOLD		5		/* see plancache.c */
+
+#define PGSP_PLAN_HISTORY		8		/* # of plan changes kept per entry */
+#define PGSP_HIT_RATE_WINDOW	(60.0)	/* hit rate decay time, in seconds */
+#define PGSP_HIT_TIME_WEIGHT	(0.1)	/* weight of the last hit in hit_time */
+
+typedef enum pgspPlanCostMode
+{
+	PGSP_PLAN_COST_ESTIMATED,	/* plancache's estimate of planning effort */
+	PGSP_PLAN_COST_MEASURED		/* measured planning and hit times */
+} pgspPlanCostMode;
+
+typedef enum pgspPlanChangeReason
+{
+	PGSP_PLAN_NEW,			/* first plan stored for the entry */
+	PGSP_PLAN_DISCARD,		/* plan discarded */
+	PGSP_PLAN_REPLAN		/* new plan stored after a discard */
+} pgspPlanChangeReason;
+
+typedef struct pgspPlanChange
+{
+	uint64		fingerprint;	/* see pgsp_plan_fingerprint() */
+	Cost		generic_cost;
+	TimestampTz	ts;
+	pgspPlanChangeReason reason;
+} pgspPlanChange;
 
 typedef struct pgspHashKey
 {
@@ -30,26 +64,86 @@ typedef struct pgspHashKey
 	uint32		constid;	/* hash of the consts still present */
 } pgspHashKey;
 
+/*
+ * Reference to an entry, using its slot in the slot table rather than its
+ * key, see pgsp_slot.c.
+ */
+typedef struct pgspEntryRef
+{
+	uint32		slot;		/* index in the slot table */
+	uint32		generation;	/* generation of the slot */
+} pgspEntryRef;
+
+/*
+ * Serialized plan stored in shared memory.  The owning entry holds one
+ * reference, and each backend deserializing the plan without holding
+ * pgsp->lock holds another one, so that the buffer isn't freed under it.
+ */
+typedef struct pgspPlanBuffer
+{
+	pg_atomic_uint32 refcount;
+	size_t		len;			/* serialized plan length */
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+} pgspPlanBuffer;
+
+#define PGSP_PLAN_BUFFER_SIZE(len)	(offsetof(pgspPlanBuffer, data) + (len))
+
 typedef struct pgspEntry
 {
 	pgspHashKey key;		/* hash key of entry - MUST BE FIRST */
+	pgspEntryRef ref;		/* slot of the entry, used by the reverse
+							   dependencies */
 	size_t		len;		/* serialized plan length */
 	dsa_pointer plan;		/* only modified holding exclusive pgsp->lock */
+	size_t		query_len;	/* serialized query length */
+	dsa_pointer query;		/* serialized Query, if store_query is enabled -
+							   only modified holding exclusive pgsp->lock */
 	int			num_rels;	/* # of referenced base relations */
 	dsa_pointer rels;		/* only modified holding exclusive pgsp->lock */
 	int			num_rdeps;	/* # of non relation reverse dependencies */
 	dsa_pointer rdeps;		/* array of pgspRdependKey - only modified holding
 							   exclusive pgsp_lock */
+	dsa_pointer memo;		/* memoized custom plans, see pgsp_memo.c - only
+							   modified holding exclusive pgsp->lock */
+	bool		has_query_text;	/* holds a reference on the query text, see
+								   pgsp_query_text_acquire() */
 	int			num_const;	/* # of const values in the plan */
 	double		plantime;	/* first generic planning time */
 	Cost		generic_cost; /* total cost of the stored plan */
 	int64		discard;	/* # of time plan was discarded */
+	uint64		fingerprint;	/* fingerprint of the stored plan */
+	uint64		epoch;		/* epoch at which the stored plan was generated,
+							   see pgsp_epoch.c */
+	int			history_next;	/* next slot to write in history */
+	int			history_count;	/* # of valid records in history */
+	pgspPlanChange history[PGSP_PLAN_HISTORY];	/* ring buffer of plan
+												   changes, only modified
+												   holding exclusive
+												   pgsp->lock */
+	TimestampTz	created_at;		/* creation time of the entry */
+	TimestampTz	last_discard_at;	/* last time the plan was discarded */
+	TimestampTz	last_replanned_at;	/* last time a plan was stored after a
+									   discard */
 	pg_atomic_uint32 lockers;/* prevent new plans from being saved if > 0 */
 	slock_t		mutex;		/* protects following fields only */
 	int64		bypass;		/* number of times magic happened */
 	double		usage;		/* usage factor */
 	Cost		total_custom_cost; /* total cost of custom plans planned */
+	Cost		total_custom_exec_cost; /* same, without the planning effort
+										   estimate */
+	double		total_custom_plantime;	/* total planning time of custom
+										   plans planned (ms) */
 	int64		num_custom_plans; /* # of custom plans planned */
+	double		hit_time;		/* moving average of the time needed to use
+								   the stored plan (ms), only maintained
+								   with measured plan_cost_mode */
+	int64		shadow_hits;	/* # of would-be bypass in shadow mode */
+	double		shadow_time_saved; /* would-be planning time saved (ms) */
+	Cost		shadow_cost_diff; /* total of generic - custom plan cost for
+								   would-be bypass */
+	TimestampTz	last_hit_at;	/* last time the plan was used */
+	double		hit_rate;		/* decayed # of hits per second, as of
+								   last_hit_at */
 } pgspEntry;
 
 typedef enum pgspEvictionKind
@@ -69,12 +163,21 @@ typedef struct pgspSharedState
 	int			LWTRANCHE_PGSP;
 	dsa_handle	pgsp_dsa_handle;
 	dshash_table_handle pgsp_rdepend_handle;
+	dshash_table_handle pgsp_query_text_handle;
 	double		cur_median_usage;	/* current median usage in hashtable */
+	int64		removed_bypass;		/* counters of removed entries, only */
+	int64		removed_custom_plans;	/* modified holding exclusive */
+	int64		removed_discard;	/* pgsp->lock */
 	slock_t		mutex;				/* protects following fields only */
 	int32		rdepend_num;		/* # of entries in the rdepend dshash */
 	int64		alloced_size;		/* allocated size for rdepend entries */
 	int64		dealloc;			/* # of times entries were deallocated */
+	int64		rdepend_refused;	/* # of entries refused by rdepend_max */
 	TimestampTz stats_reset;		/* timestamp with all stats reset */
+	pg_atomic_uint64 plantime_rejected;	/* # of plans not cached because of
+										   min_plan_time */
+	pg_atomic_uint64 trace_size;	/* bytes written in current trace file */
+	pg_atomic_uint32 trace_generation;	/* bumped on each trace rotation */
 } pgspSharedState;
 
 /* Links to shared memory state */
@@ -82,10 +185,27 @@ extern pgspSharedState *pgsp;
 extern HTAB *pgsp_hash;
 extern dsa_area *pgsp_area;
 extern dshash_table *pgsp_rdepend;
+extern dshash_table *pgsp_query_text;
+
+/* GUC variables */
+extern int	pgsp_max;
+extern int	pgsp_min_plantime;
+extern int	pgsp_plan_cost_mode;
+extern double pgsp_plantime_cost;
+extern int	pgsp_threshold;
+extern bool	pgsp_store_query;
 
 uint32 pgsp_hash_fn(const void *key, Size keysize);
 int pgsp_match_fn(const void *key1, const void *key2, Size keysize);
 
+void pgsp_attach_dsa(void);
+bool pgsp_entry_epoch_valid(pgspEntry *entry);
+bool pgsp_generic_plan_cheaper(volatile pgspEntry *e);
+dsa_pointer pgsp_plan_alloc(const char *serialized, size_t len);
+const char *pgsp_plan_pin(dsa_pointer plan, size_t *len);
+void pgsp_plan_unpin(dsa_pointer plan);
 void pgsp_evict_by_oid(Oid dbid, Oid classid, Oid oid, pgspEvictionKind kind);
+PlannedStmt *pgsp_call_planner(Query *parse, const char *query_string,
+							   int cursorOptions, ParamListInfo boundParams);
 
 #endif
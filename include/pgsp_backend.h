@@ -0,0 +1,54 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_backend.h: Per-backend statistics of the shared plan cache usage.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_BACKEND_H
+#define _PGSP_BACKEND_H
+
+#include "postgres.h"
+
+#include "portability/instr_time.h"
+#include "storage/spin.h"
+
+typedef enum pgspBackendLookup
+{
+	PGSP_LOOKUP_HIT,		/* cached plan used */
+	PGSP_LOOKUP_MISS,		/* no usable cached plan */
+	PGSP_LOOKUP_CUSTOM		/* cached plan found but a custom plan used */
+} pgspBackendLookup;
+
+/*
+ * Counters of a single backend.  Only the owning backend modifies them, and
+ * they're reset when it exits.
+ */
+typedef struct pgspBackendStats
+{
+	slock_t		mutex;				/* protects all the following fields */
+	int			pid;				/* owning backend, 0 if unused */
+	int64		lookups;			/* # of shared cache lookups */
+	int64		hits;				/* # of cached plans used */
+	int64		misses;				/* # of lookups without usable plan */
+	int64		stores;				/* # of plans stored */
+	int64		validation_failures;	/* # of cached plans invalidated
+										   while acquiring the locks */
+	double		hook_time;			/* total time spent in the planner hook,
+									   in ms */
+	int64		bytes_deserialized;	/* size of the cached plans used,
+									   generic or memoized */
+} pgspBackendStats;
+
+int pgsp_backend_num_slots(void);
+Size pgsp_backend_memsize(void);
+void pgsp_backend_shmem_startup(void);
+void pgsp_backend_record(instr_time start, pgspBackendLookup lookup,
+						 bool stored, bool validation_failed,
+						 size_t bytes_deserialized);
+#endif
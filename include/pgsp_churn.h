@@ -0,0 +1,60 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_churn.h: Detection of queries cached with many different constants.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_CHURN_H
+#define _PGSP_CHURN_H
+
+#include "postgres.h"
+
+#include "storage/spin.h"
+
+#include "include/pg_shared_plans.h"
+
+/* Number of registers of the sketch, must be a power of 2 */
+#define PGSP_CHURN_BITS			6
+#define PGSP_CHURN_REGISTERS	(1 << PGSP_CHURN_BITS)
+
+/*
+ * Number of tracked queries.  Each queryid having at least one cached entry
+ * needs to be tracked, so keep room for as many other ones.
+ */
+#define PGSP_CHURN_MAX			(pgsp_max * 2)
+
+typedef struct pgspChurnKey
+{
+	Oid			dbid;
+	uint64		queryid;
+} pgspChurnKey;
+
+/*
+ * Number of distinct constid seen for a given dbid and queryid, estimated
+ * using a HyperLogLog sketch.  The entry is only created, removed and its
+ * num_entries modified holding an exclusive lock on pgsp->lock.
+ */
+typedef struct pgspChurnEntry
+{
+	pgspChurnKey key;		/* hash key of the entry - MUST BE FIRST */
+	int			num_entries;	/* # of pgspEntry currently cached */
+	slock_t		mutex;		/* protects the following fields */
+	int64		refused;	/* # of entries refused by max_entries_per_query */
+	uint8		registers[PGSP_CHURN_REGISTERS];
+} pgspChurnEntry;
+
+extern PGDLLIMPORT int pgsp_max_entries_per_query;
+
+Size pgsp_churn_memsize(void);
+void pgsp_churn_shmem_startup(void);
+bool pgsp_churn_check(pgspHashKey *key, uint32 hashvalue);
+void pgsp_churn_entry_added(pgspHashKey *key);
+void pgsp_churn_entry_removed(pgspHashKey *key);
+void pgsp_churn_reset(void);
+#endif
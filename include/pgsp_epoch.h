@@ -0,0 +1,50 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_epoch.h: Lazy validation of the cached plans.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_EPOCH_H
+#define _PGSP_EPOCH_H
+
+#include "postgres.h"
+
+#include "port/atomics.h"
+
+#include "include/pgsp_rdepend.h"
+
+/* Number of epoch slots, must be a power of 2 */
+#define PGSP_EPOCH_SLOTS		4096
+
+typedef enum pgspValidationMode
+{
+	PGSP_VALIDATION_EAGER,		/* discard the dependent plans on DDL */
+	PGSP_VALIDATION_LAZY		/* check the dependencies when using a plan */
+} pgspValidationMode;
+
+/*
+ * Epochs of the last invalidation of the dependencies.  Every dependency is
+ * hashed to one of the slots, so a collision can only lead to a spurious
+ * invalidation.
+ */
+typedef struct pgspEpochs
+{
+	pg_atomic_uint64 current;	/* last epoch assigned */
+	pg_atomic_uint64 slots[PGSP_EPOCH_SLOTS];
+} pgspEpochs;
+
+extern PGDLLIMPORT int pgsp_validation;
+
+Size pgsp_epoch_memsize(void);
+void pgsp_epoch_shmem_startup(void);
+void pgsp_epoch_register_callbacks(void);
+uint64 pgsp_epoch_start_planning(void);
+bool pgsp_epoch_valid(uint64 epoch, Oid dbid, Oid *rels, int num_rels,
+					  pgspRdependKey *rdeps, int num_rdeps);
+#endif
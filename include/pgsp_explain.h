@@ -0,0 +1,47 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_explain.h: Shared cache provenance of the plans shown by EXPLAIN.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_EXPLAIN_H
+#define _PGSP_EXPLAIN_H
+
+#include "postgres.h"
+
+#include "nodes/plannodes.h"
+#include "portability/instr_time.h"
+
+#include "include/pg_shared_plans.h"
+#include "include/pgsp_backend.h"
+
+#define PGSP_EXPLAIN_RECORDS	16	/* # of plans remembered per backend */
+
+/*
+ * Provenance of a plan returned by the planner hook.  Only kept in the
+ * backend's local memory.
+ */
+typedef struct pgspExplainRecord
+{
+	PlannedStmt *stmt;			/* returned plan, only used as an identifier */
+	pgspHashKey key;
+	pgspBackendLookup lookup;
+	bool		stored;			/* was the plan stored in the shared cache */
+	Cost		original_cost;	/* total cost before plancache adjustment */
+	Cost		cost;			/* total cost of the returned plan */
+	double		lookup_time;	/* time spent in the planner hook, in ms */
+} pgspExplainRecord;
+
+extern PGDLLIMPORT bool pgsp_explain_provenance;
+
+void pgsp_explain_install_hooks(void);
+void pgsp_explain_record(PlannedStmt *stmt, pgspHashKey *key,
+						 pgspBackendLookup lookup, bool stored,
+						 Cost original_cost, instr_time start);
+#endif
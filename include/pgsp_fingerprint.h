@@ -0,0 +1,25 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_fingerprint.h: Plan shape and query fingerprinting.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_FINGERPRINT_H
+#define _PGSP_FINGERPRINT_H
+
+#include "postgres.h"
+
+#include "nodes/parsenodes.h"
+#include "nodes/plannodes.h"
+
+uint64 pgsp_plan_fingerprint(PlannedStmt *stmt);
+uint64 pgsp_query_fingerprint(Query *query);
+void pgsp_fingerprint_remember(uint64 fingerprint);
+bool pgsp_fingerprint_is_builtin(uint64 queryid);
+#endif
@@ -0,0 +1,41 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_index.h: Open-addressing index of the pgsp_hash entries.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_INDEX_H
+#define _PGSP_INDEX_H
+
+#include "postgres.h"
+
+#include "include/pg_shared_plans.h"
+
+/*
+ * The index.  It's only modified holding an exclusive lock on pgsp->lock, so
+ * a shared lock is enough to look it up.  The hashes and entries are stored
+ * in separate arrays, so that probing only touches the hashes until one
+ * matches: a zero hash marks an empty bucket.
+ */
+typedef struct pgspIndex
+{
+	uint32		mask;			/* number of buckets - 1 */
+	uint32		num_entries;
+	uint32		hashes[FLEXIBLE_ARRAY_MEMBER];	/* followed by the entries */
+} pgspIndex;
+
+uint32 pgsp_index_num_buckets(void);
+Size pgsp_index_memsize(void);
+void pgsp_index_shmem_startup(void);
+pgspEntry *pgsp_index_lookup(const pgspHashKey *key, uint32 hashvalue);
+void pgsp_index_insert(pgspEntry *entry, uint32 hashvalue);
+void pgsp_index_delete(pgspEntry *entry);
+
+#define pgsp_index_hash(key)	pgsp_hash_fn((key), sizeof(pgspHashKey))
+#endif
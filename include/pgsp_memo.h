@@ -0,0 +1,73 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_memo.h: Memoized custom plans for repeated parameter values.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_MEMO_H
+#define _PGSP_MEMO_H
+
+#include "postgres.h"
+
+#include "nodes/params.h"
+#include "nodes/plannodes.h"
+#include "port/atomics.h"
+
+#include "include/pg_shared_plans.h"
+
+typedef enum pgspMemoKind
+{
+	PGSP_MEMO_PARAMS,			/* custom plan, keyed by the parameter values */
+	PGSP_MEMO_PARTITIONS,		/* generic plan restricted to some partitions,
+								   keyed by the partitions, see
+								   pgsp_partition.c */
+	PGSP_MEMO_SHAPE				/* plan for the parameter shape, keyed by the
+								   shape, see pgsp_shape.c */
+} pgspMemoKind;
+
+/*
+ * A plan generated for some bound parameter values.  Only the hits and
+ * last_used fields can be modified without an exclusive lock on pgsp->lock.
+ */
+typedef struct pgspMemoPlan
+{
+	pgspMemoKind kind;
+	uint64		params_hash;	/* hash of the parameters image */
+	size_t		params_len;
+	dsa_pointer params;			/* image of the bound parameters */
+	dsa_pointer plan;			/* pgspPlanBuffer of the plan */
+	Cost		cost;			/* total cost of the plan */
+	uint64		epoch;			/* see pgsp_epoch.c */
+	pg_atomic_uint64 hits;		/* # of times the plan was used */
+	pg_atomic_uint64 last_used;	/* memo clock value at last use */
+} pgspMemoPlan;
+
+/* Small LRU of memoized plans of an entry */
+typedef struct pgspMemo
+{
+	pg_atomic_uint64 clock;		/* bumped on each use of a memoized plan */
+	int			num_plans;
+	int			max_plans;
+	pgspMemoPlan plans[FLEXIBLE_ARRAY_MEMBER];
+} pgspMemo;
+
+#define PGSP_MEMO_SIZE(n)	(offsetof(pgspMemo, plans) + \
+							 sizeof(pgspMemoPlan) * (n))
+
+extern PGDLLIMPORT int pgsp_memo_size;
+
+char *pgsp_memo_params(ParamListInfo params, size_t *len, uint64 *hash);
+dsa_pointer pgsp_memo_lookup(pgspEntry *entry, pgspMemoKind kind,
+							 const char *params, size_t len, uint64 hash);
+bool pgsp_memo_valid(pgspEntry *entry, dsa_pointer plan);
+void pgsp_memo_remember(pgspHashKey *key, int64 discard, PlannedStmt *stmt,
+						pgspMemoKind kind, const char *params, size_t len,
+						uint64 hash, uint64 epoch);
+void pgsp_memo_reset(pgspEntry *entry);
+#endif
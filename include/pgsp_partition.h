@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_partition.h: Plans restricted to the partitions the parameters lead
+ *                   to.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_PARTITION_H
+#define _PGSP_PARTITION_H
+
+#include "postgres.h"
+
+#include "nodes/params.h"
+#include "nodes/parsenodes.h"
+
+#include "include/pg_shared_plans.h"
+
+extern PGDLLIMPORT bool pgsp_partition_plans;
+
+char *pgsp_partition_key(Query *parse, ParamListInfo params, size_t *len,
+						 uint64 *hash);
+void pgsp_partition_remember(pgspHashKey *key, int64 discard, Query *parse,
+							 const char *query_string, int cursorOptions,
+							 const char *partitions, size_t len, uint64 hash);
+#endif
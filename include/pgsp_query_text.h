@@ -0,0 +1,54 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_query_text.h: Storage of the normalized query text of cached plans.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_QUERY_TEXT_H
+#define _PGSP_QUERY_TEXT_H
+
+#include "postgres.h"
+
+#include "lib/dshash.h"
+#include "nodes/parsenodes.h"
+
+#include "include/pg_shared_plans.h"
+
+typedef struct pgspQueryTextKey
+{
+	Oid			dbid;
+	uint64		queryid;
+} pgspQueryTextKey;
+
+/*
+ * Normalized query text, shared by all the pgspEntry having the same dbid and
+ * queryid.  Only modified holding an exclusive lock on pgsp->lock.
+ */
+typedef struct pgspQueryTextEntry
+{
+	pgspQueryTextKey key;	/* hash key of the entry - MUST BE FIRST */
+	int			refcount;	/* # of pgspEntry using this text */
+	int			len;		/* length of the text, including trailing NUL */
+	int			stored_len;	/* size of the stored text */
+	bool		compressed;	/* is the stored text pglz compressed */
+	dsa_pointer text;
+} pgspQueryTextEntry;
+
+extern PGDLLIMPORT dshash_parameters pgsp_query_text_params;
+extern PGDLLIMPORT bool pgsp_compress_query_text;
+
+char *pgsp_query_text_normalize(Query *parse, const char *query_string);
+bool pgsp_query_text_acquire(Oid dbid, uint64 queryid, const char *text);
+void pgsp_query_text_release(Oid dbid, uint64 queryid);
+char *pgsp_query_text_get(Oid dbid, uint64 queryid);
+
+int pgsp_query_text_fn_compare(const void *a, const void *b, size_t size,
+							   void *arg);
+dshash_hash pgsp_query_text_fn_hash(const void *v, size_t size, void *arg);
+#endif
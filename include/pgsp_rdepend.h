@@ -35,26 +35,42 @@ typedef struct pgspRdependKey
 /*
  * Store a reverse depdendency (in pgsp_rdepend dshash), from a relation to a
  * pgsp_hash entry.
- * Note that you can't assume that the stored pgspHashKey will point to an
+ * Note that you can't assume that the stored pgspEntryRef will point to an
  * existing entry, as pgsp->lock can be released between a reverse dependency
  * creation and the pgspEntry insertion.  This should however be a transient
  * situation.
+ * The counters are only kept as long as the entry exists, i.e. as long as some
+ * pgspEntry depends on the object, and start from zero if it's created again.
+ * Keeping them for objects that aren't used anymore, possibly dropped, would
+ * make the dshash grow without bound.
  */
 typedef struct pgspRdependEntry
 {
 	pgspRdependKey key;		/* hash key of the entry - MUST BE FIRST */
 	int			num_keys;
 	int			max_keys;
-	dsa_pointer keys;		/* Hold an array of pgspHashKey */
+	dsa_pointer keys;		/* Hold an array of pgspEntryRef */
+	int64		discards;	/* # of plans discarded because of this object */
+	int64		evictions;	/* # of entries evicted because of this object */
+	int64		refused;	/* # of entries refused because of rdepend_max */
 } pgspRdependEntry;
 
 extern PGDLLIMPORT dshash_parameters pgsp_rdepend_params;
 extern PGDLLIMPORT int pgsp_rdepend_max;
 
 
-bool pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key);
-void pgsp_entry_unregister_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key);
+bool pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid,
+								 pgspEntryRef *ref);
+int pgsp_entry_register_rdepends(Oid dbid, Oid classid, const Oid *oids,
+								 int num, pgspEntryRef *ref);
+void pgsp_entry_unregister_rdepend(Oid dbid, Oid classid, Oid oid,
+								   pgspEntryRef *ref);
+void pgsp_entry_unregister_rdepends(Oid dbid, Oid classid, const Oid *oids,
+									int num, pgspEntryRef *ref);
+void pgsp_entry_retarget_rdepend(Oid dbid, Oid classid, Oid oid,
+								 pgspEntryRef *from, pgspEntryRef *to);
 
+int pgsp_rdepend_key_cmp(const void *a, const void *b);
 int pgsp_rdepend_fn_compare(const void *a, const void *b, size_t size,
 								   void *arg);
 dshash_hash pgsp_rdepend_fn_hash(const void *v, size_t size, void *arg);
@@ -0,0 +1,24 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_shape.h: Plans generated for a parameter shape.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_SHAPE_H
+#define _PGSP_SHAPE_H
+
+#include "postgres.h"
+
+#include "nodes/params.h"
+
+extern PGDLLIMPORT bool pgsp_shape_plans;
+
+char *pgsp_shape_key(ParamListInfo params, size_t *len, uint64 *hash);
+ParamListInfo pgsp_shape_bind(ParamListInfo params);
+#endif
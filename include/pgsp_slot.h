@@ -0,0 +1,51 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_slot.h: Stable slot indexes for the pgsp_hash entries.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_SLOT_H
+#define _PGSP_SLOT_H
+
+#include "postgres.h"
+
+#include "include/pg_shared_plans.h"
+
+#define PGSP_SLOT_NONE			PG_UINT32_MAX
+#define PGSP_NUM_SLOTS			((uint32) pgsp_max * 2)
+
+/*
+ * A slot of the table.  A slot is only reserved, attached to an entry or
+ * released holding an exclusive lock on pgsp->lock, so a shared lock is
+ * enough to read it.
+ */
+typedef struct pgspSlot
+{
+	pgspEntry  *entry;			/* NULL if free or not attached yet */
+	uint32		generation;		/* bumped each time the slot is released */
+	uint32		next_free;		/* next free slot, if free */
+} pgspSlot;
+
+typedef struct pgspSlots
+{
+	uint32		num_slots;
+	uint32		first_free;		/* head of the free list */
+	pgspSlot	slots[FLEXIBLE_ARRAY_MEMBER];
+} pgspSlots;
+
+Size pgsp_slot_memsize(void);
+void pgsp_slot_shmem_startup(void);
+bool pgsp_slot_reserve(pgspEntryRef *ref);
+void pgsp_slot_attach(pgspEntryRef *ref, pgspEntry *entry);
+void pgsp_slot_release(pgspEntryRef *ref);
+pgspEntry *pgsp_slot_get(pgspEntryRef *ref);
+
+#define pgsp_entry_ref_equal(a, b) \
+	((a)->slot == (b)->slot && (a)->generation == (b)->generation)
+#endif
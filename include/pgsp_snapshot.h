@@ -0,0 +1,75 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_snapshot.h: Periodic snapshots of the shared plan cache statistics.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_SNAPSHOT_H
+#define _PGSP_SNAPSHOT_H
+
+#include "postgres.h"
+
+#include "datatype/timestamp.h"
+#include "storage/lwlock.h"
+
+#include "include/pg_shared_plans.h"
+
+/*
+ * Cumulative counters are the sum of the counters of the entries present in
+ * the hash table and of the counters of the entries removed since the last
+ * reset, so that they never go backward because of evictions.
+ */
+typedef struct pgspSnapshot
+{
+	TimestampTz	ts;					/* time of the snapshot */
+	TimestampTz	stats_reset;		/* pgsp->stats_reset at that time */
+	int64		num_entries;		/* # of entries */
+	int64		num_plans;			/* # of entries having a plan */
+	int64		alloced_size;
+	int32		rdepend_num;
+	int64		dealloc;
+	int64		bypass;				/* cumulative */
+	int64		num_custom_plans;	/* cumulative */
+	int64		discard;			/* cumulative */
+	int			num_top;			/* # of valid per-entry records */
+} pgspSnapshot;
+
+/*
+ * Counters of one of the most used entries at the time of a snapshot, see
+ * pg_shared_plans.snapshot_entries.  The counters are the entry's own ones,
+ * so they start from zero again if the entry is evicted and created again.
+ */
+typedef struct pgspSnapshotEntry
+{
+	pgspHashKey key;
+	int64		bypass;
+	int64		num_custom_plans;
+	int64		discard;
+} pgspSnapshotEntry;
+
+typedef struct pgspSnapshotRing
+{
+	LWLock	   *lock;			/* protects all the following fields */
+	int			next;			/* next slot to write */
+	int			count;			/* # of valid snapshots */
+	pgspSnapshot snapshots[FLEXIBLE_ARRAY_MEMBER];
+	/* followed by snapshot_entries pgspSnapshotEntry per snapshot */
+} pgspSnapshotRing;
+
+extern PGDLLIMPORT int pgsp_snapshot_interval;
+extern PGDLLIMPORT int pgsp_snapshot_max;
+extern PGDLLIMPORT int pgsp_snapshot_entries;
+
+Size pgsp_snapshot_memsize(void);
+void pgsp_snapshot_shmem_startup(LWLock *lock);
+void pgsp_snapshot_register_worker(void);
+void pgsp_snapshot_take(void);
+
+PGDLLEXPORT void pgsp_snapshot_main(Datum main_arg);
+#endif
@@ -0,0 +1,57 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_trace.h: Recording and replay of shared plan cache accesses.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef _PGSP_TRACE_H
+#define _PGSP_TRACE_H
+
+#include "postgres.h"
+
+#include "pgstat.h"
+
+#include "include/pg_shared_plans.h"
+
+#define PGSP_TRACE_FILE			PG_STAT_TMP_DIR "/pg_shared_plans.trace"
+#define PGSP_TRACE_OLD_FILE		PGSP_TRACE_FILE ".1"
+#define PGSP_TRACE_VERSION		1
+
+typedef enum pgspTraceKind
+{
+	PGSP_TRACE_HIT,			/* shared plan returned */
+	PGSP_TRACE_MISS,		/* no usable entry, plan possibly stored */
+	PGSP_TRACE_CUSTOM		/* entry found but a custom plan was generated */
+} pgspTraceKind;
+
+/*
+ * A single access to the shared plan cache, as written in the trace file.
+ * The layout is fixed size so that the file can be read back without any
+ * framing.
+ */
+typedef struct pgspTraceRecord
+{
+	TimestampTz	ts;			/* time of the access */
+	uint64		queryid;
+	Oid			userid;
+	Oid			dbid;
+	uint32		constid;
+	uint32		len;		/* serialized plan length, 0 if unknown */
+	double		plantime;	/* planning time spent or saved, in ms */
+	uint8		version;	/* PGSP_TRACE_VERSION */
+	uint8		kind;		/* a pgspTraceKind */
+} pgspTraceRecord;
+
+extern PGDLLIMPORT bool pgsp_trace_enabled;
+extern PGDLLIMPORT int pgsp_trace_size;
+
+void pgsp_trace_shmem_startup(void);
+void pgsp_trace_record(pgspHashKey *key, pgspTraceKind kind, size_t len,
+					   double plantime);
+#endif
@@ -11,6 +11,8 @@ CREATE FUNCTION pg_shared_plans_info(
     OUT rdepend_num int,
     OUT alloced_size bigint,
     OUT dealloc bigint,
+    OUT rdepend_refused bigint,
+    OUT plantime_rejected bigint,
     OUT stats_reset timestamp with time zone
 )
 RETURNS record
@@ -51,6 +53,16 @@ CREATE FUNCTION pg_shared_plans(IN showplan boolean DEFAULT false,
     OUT num_rdeps integer,
     OUT discard bigint,
     OUT lockers integer,
+    OUT shadow_hits bigint,
+    OUT shadow_time_saved float8,
+    OUT shadow_cost_diff float8,
+    OUT fingerprint bigint,
+    OUT created_at timestamptz,
+    OUT last_hit_at timestamptz,
+    OUT last_discard_at timestamptz,
+    OUT last_replanned_at timestamptz,
+    OUT hit_rate float8,
+    OUT query text,
     OUT relations oid[],
     OUT plan text)
 RETURNS SETOF record
@@ -58,7 +70,7 @@ AS 'MODULE_PATHNAME', 'pg_shared_plans'
 LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
 
 CREATE VIEW pg_shared_plans AS
-  SELECT DISTINCT
+  SELECT
     r.rolname,
     d.datname,
     pgsp.queryid,
@@ -74,8 +86,390 @@ CREATE VIEW pg_shared_plans AS
     pgsp.num_rdeps,
     pgsp.discard,
     pgsp.lockers,
+    pgsp.shadow_hits,
+    pgsp.shadow_time_saved,
+    pgsp.shadow_cost_diff / NULLIF(pgsp.shadow_hits, 0) AS avg_shadow_cost_diff,
+    pgsp.fingerprint,
+    pgsp.created_at,
+    pgsp.last_hit_at,
+    pgsp.last_discard_at,
+    pgsp.last_replanned_at,
+    pgsp.hit_rate,
+    pgsp.query
   FROM pg_shared_plans(false, false) AS pgsp
   LEFT JOIN pg_roles AS r ON r.oid = pgsp.userid
   LEFT JOIN pg_database AS d ON d.oid = pgsp.dbid;
 
 GRANT SELECT ON pg_shared_plans TO pg_read_all_stats;
+
+CREATE VIEW pg_shared_plans_relations AS
+  SELECT
+    r.rolname,
+    d.datname,
+    pgsp.queryid,
+    pgsp.constid,
+    pgsp.numconst,
+    pgsp.bypass,
+    pg_size_pretty(pgsp.size) AS size,
+    pgsp.plantime,
+    pgsp.total_custom_cost / num_custom_plans AS avg_custom_cost,
+    pgsp.num_custom_plans,
+    pgsp.generic_cost,
+    pgsp.num_relations,
+    pgsp.num_rdeps,
+    pgsp.discard,
+    pgsp.lockers,
+    pgsp.shadow_hits,
+    pgsp.shadow_time_saved,
+    pgsp.shadow_cost_diff / NULLIF(pgsp.shadow_hits, 0) AS avg_shadow_cost_diff,
+    pgsp.fingerprint,
+    pgsp.created_at,
+    pgsp.last_hit_at,
+    pgsp.last_discard_at,
+    pgsp.last_replanned_at,
+    pgsp.hit_rate,
+    pgsp.query,
+    pgsp.relations
+  FROM pg_shared_plans(true, false) AS pgsp
+  LEFT JOIN pg_roles AS r ON r.oid = pgsp.userid
+  LEFT JOIN pg_database AS d ON d.oid = pgsp.dbid;
+
+GRANT SELECT ON pg_shared_plans_relations TO pg_read_all_stats;
+
+CREATE VIEW pg_shared_plans_explain AS
+  SELECT
+    r.rolname,
+    d.datname,
+    pgsp.queryid,
+    pgsp.constid,
+    pgsp.numconst,
+    pgsp.bypass,
+    pg_size_pretty(pgsp.size) AS size,
+    pgsp.plantime,
+    pgsp.total_custom_cost / num_custom_plans AS avg_custom_cost,
+    pgsp.num_custom_plans,
+    pgsp.generic_cost,
+    pgsp.num_relations,
+    pgsp.num_rdeps,
+    pgsp.discard,
+    pgsp.lockers,
+    pgsp.shadow_hits,
+    pgsp.shadow_time_saved,
+    pgsp.shadow_cost_diff / NULLIF(pgsp.shadow_hits, 0) AS avg_shadow_cost_diff,
+    pgsp.fingerprint,
+    pgsp.created_at,
+    pgsp.last_hit_at,
+    pgsp.last_discard_at,
+    pgsp.last_replanned_at,
+    pgsp.hit_rate,
+    pgsp.query,
+    pgsp.plan
+  FROM pg_shared_plans(false, true) AS pgsp
+  LEFT JOIN pg_roles AS r ON r.oid = pgsp.userid
+  LEFT JOIN pg_database AS d ON d.oid = pgsp.dbid;
+
+GRANT SELECT ON pg_shared_plans_explain TO pg_read_all_stats;
+
+CREATE VIEW pg_shared_plans_all AS
+  SELECT
+    r.rolname,
+    d.datname,
+    pgsp.queryid,
+    pgsp.constid,
+    pgsp.numconst,
+    pgsp.bypass,
+    pg_size_pretty(pgsp.size) AS size,
+    pgsp.plantime,
+    pgsp.total_custom_cost / num_custom_plans AS avg_custom_cost,
+    pgsp.num_custom_plans,
+    pgsp.generic_cost,
+    pgsp.num_relations,
+    pgsp.num_rdeps,
+    pgsp.discard,
+    pgsp.lockers,
+    pgsp.shadow_hits,
+    pgsp.shadow_time_saved,
+    pgsp.shadow_cost_diff / NULLIF(pgsp.shadow_hits, 0) AS avg_shadow_cost_diff,
+    pgsp.fingerprint,
+    pgsp.created_at,
+    pgsp.last_hit_at,
+    pgsp.last_discard_at,
+    pgsp.last_replanned_at,
+    pgsp.hit_rate,
+    pgsp.query,
+    pgsp.relations,
+    pgsp.plan
+  FROM pg_shared_plans(true, true) AS pgsp
+  LEFT JOIN pg_roles AS r ON r.oid = pgsp.userid
+  LEFT JOIN pg_database AS d ON d.oid = pgsp.dbid;
+
+GRANT SELECT ON pg_shared_plans_all TO pg_read_all_stats;
+
+CREATE FUNCTION pg_shared_plans_simulate(IN capacities integer[] DEFAULT '{}',
+    IN filename text DEFAULT '',
+    OUT policy text,
+    OUT capacity integer,
+    OUT accesses bigint,
+    OUT hits bigint,
+    OUT hit_ratio float8,
+    OUT evictions bigint,
+    OUT plantime_saved float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_shared_plans_simulate'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+-- Don't want this to be available to non-superusers.
+REVOKE ALL ON FUNCTION pg_shared_plans_simulate(integer[], text) FROM PUBLIC;
+
+CREATE FUNCTION pg_shared_plans_trace_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_shared_plans_trace_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+-- Don't want this to be available to non-superusers.
+REVOKE ALL ON FUNCTION pg_shared_plans_trace_reset() FROM PUBLIC;
+
+CREATE FUNCTION pg_shared_plans_snapshots(
+    OUT ts timestamptz,
+    OUT stats_reset timestamptz,
+    OUT num_entries bigint,
+    OUT num_plans bigint,
+    OUT alloced_size bigint,
+    OUT rdepend_num integer,
+    OUT dealloc bigint,
+    OUT bypass bigint,
+    OUT num_custom_plans bigint,
+    OUT discard bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_shared_plans_snapshots'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Activity between the first and the last snapshots taken in the given
+-- interval.  If the statistics were reset in between, the counters of the
+-- last snapshot are used as is.
+CREATE FUNCTION pg_shared_plans_snapshots_delta(IN since timestamptz,
+    IN until timestamptz DEFAULT now(),
+    OUT first_ts timestamptz,
+    OUT last_ts timestamptz,
+    OUT num_entries bigint,
+    OUT num_plans bigint,
+    OUT alloced_size bigint,
+    OUT rdepend_num integer,
+    OUT dealloc bigint,
+    OUT bypass bigint,
+    OUT num_custom_plans bigint,
+    OUT discard bigint,
+    OUT hit_ratio float8)
+RETURNS SETOF record
+AS $$
+  WITH s AS (
+    SELECT * FROM pg_shared_plans_snapshots()
+    WHERE ts >= since AND ts <= until
+  ), f AS (
+    SELECT * FROM s ORDER BY ts LIMIT 1
+  ), l AS (
+    SELECT * FROM s ORDER BY ts DESC LIMIT 1
+  ), d AS (
+    SELECT f.ts AS first_ts, l.ts AS last_ts,
+      l.num_entries, l.num_plans, l.alloced_size, l.rdepend_num,
+      CASE WHEN l.stats_reset IS NOT DISTINCT FROM f.stats_reset
+        THEN l.dealloc - f.dealloc ELSE l.dealloc END AS dealloc,
+      CASE WHEN l.stats_reset IS NOT DISTINCT FROM f.stats_reset
+        THEN l.bypass - f.bypass ELSE l.bypass END AS bypass,
+      CASE WHEN l.stats_reset IS NOT DISTINCT FROM f.stats_reset
+        THEN l.num_custom_plans - f.num_custom_plans
+        ELSE l.num_custom_plans END AS num_custom_plans,
+      CASE WHEN l.stats_reset IS NOT DISTINCT FROM f.stats_reset
+        THEN l.discard - f.discard ELSE l.discard END AS discard
+    FROM f, l
+  )
+  SELECT d.*,
+    CASE WHEN d.bypass + d.num_custom_plans > 0
+      THEN d.bypass::float8 / (d.bypass + d.num_custom_plans)
+    END AS hit_ratio
+  FROM d;
+$$ LANGUAGE sql STABLE PARALLEL SAFE;
+
+CREATE FUNCTION pg_shared_plans_snapshots_entries(
+    OUT ts timestamptz,
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT constid integer,
+    OUT bypass bigint,
+    OUT num_custom_plans bigint,
+    OUT discard bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_shared_plans_snapshots_entries'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Activity of the entries kept in the last snapshot taken in the given
+-- interval, since the first snapshot taken in that interval.  If the entry
+-- wasn't kept in the first snapshot, or if its counters went backward because
+-- it was evicted and created again or because the statistics were reset, the
+-- counters of the last snapshot are used as is.
+CREATE FUNCTION pg_shared_plans_snapshots_entries_delta(IN since timestamptz,
+    IN until timestamptz DEFAULT now(),
+    OUT first_ts timestamptz,
+    OUT last_ts timestamptz,
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT constid integer,
+    OUT bypass bigint,
+    OUT num_custom_plans bigint,
+    OUT discard bigint)
+RETURNS SETOF record
+AS $$
+  WITH s AS (
+    SELECT * FROM pg_shared_plans_snapshots_entries()
+    WHERE ts >= since AND ts <= until
+  ), g AS (
+    SELECT * FROM pg_shared_plans_snapshots()
+    WHERE ts >= since AND ts <= until
+  ), t AS (
+    SELECT f.ts AS first_ts, l.ts AS last_ts,
+      l.stats_reset IS DISTINCT FROM f.stats_reset AS reset
+    FROM (SELECT * FROM g ORDER BY ts LIMIT 1) f,
+      (SELECT * FROM g ORDER BY ts DESC LIMIT 1) l
+  ), d AS (
+    SELECT t.first_ts, t.last_ts, l.userid, l.dbid, l.queryid, l.constid,
+      l.bypass, l.num_custom_plans, l.discard,
+      t.reset OR f.ts IS NULL OR l.bypass < f.bypass
+        OR l.num_custom_plans < f.num_custom_plans
+        OR l.discard < f.discard AS restart,
+      f.bypass AS f_bypass, f.num_custom_plans AS f_num_custom_plans,
+      f.discard AS f_discard
+    FROM t
+    JOIN s l ON l.ts = t.last_ts
+    LEFT JOIN s f ON f.ts = t.first_ts AND f.userid = l.userid
+      AND f.dbid = l.dbid AND f.queryid = l.queryid AND f.constid = l.constid
+  )
+  SELECT first_ts, last_ts, userid, dbid, queryid, constid,
+    CASE WHEN restart THEN bypass ELSE bypass - f_bypass END AS bypass,
+    CASE WHEN restart THEN num_custom_plans
+      ELSE num_custom_plans - f_num_custom_plans END AS num_custom_plans,
+    CASE WHEN restart THEN discard ELSE discard - f_discard END AS discard
+  FROM d;
+$$ LANGUAGE sql STABLE PARALLEL SAFE;
+
+CREATE FUNCTION pg_shared_plans_snapshot_take()
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_shared_plans_snapshot_take'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+-- Don't want this to be available to non-superusers.
+REVOKE ALL ON FUNCTION pg_shared_plans_snapshot_take() FROM PUBLIC;
+
+CREATE FUNCTION pg_shared_plans_advise(
+    OUT parameter text,
+    OUT setting text,
+    OUT recommended text,
+    OUT reason text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_shared_plans_advise'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION pg_shared_plans_whatif(IN settings text[],
+    OUT userid oid,
+    OUT queryid bigint,
+    OUT constid integer,
+    OUT cost float8,
+    OUT whatif_cost float8,
+    OUT cost_diff float8,
+    OUT plan_changed boolean)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_shared_plans_whatif'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+-- Don't want this to be available to non-superusers.
+REVOKE ALL ON FUNCTION pg_shared_plans_whatif(text[]) FROM PUBLIC;
+
+CREATE FUNCTION pg_shared_plans_memory(
+    OUT dbid oid,
+    OUT component text,
+    OUT num bigint,
+    OUT bytes bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_shared_plans_memory'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION pg_shared_plans_rdepends(
+    OUT dbid oid,
+    OUT classid oid,
+    OUT objid oid,
+    OUT hashvalue bigint,
+    OUT num_keys integer,
+    OUT max_keys integer,
+    OUT bytes bigint,
+    OUT discards bigint,
+    OUT evictions bigint,
+    OUT refused bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_shared_plans_rdepends'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION pg_shared_plans_plan_changes(
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT constid integer,
+    OUT fingerprint bigint,
+    OUT generic_cost float8,
+    OUT ts timestamptz,
+    OUT reason text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_shared_plans_plan_changes'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION pg_shared_plans_backends(
+    OUT pid integer,
+    OUT lookups bigint,
+    OUT hits bigint,
+    OUT misses bigint,
+    OUT stores bigint,
+    OUT validation_failures bigint,
+    OUT hook_time float8,
+    OUT bytes_deserialized bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_shared_plans_backends'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION pg_shared_plans_provenance(
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT constid integer,
+    OUT lookup text,
+    OUT stored boolean,
+    OUT original_cost float8,
+    OUT cost float8,
+    OUT lookup_time float8,
+    OUT n integer)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_shared_plans_provenance'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION pg_shared_plans_churn(
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT distinct_constids bigint,
+    OUT entries integer,
+    OUT refused bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_shared_plans_churn'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION pg_shared_plans_memo(
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT constid integer,
+    OUT kind text,
+    OUT params_hash bigint,
+    OUT len bigint,
+    OUT cost float8,
+    OUT hits bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_shared_plans_memo'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
@@ -13,8 +13,12 @@
 
 #include "postgres.h"
 
+#include <float.h>
+#include <math.h>
+
 #include "access/parallel.h"
 #include "access/relation.h"
+#include "access/xact.h"
 #if PG_VERSION_NUM >= 160000
 #include "catalog/pg_proc.h"
 #endif
@@ -29,6 +33,7 @@
 #endif
 #include "optimizer/optimizer.h"
 #include "optimizer/planner.h"
+#include "parser/analyze.h"
 #include "pgstat.h"
 #include "storage/ipc.h"
 #include "storage/proc.h"
@@ -52,8 +57,21 @@
 #endif
 
 #include "include/pg_shared_plans.h"
+#include "include/pgsp_backend.h"
+#include "include/pgsp_churn.h"
+#include "include/pgsp_epoch.h"
+#include "include/pgsp_explain.h"
+#include "include/pgsp_fingerprint.h"
 #include "include/pgsp_import.h"
+#include "include/pgsp_index.h"
+#include "include/pgsp_memo.h"
+#include "include/pgsp_partition.h"
+#include "include/pgsp_query_text.h"
 #include "include/pgsp_rdepend.h"
+#include "include/pgsp_shape.h"
+#include "include/pgsp_slot.h"
+#include "include/pgsp_snapshot.h"
+#include "include/pgsp_trace.h"
 #include "include/pgsp_utility.h"
 
 #if PG_VERSION_NUM < 170000
@@ -63,12 +81,8 @@
 PG_MODULE_MAGIC;
 
 #define PGSP_TRANCHE_NAME		"pg_shared_plans"
-#define PGSP_USAGE_INIT			(1.0)
+#define PGSP_NUM_LOCKS			2		/* main lock and snapshot lock */
 #define ASSUMED_MEDIAN_INIT		(10.0)	/* initial assumed median usage */
-#define USAGE_DECREASE_FACTOR	(0.99)	/* decreased every entry_dealloc */
-#define USAGE_DEALLOC_PERCENT	5		/* free this % of entries at once */
-
-#define PLANCACHE_THRESHOLD		5
 
 #define PGSP_USEDSMEM(size) {												\
 	volatile pgspSharedState *s = (volatile pgspSharedState *) pgsp;		\
@@ -95,6 +109,18 @@ PG_MODULE_MAGIC;
 		where->sizefield = 0;												\
 }
 
+/*
+ * Release the reference that the entry or context holds on its plan buffer.
+ * The buffer is only freed once no other backend has it pinned, see
+ * pgsp_plan_unpin().
+ */
+#define PGSP_RELEASEPLAN(where) {											\
+	Assert(where->plan != InvalidDsaPointer);								\
+		pgsp_plan_unpin(where->plan);										\
+		where->plan = InvalidDsaPointer;									\
+		where->len = 0;														\
+}
+
 #define PGSP_TRANSFER(entry,context,field,counter) {						\
 	entry->field = context->field;											\
 	context->field = InvalidDsaPointer;										\
@@ -111,6 +137,10 @@ typedef struct pgspDsaContext
 	size_t			len;
 	int				num_rels;
 	dsa_pointer		rdeps;
+	dsa_pointer		query;
+	size_t			query_len;
+	uint64			epoch;
+	pgspEntryRef	ref;		/* slot reserved for the entry */
 } pgspDsaContext;
 
 typedef struct pgspWalkerContext
@@ -128,6 +158,7 @@ static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static shmem_request_hook_type prev_shmem_request_hook = NULL;
 #endif
 static planner_hook_type prev_planner_hook = NULL;
+static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
 static ProcessUtility_hook_type prev_ProcessUtility = NULL;
 
 /* Links to shared memory state */
@@ -135,19 +166,25 @@ pgspSharedState *pgsp = NULL;
 HTAB *pgsp_hash = NULL;
 dsa_area *pgsp_area = NULL;
 dshash_table *pgsp_rdepend = NULL;
+dshash_table *pgsp_query_text = NULL;
 
 /*---- GUC variables ----*/
 
+static bool pgsp_builtin_fingerprint;
 #ifdef USE_ASSERT_CHECKING
 static bool pgsp_cache_all;
 #endif
 static bool pgsp_disable_plancache;
 static bool pgsp_enabled;
-static int	pgsp_max;
-static int	pgsp_min_plantime;
+int			pgsp_max;
+int			pgsp_min_plantime;
+int			pgsp_plan_cost_mode;
+double		pgsp_plantime_cost;
 extern int	pgsp_rdepend_max;
 static bool	pgsp_ro;
-static int	pgsp_threshold;
+static bool	pgsp_shadow;
+bool		pgsp_store_query;
+int			pgsp_threshold;
 static bool pgsp_es_costs;
 static int	pgsp_es_format;
 static bool pgsp_es_verbose;
@@ -163,11 +200,26 @@ static const struct config_enum_entry pgsp_explain_format_options[] =
 	{NULL, 0, false},
 };
 
+static const struct config_enum_entry pgsp_plan_cost_mode_options[] =
+{
+	{"estimated", PGSP_PLAN_COST_ESTIMATED, false},
+	{"measured", PGSP_PLAN_COST_MEASURED, false},
+	{NULL, 0, false},
+};
+
+static const struct config_enum_entry pgsp_validation_options[] =
+{
+	{"eager", PGSP_VALIDATION_EAGER, false},
+	{"lazy", PGSP_VALIDATION_LAZY, false},
+	{NULL, 0, false},
+};
+
 /*---- Function declarations ----*/
 
 PGDLLEXPORT void _PG_init(void);
 
 PG_FUNCTION_INFO_V1(pg_shared_plans_reset);
+PG_FUNCTION_INFO_V1(pg_shared_plans_plan_changes);
 PG_FUNCTION_INFO_V1(pg_shared_plans_info);
 PG_FUNCTION_INFO_V1(pg_shared_plans);
 
@@ -175,6 +227,12 @@ PG_FUNCTION_INFO_V1(pg_shared_plans);
 static void pgsp_shmem_request(void);
 #endif
 static void pgsp_shmem_startup(void);
+#if PG_VERSION_NUM >= 140000
+static void pgsp_post_parse_analyze(ParseState *pstate, Query *query,
+									JumbleState *jstate);
+#else
+static void pgsp_post_parse_analyze(ParseState *pstate, Query *query);
+#endif
 static PlannedStmt *pgsp_planner_hook(Query *parse,
 #if PG_VERSION_NUM >= 130000
 									  const char *query_string,
@@ -196,24 +254,36 @@ static void pgsp_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 #endif
 								);
 
-static void pgsp_attach_dsa(void);
 static void pg_shared_plans_reset_internal(Oid userid, Oid dbid, uint64 queryid);
 
-static void pgsp_accum_custom_plan(pgspHashKey *key, Cost cost);
+static void pgsp_accum_custom_plan(pgspHashKey *key, uint32 hashvalue,
+								   PlannedStmt *custom, double plantime);
+static void pgsp_accum_shadow_hit(pgspHashKey *key, uint32 hashvalue,
+								  double plantime, Cost custom_cost);
 static void pgsp_acquire_executor_locks(PlannedStmt *plannedstmt, bool acquire);
 static bool pgsp_allocate_plan(Query *parse, PlannedStmt *stmt,
-							   pgspDsaContext *context, pgspHashKey *key);
+							   pgspDsaContext *context);
+static void pgsp_allocate_query(Query *parse, pgspDsaContext *context);
 static bool pgsp_choose_cache_plan(pgspEntry *entry, bool *accum_custom_stats);
 static const char *pgsp_get_plan(dsa_pointer plan);
-static void pgsp_cache_plan(Query *parse, PlannedStmt *custom,
-		PlannedStmt *generic, pgspHashKey *key, double plantime, int num_const);
+static size_t pgsp_cache_plan(Query *parse, const char *query_string,
+							  PlannedStmt *custom,
+		PlannedStmt *generic, pgspHashKey *key, uint32 hashvalue,
+		double plantime, int num_const, uint64 epoch);
 static Size pgsp_memsize(void);
-static pgspEntry *pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context,
-		double plantime, int num_const, Cost custom_cost, Cost generic_cost);
+static double pgsp_hit_rate_decay(TimestampTz last_hit_at, TimestampTz now);
+static void pgsp_entry_add_history(pgspEntry *entry,
+								   pgspPlanChangeReason reason);
+static pgspEntry *pgsp_entry_alloc(pgspHashKey *key, uint32 hashvalue,
+		pgspDsaContext *context, double plantime, int num_const,
+		Cost custom_cost, Cost custom_exec_cost, Cost generic_cost,
+		uint64 fingerprint, const char *query_text);
 static void pgsp_entry_dealloc(void);
+static void pgsp_entry_record_hit_time(pgspEntry *entry, instr_time start);
 static void pgsp_entry_remove(pgspEntry *entry);
 static bool pgsp_query_walker(Node *node, pgspWalkerContext *context);
 static int entry_cmp(const void *lhs, const void *rhs);
+static int pgsp_sort_oids(Oid *oids, int num);
 static Datum do_showrels(dsa_pointer rels, int num_rels);
 static char *do_showplans(dsa_pointer plan);
 
@@ -229,6 +299,17 @@ dshash_parameters pgsp_rdepend_params = {
 	-1, /* will be set at inittime */
 };
 
+dshash_parameters pgsp_query_text_params = {
+	sizeof(pgspQueryTextKey),
+	sizeof(pgspQueryTextEntry),
+	pgsp_query_text_fn_compare,
+	pgsp_query_text_fn_hash,
+#if PG_VERSION_NUM >= 170000
+	dshash_memcpy,
+#endif
+	-1, /* will be set at inittime */
+};
+
 /*
  * Module load callback
  */
@@ -241,17 +322,20 @@ _PG_init(void)
 		return;
 	}
 
-#if PG_VERSION_NUM >= 140000
-	/*
-	 * Inform the postmaster that we want to enable query_id calculation if
-	 * compute_query_id is set to auto.
-	 */
-	EnableQueryId();
-#endif
-
 	/*
 	 * Define (or redefine) custom GUC variables.
 	 */
+	DefineCustomBoolVariable("pg_shared_plans.builtin_fingerprint",
+							 "Compute a fingerprint of the queries if no query identifier is computed.",
+							 NULL,
+							 &pgsp_builtin_fingerprint,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 #ifdef USE_ASSERT_CHECKING
 	DefineCustomBoolVariable("pg_shared_plans.cache_regular_statements",
 							 "Enable or disable caching of regular statements.",
@@ -293,13 +377,39 @@ _PG_init(void)
 							&pgsp_max,
 							100,
 							5,
-							INT_MAX,
+							PGSP_MAX_ENTRIES,
 							PGC_POSTMASTER,
 							0,
 							NULL,
 							NULL,
 							NULL);
 
+	DefineCustomIntVariable("pg_shared_plans.max_entries_per_query",
+							"Sets the maximum number of entries cached for a single query identifier.",
+							"Zero means no limit.",
+							&pgsp_max_entries_per_query,
+							0,
+							0,
+							INT_MAX,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_shared_plans.memo_size",
+							"Sets the maximum number of custom plans memoized per entry.",
+							"Zero disables the memoization of custom plans.",
+							&pgsp_memo_size,
+							0,
+							0,
+							64,
+							PGC_SUSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomIntVariable("pg_shared_plans.min_plan_time",
 							"Sets the minimum planning time to save an entry (in ms).",
 							NULL,
@@ -313,6 +423,54 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomBoolVariable("pg_shared_plans.compress_query_text",
+							 "Compress the stored query texts.",
+							 NULL,
+							 &pgsp_compress_query_text,
+							 true,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_shared_plans.partition_plans",
+							 "Memoize generic plans restricted to the partitions the parameters lead to.",
+							 "Requires pg_shared_plans.memo_size to be greater than zero.",
+							 &pgsp_partition_plans,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_shared_plans.plan_cost_mode",
+							 "Sets how the planning effort is accounted when choosing between the shared plan and a custom plan.",
+							 "estimated uses plancache's estimate based on the number of relations, "
+							 "measured uses the measured planning and hit times.",
+							 &pgsp_plan_cost_mode,
+							 PGSP_PLAN_COST_ESTIMATED,
+							 pgsp_plan_cost_mode_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_shared_plans.plantime_cost",
+							 "Sets the planner's estimate of the cost of a millisecond of planning or hit time.",
+							 "Only used with measured plan_cost_mode.",
+							 &pgsp_plantime_cost,
+							 100.0,
+							 0.0,
+							 DBL_MAX,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomBoolVariable("pg_shared_plans.read_only",
 							 "Should pg_shared_plans cache new plans.",
 							 NULL,
@@ -324,6 +482,39 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomBoolVariable("pg_shared_plans.shadow",
+							 "Only track the shared plans that would be used, without using them.",
+							 NULL,
+							 &pgsp_shadow,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_shared_plans.shape_plans",
+							 "Memoize plans generated for the shape of the parameters rather than custom plans.",
+							 "Requires pg_shared_plans.memo_size to be greater than zero.",
+							 &pgsp_shape_plans,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_shared_plans.store_query",
+							 "Also store the query tree of the cached entries.",
+							 NULL,
+							 &pgsp_store_query,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomIntVariable("pg_shared_plans.threshold",
 							"Minimum number of custom plans to generate before maybe choosing cached plans.",
 							NULL,
@@ -350,6 +541,69 @@ _PG_init(void)
 							pgsp_assign_rdepend_max,
 							NULL);
 
+	DefineCustomIntVariable("pg_shared_plans.snapshot_interval",
+							"Sets the interval between two snapshots of the statistics.",
+							NULL,
+							&pgsp_snapshot_interval,
+							60,
+							1,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_shared_plans.snapshot_max",
+							"Sets the maximum number of snapshots of the statistics kept.",
+							NULL,
+							&pgsp_snapshot_max,
+							1440,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_shared_plans.snapshot_entries",
+							"Sets the number of most used entries kept in each snapshot.",
+							NULL,
+							&pgsp_snapshot_entries,
+							10,
+							0,
+							1000,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_shared_plans.trace",
+							 "Record accesses to the shared plan cache in a trace file.",
+							 NULL,
+							 &pgsp_trace_enabled,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_shared_plans.trace_size",
+							"Sets the size of the trace file before it's rotated.",
+							NULL,
+							&pgsp_trace_size,
+							10240,
+							1024,
+							INT_MAX / 1024,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomBoolVariable("pg_shared_plans.explain_costs",
 							 "Display plans with COST option.",
 							 NULL,
@@ -362,6 +616,30 @@ _PG_init(void)
 							 NULL);
 
 
+	DefineCustomBoolVariable("pg_shared_plans.explain_provenance",
+							 "Show the shared cache provenance of the plans in EXPLAIN output.",
+							 "Only available starting with PostgreSQL 18.",
+							 &pgsp_explain_provenance,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_shared_plans.validation",
+							 "Sets how the cached plans are invalidated.",
+							 "eager discards the dependent plans when executing DDL, "
+							 "lazy checks the dependencies when using a plan.",
+							 &pgsp_validation,
+							 PGSP_VALIDATION_EAGER,
+							 pgsp_validation_options,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomEnumVariable("pg_shared_plans.explain_format",
 							 "Display plans with FORMAT option.",
 							 NULL,
@@ -394,9 +672,21 @@ _PG_init(void)
 	 * resources in pgsp_shmem_startup().
 	 */
 	RequestAddinShmemSpace(pgsp_memsize());
-	RequestNamedLWLockTranche(PGSP_TRANCHE_NAME, 1);
+	RequestNamedLWLockTranche(PGSP_TRANCHE_NAME, PGSP_NUM_LOCKS);
+#endif
+
+#if PG_VERSION_NUM >= 140000
+	/*
+	 * Inform the postmaster that we want to enable query_id calculation if
+	 * compute_query_id is set to auto, unless we compute our own fingerprint.
+	 */
+	if (!pgsp_builtin_fingerprint)
+		EnableQueryId();
 #endif
 
+	/* Start the snapshot background worker if needed. */
+	pgsp_snapshot_register_worker();
+
 	/* Install hooks */
 #if PG_VERSION_NUM >= 150000
 	prev_shmem_request_hook = shmem_request_hook;
@@ -404,10 +694,16 @@ _PG_init(void)
 #endif
 	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = pgsp_shmem_startup;
+	prev_post_parse_analyze_hook = post_parse_analyze_hook;
+	post_parse_analyze_hook = pgsp_post_parse_analyze;
 	prev_planner_hook = planner_hook;
 	planner_hook = pgsp_planner_hook;
 	prev_ProcessUtility = ProcessUtility_hook;
 	ProcessUtility_hook = pgsp_ProcessUtility;
+	pgsp_explain_install_hooks();
+
+	/* Register the invalidation callbacks if needed. */
+	pgsp_epoch_register_callbacks();
 }
 
 static void
@@ -427,7 +723,7 @@ pgsp_shmem_request(void)
 		prev_shmem_request_hook();
 
 	RequestAddinShmemSpace(pgsp_memsize());
-	RequestNamedLWLockTranche(PGSP_TRANCHE_NAME, 1);
+	RequestNamedLWLockTranche(PGSP_TRANCHE_NAME, PGSP_NUM_LOCKS);
 }
 #endif
 
@@ -456,6 +752,14 @@ pgsp_shmem_startup(void)
 						   sizeof(pgspSharedState),
 						   &found);
 
+	pgsp_snapshot_shmem_startup(
+			&(GetNamedLWLockTranche(PGSP_TRANCHE_NAME))[1].lock);
+	pgsp_backend_shmem_startup();
+	pgsp_churn_shmem_startup();
+	pgsp_epoch_shmem_startup();
+	pgsp_index_shmem_startup();
+	pgsp_slot_shmem_startup();
+
 	if (!found)
 	{
 		int			trancheid;
@@ -465,10 +769,12 @@ pgsp_shmem_startup(void)
 		pgsp->lock = &(GetNamedLWLockTranche(PGSP_TRANCHE_NAME))->lock;
 		pgsp->pgsp_dsa_handle = DSM_HANDLE_INVALID;
 		pgsp->pgsp_rdepend_handle = InvalidDsaPointer;
+		pgsp->pgsp_query_text_handle = InvalidDsaPointer;
 		pgsp->cur_median_usage = ASSUMED_MEDIAN_INIT;
 		pgsp->rdepend_num = 0;
 		pgsp->alloced_size = 0;
 		SpinLockInit(&pgsp->mutex);
+		pg_atomic_init_u64(&pgsp->plantime_rejected, 0);
 
 		/* try to guess our trancheid */
 		for (trancheid = LWTRANCHE_FIRST_USER_DEFINED; ; trancheid++)
@@ -489,6 +795,7 @@ pgsp_shmem_startup(void)
 		Assert(trancheid >= LWTRANCHE_FIRST_USER_DEFINED);
 		pgsp->LWTRANCHE_PGSP = trancheid;
 
+		pgsp_trace_shmem_startup();
 	}
 
 	info.keysize = sizeof(pgspHashKey);
@@ -503,6 +810,36 @@ pgsp_shmem_startup(void)
 	LWLockRelease(AddinShmemInitLock);
 }
 
+/*
+ * Post-parse-analysis hook: compute the builtin fingerprint of the query if
+ * nothing computed a query identifier.
+ */
+static void
+#if PG_VERSION_NUM >= 140000
+pgsp_post_parse_analyze(ParseState *pstate, Query *query, JumbleState *jstate)
+#else
+pgsp_post_parse_analyze(ParseState *pstate, Query *query)
+#endif
+{
+	if (prev_post_parse_analyze_hook)
+		prev_post_parse_analyze_hook(pstate, query
+#if PG_VERSION_NUM >= 140000
+									 , jstate
+#endif
+									 );
+
+	if (!pgsp_enabled || !pgsp_builtin_fingerprint)
+		return;
+
+	if (query->queryId != UINT64CONST(0) || query->utilityStmt != NULL)
+		return;
+
+	query->queryId = pgsp_query_fingerprint(query);
+
+	/* Let the planner know that it can trust this query identifier. */
+	pgsp_fingerprint_remember(query->queryId);
+}
+
 static PlannedStmt *
 pgsp_planner_hook(Query *parse,
 #if PG_VERSION_NUM >= 130000
@@ -514,17 +851,49 @@ pgsp_planner_hook(Query *parse,
 	Query		   *generic_parse = NULL, *back_parse = NULL;
 	PlannedStmt	   *result, *generic;
 	pgspHashKey		key;
+	uint32			hashvalue;
 	pgspEntry	   *entry;
-	instr_time		planstart,
+	instr_time		hookstart,
+					lookupstart,
+					planstart,
 					planduration;
 	double			plantime;
 	bool			accum_custom_stats = false;
+	bool			validation_failed = false;
+	bool			stored = false;
 	pgspWalkerContext context;
+	size_t			cached_len = 0;
+	size_t			deserialized_len = 0;
+	double			cached_plantime = 0;
+	bool			shadow_hit = false;
+	uint64			epoch = 0;
+	char		   *memo_params = NULL;
+	size_t			memo_params_len = 0;
+	uint64			memo_params_hash = 0;
+	dsa_pointer		memo_plan = InvalidDsaPointer;
+	pgspMemoKind	memo_kind = PGSP_MEMO_PARAMS;
+	int64			memo_discard = 0;
+	char		   *part_key = NULL;
+	size_t			part_key_len = 0;
+	uint64			part_key_hash = 0;
+	bool			build_partition_plan = false;
+	char		   *shape_key = NULL;
+	size_t			shape_key_len = 0;
+	uint64			shape_key_hash = 0;
+	bool			build_shape_plan = false;
+	ParamListInfo	plan_params = boundParams;
+
+	/* The whole overhead of the hook is accounted in the backend stats. */
+	INSTR_TIME_SET_CURRENT(hookstart);
 
 	if (!pgsp_enabled || parse->queryId == UINT64CONST(0) ||
 #if PG_VERSION_NUM >= 140000
-			/* 3rd party query_id implementation may not be suitable. */
-			compute_query_id == COMPUTE_QUERY_ID_OFF ||
+			/*
+			 * 3rd party query_id implementation may not be suitable, only
+			 * accept our own.
+			 */
+			(!IsQueryIdEnabled() &&
+			 !pgsp_fingerprint_is_builtin(parse->queryId)) ||
 #endif
 #ifdef USE_ASSERT_CHECKING
 			(!pgsp_cache_all && boundParams == NULL)
@@ -585,27 +954,131 @@ pgsp_planner_hook(Query *parse,
 
 	key.constid = context.constid;
 
+	/* Only compute the key hash once, it's needed for every lookup. */
+	hashvalue = pgsp_index_hash(&key);
+
+	INSTR_TIME_SET_CURRENT(lookupstart);
+
+	/*
+	 * Compute the memo keys outside the lock, as it may need to detoast or
+	 * open relations.
+	 */
+	if (pgsp_memo_size > 0)
+	{
+		memo_params = pgsp_memo_params(boundParams, &memo_params_len,
+									   &memo_params_hash);
+		if (pgsp_partition_plans)
+			part_key = pgsp_partition_key(parse, boundParams, &part_key_len,
+										  &part_key_hash);
+		if (pgsp_shape_plans)
+			shape_key = pgsp_shape_key(boundParams, &shape_key_len,
+									   &shape_key_hash);
+	}
+
 	/* Lookup the hash table entry with shared lock. */
 	LWLockAcquire(pgsp->lock, LW_SHARED);
-	entry = (pgspEntry *) hash_search(pgsp_hash, &key, HASH_FIND, NULL);
+	entry = pgsp_index_lookup(&key, hashvalue);
 
 	if (entry)
 	{
 		int64		discard = entry->discard;
-		const char *local = pgsp_get_plan(entry->plan);
+		dsa_pointer plan = entry->plan;
 
-		if (local != NULL)
+		cached_len = entry->len;
+		cached_plantime = entry->plantime;
+
+		if (plan != InvalidDsaPointer)
 		{
 			bool	use_cached;
 			int		bypass;
 
 			use_cached = pgsp_choose_cache_plan(entry, &accum_custom_stats);
 
+			/*
+			 * In shadow mode, only remember that we could have used the
+			 * cached plan and plan the query as usual.
+			 */
+			if (use_cached && pgsp_shadow)
+			{
+				shadow_hit = true;
+				use_cached = false;
+			}
+
+			/*
+			 * A custom plan is needed, but one may already have been
+			 * generated for the same parameter values or their shape.
+			 */
+			if (!use_cached && !shadow_hit && memo_params != NULL)
+			{
+				memo_discard = discard;
+				memo_plan = pgsp_memo_lookup(entry, PGSP_MEMO_PARAMS,
+											 memo_params, memo_params_len,
+											 memo_params_hash);
+				if (memo_plan != InvalidDsaPointer)
+					memo_kind = PGSP_MEMO_PARAMS;
+				else if (shape_key != NULL)
+				{
+					memo_plan = pgsp_memo_lookup(entry, PGSP_MEMO_SHAPE,
+												 shape_key, shape_key_len,
+												 shape_key_hash);
+					if (memo_plan != InvalidDsaPointer)
+						memo_kind = PGSP_MEMO_SHAPE;
+					else
+						build_shape_plan = true;
+				}
+
+				if (memo_plan != InvalidDsaPointer)
+				{
+					plan = memo_plan;
+					use_cached = true;
+				}
+			}
+			/*
+			 * The generic plan can be used, but a plan restricted to the
+			 * partitions the parameters lead to may be available, or
+			 * generated.
+			 */
+			else if (use_cached && part_key != NULL)
+			{
+				memo_discard = discard;
+				memo_plan = pgsp_memo_lookup(entry, PGSP_MEMO_PARTITIONS,
+											 part_key, part_key_len,
+											 part_key_hash);
+				if (memo_plan != InvalidDsaPointer)
+				{
+					plan = memo_plan;
+					memo_kind = PGSP_MEMO_PARTITIONS;
+				}
+				else
+					build_partition_plan = true;
+			}
+
 			if (use_cached)
 			{
-				result = (PlannedStmt *) stringToNode(local);
+				const char *local;
 
+retry:
+				local = pgsp_plan_pin(plan, &deserialized_len);
+
+				/*
+				 * Deserialize the plan without holding the lock, as it can
+				 * take a while for big plans and would block any writer.  The
+				 * pin guarantees that the buffer isn't freed if the plan is
+				 * discarded meanwhile, which the check below will detect.
+				 */
 				LWLockRelease(pgsp->lock);
+				PG_TRY();
+				{
+					result = (PlannedStmt *) stringToNode(local);
+				}
+				PG_CATCH();
+				{
+					pgsp_plan_unpin(plan);
+					PG_RE_THROW();
+				}
+				PG_END_TRY();
+				pgsp_plan_unpin(plan);
+
 				pgsp_acquire_executor_locks(result, true);
 
 				/*
@@ -613,26 +1086,112 @@ pgsp_planner_hook(Query *parse,
 				 * locks.
 				 */
 				LWLockAcquire(pgsp->lock, LW_SHARED);
-				entry = (pgspEntry *) hash_search(pgsp_hash, &key, HASH_FIND,
-												  NULL);
+				entry = pgsp_index_lookup(&key, hashvalue);
 
 				if (entry == NULL || entry->plan == InvalidDsaPointer ||
-						entry->discard != discard)
+						entry->discard != discard ||
+						(memo_plan == InvalidDsaPointer &&
+						 pgsp_validation == PGSP_VALIDATION_LAZY &&
+						 !pgsp_entry_epoch_valid(entry)))
+				{
+					use_cached = false;
+					validation_failed = true;
+					entry = NULL;
+				}
+				else if (memo_plan != InvalidDsaPointer &&
+						 !pgsp_memo_valid(entry, memo_plan))
+				{
+					/*
+					 * Only the memoized plan is gone, e.g. evicted by another
+					 * backend meanwhile, the entry's plan is still valid.  If
+					 * the memoized plan was used in place of the generic plan,
+					 * use the latter and generate the memoized plan again.
+					 * Otherwise plan a custom plan and memoize it again, as if
+					 * it hadn't been found in the first place.
+					 */
+					if (memo_kind == PGSP_MEMO_PARTITIONS)
+					{
+						plan = entry->plan;
+						memo_plan = InvalidDsaPointer;
+						build_partition_plan = true;
+						goto retry;
+					}
+
 					use_cached = false;
+					if (memo_kind == PGSP_MEMO_SHAPE)
+						build_shape_plan = true;
+				}
 				else
+				{
 					bypass = entry->bypass;
 
-				entry = NULL;
-				LWLockRelease(pgsp->lock);
+					/*
+					 * Most of the overhead of using the stored plan is done,
+					 * record it.  The plans memoized in place of custom plans
+					 * are accounted as custom plans instead.
+					 */
+					if (pgsp_plan_cost_mode == PGSP_PLAN_COST_MEASURED &&
+						(memo_plan == InvalidDsaPointer ||
+						 memo_kind == PGSP_MEMO_PARTITIONS))
+						pgsp_entry_record_hit_time(entry, lookupstart);
+				}
+
+				/* Otherwise the lock is released below. */
+				if (use_cached)
+					LWLockRelease(pgsp->lock);
 			}
 
 			/* Entry is still valid, keep going. */
 			if (use_cached)
 			{
+				Cost	original_cost;
 				Cost	total_diff;
 				Cost	diff;
 				int		nb_rels;
 
+				if (pgsp_trace_enabled)
+					pgsp_trace_record(&key, PGSP_TRACE_HIT, cached_len,
+									  cached_plantime);
+
+				pgsp_backend_record(hookstart, PGSP_LOOKUP_HIT, false, false,
+									deserialized_len);
+
+				original_cost = result->planTree->total_cost;
+
+				/*
+				 * A plan memoized for the parameter values or their shape is
+				 * used in place of a custom plan, so plancache must see its
+				 * real cost.
+				 */
+				if (memo_plan != InvalidDsaPointer &&
+					memo_kind != PGSP_MEMO_PARTITIONS)
+				{
+					if (accum_custom_stats)
+					{
+						instr_time	duration;
+
+						/* The lookup was the "planning" of this plan. */
+						INSTR_TIME_SET_CURRENT(duration);
+						INSTR_TIME_SUBTRACT(duration, lookupstart);
+						pgsp_accum_custom_plan(&key, hashvalue, result,
+											   INSTR_TIME_GET_DOUBLE(duration) * 1000.0);
+					}
+					pgsp_explain_record(result, &key, PGSP_LOOKUP_HIT, false,
+										original_cost, lookupstart);
+					return result;
+				}
+
+				/* Generate the plan restricted to the partitions for next time. */
+				if (build_partition_plan)
+					pgsp_partition_remember(&key, memo_discard, parse,
+#if PG_VERSION_NUM >= 130000
+											query_string,
+#else
+											NULL,
+#endif
+											cursorOptions, part_key,
+											part_key_len, part_key_hash);
+
 				/*
 				 * If our threshold is greater or equal than the plancache one,
 				 * we won't be able to bypass it, so just return our plan as
@@ -643,7 +1202,11 @@ pgsp_planner_hook(Query *parse,
 				 * decided that a generic plan isn't suitable so should we.
 				 */
 				if (pgsp_threshold >= PLANCACHE_THRESHOLD)
+				{
+					pgsp_explain_record(result, &key, PGSP_LOOKUP_HIT, false,
+										original_cost, lookupstart);
 					return result;
+				}
 
 				/*
 				 * Nullify plancache heuristics to make it believe that a
@@ -695,6 +1258,8 @@ pgsp_planner_hook(Query *parse,
 						result->planTree->total_cost = 0.001;
 				}
 
+				pgsp_explain_record(result, &key, PGSP_LOOKUP_HIT, false,
+									original_cost, lookupstart);
 				return result;
 			}
 		}
@@ -714,28 +1279,31 @@ pgsp_planner_hook(Query *parse,
 	{
 		generic_parse = copyObject(parse);
 		back_parse = copyObject(parse);
-		INSTR_TIME_SET_CURRENT(planstart);
+		epoch = pgsp_epoch_start_planning();
 	}
+	else if (memo_params != NULL && !shadow_hit)
+		epoch = pgsp_epoch_start_planning();
 
-	if (prev_planner_hook)
-		result = (*prev_planner_hook) (parse,
-#if PG_VERSION_NUM >= 130000
-									   query_string,
-#endif
-									   cursorOptions, boundParams);
-	else
-		result = standard_planner(parse,
+	/*
+	 * Only plan for the parameter shape, so that the plan can be used for
+	 * other values of the same shape.
+	 */
+	if (entry && build_shape_plan)
+		plan_params = pgsp_shape_bind(boundParams);
+
+	INSTR_TIME_SET_CURRENT(planstart);
+
+	result = pgsp_call_planner(parse,
 #if PG_VERSION_NUM >= 130000
-								  query_string,
+							   query_string,
+#else
+							   NULL,
 #endif
-								  cursorOptions, boundParams);
+							   cursorOptions, plan_params);
 
-	if(!entry)
-	{
-		INSTR_TIME_SET_CURRENT(planduration);
-		INSTR_TIME_SUBTRACT(planduration, planstart);
-		plantime = INSTR_TIME_GET_DOUBLE(planduration) * 1000.0;
-	}
+	INSTR_TIME_SET_CURRENT(planduration);
+	INSTR_TIME_SUBTRACT(planduration, planstart);
+	plantime = INSTR_TIME_GET_DOUBLE(planduration) * 1000.0;
 
 	/* Save the plan if no one did it yet */
 	if (!entry && plantime >= pgsp_min_plantime)
@@ -747,21 +1315,76 @@ pgsp_planner_hook(Query *parse,
 								   query_string,
 #endif
 								   cursorOptions, NULL);
-		pgsp_cache_plan(back_parse, result, generic, &key, plantime,
-				context.num_const);
+		cached_len = pgsp_cache_plan(back_parse,
+#if PG_VERSION_NUM >= 130000
+									 query_string,
+#else
+									 NULL,
+#endif
+									 result, generic, &key, hashvalue,
+									 plantime, context.num_const, epoch);
+		stored = (cached_len > 0);
 	}
+	else if (!entry)
+		pg_atomic_fetch_add_u64(&pgsp->plantime_rejected, 1);
 	else if (accum_custom_stats)
+		pgsp_accum_custom_plan(&key, hashvalue, result, plantime);
+	else if (shadow_hit)
 	{
-		Cost custom_cost = pgsp_cached_plan_cost(result, true);
+		Cost custom_cost = pgsp_cached_plan_cost(result, false);
 
-		pgsp_accum_custom_plan(&key, custom_cost);
+		pgsp_accum_shadow_hit(&key, hashvalue, plantime, custom_cost);
 	}
 
+	/* Remember the custom plan for these parameter values or their shape. */
+	if (entry && build_shape_plan)
+		pgsp_memo_remember(&key, memo_discard, result, PGSP_MEMO_SHAPE,
+						   shape_key, shape_key_len, shape_key_hash, epoch);
+	else if (entry && memo_params != NULL && !shadow_hit)
+		pgsp_memo_remember(&key, memo_discard, result, PGSP_MEMO_PARAMS,
+						   memo_params, memo_params_len, memo_params_hash,
+						   epoch);
+
+	if (pgsp_trace_enabled)
+	{
+		if (shadow_hit)
+			pgsp_trace_record(&key, PGSP_TRACE_HIT, cached_len, plantime);
+		else if (entry)
+			pgsp_trace_record(&key, PGSP_TRACE_CUSTOM, cached_len, plantime);
+		else
+			pgsp_trace_record(&key, PGSP_TRACE_MISS, cached_len, plantime);
+	}
+
+	pgsp_backend_record(hookstart,
+						entry ? PGSP_LOOKUP_CUSTOM : PGSP_LOOKUP_MISS,
+						stored, validation_failed, 0);
+	pgsp_explain_record(result, &key,
+						entry ? PGSP_LOOKUP_CUSTOM : PGSP_LOOKUP_MISS,
+						stored, result->planTree->total_cost, lookupstart);
+
 	Assert(!LWLockHeldByMe(pgsp->lock));
 	return result;
 
 fallback:
 	Assert(!LWLockHeldByMe(pgsp->lock));
+	return pgsp_call_planner(parse,
+#if PG_VERSION_NUM >= 130000
+							 query_string,
+#else
+							 NULL,
+#endif
+							 cursorOptions, boundParams);
+}
+
+/*
+ * Plan the given query with the planner we're chaining to, so that the other
+ * extensions see all the plans we generate for the executed queries.
+ * query_string is ignored before pg13.
+ */
+PlannedStmt *
+pgsp_call_planner(Query *parse, const char *query_string, int cursorOptions,
+				  ParamListInfo boundParams)
+{
 	if (prev_planner_hook)
 		return (*prev_planner_hook) (parse,
 #if PG_VERSION_NUM >= 130000
@@ -827,8 +1450,12 @@ pgsp_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 	 */
 	pgsp_utility_pre_exec(parsetree, &util);
 
-	/* Process the populated util.oids_lock if any. */
-	pgsp_utility_do_lock(&util);
+	/*
+	 * Process the populated util.oids_lock if any.  In lazy validation mode,
+	 * the dependent plans are only checked when used.
+	 */
+	if (pgsp_validation == PGSP_VALIDATION_EAGER)
+		pgsp_utility_do_lock(&util);
 
 	/* Run the utility. */
 	if (prev_ProcessUtility)
@@ -875,12 +1502,23 @@ pgsp_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 	 */
 	pgsp_utility_post_exec(parsetree, &util);
 
+	/*
+	 * In lazy validation mode, the dependent plans will be discarded when
+	 * used, but still make sure that we don't cache a new plan as we don't
+	 * know if the transaction will commit or not.
+	 */
+	if ((util.has_discard || util.has_remove || util.has_lock) &&
+		pgsp_validation == PGSP_VALIDATION_LAZY)
+	{
+		set_config_option("pg_shared_plans.read_only", "on", PGC_USERSET,
+				PGC_S_SESSION, GUC_ACTION_LOCAL, true, 0, false);
+	}
 	/*
 	 * Discard any saved plan, or drop the entry referencing the underlying
 	 * relation, or unlock the required entries depending on the original
 	 * UTILITY.
 	 */
-	if (util.has_discard || util.has_remove || util.has_lock)
+	else if (util.has_discard || util.has_remove || util.has_lock)
 	{
 		pgspOidsEntry  *entry;
 		HASH_SEQ_STATUS oids_seq;
@@ -919,7 +1557,7 @@ pgsp_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 /*
  * Create the dynamic shared area or attach to it.
  */
-static void
+void
 pgsp_attach_dsa(void)
 {
 	MemoryContext	oldcontext;
@@ -929,7 +1567,7 @@ pgsp_attach_dsa(void)
 	/* Nothing to do if we're already attached to the dsa. */
 	if (pgsp_area != NULL)
 	{
-		Assert(pgsp_rdepend != NULL);
+		Assert(pgsp_rdepend != NULL && pgsp_query_text != NULL);
 		return;
 	}
 
@@ -958,6 +1596,20 @@ pgsp_attach_dsa(void)
 		pgsp_rdepend = dshash_attach(pgsp_area, &pgsp_rdepend_params,
 									 pgsp->pgsp_rdepend_handle, NULL);
 	}
+
+	pgsp_query_text_params.tranche_id = pgsp->LWTRANCHE_PGSP;
+	if (pgsp->pgsp_query_text_handle == InvalidDsaPointer)
+	{
+		pgsp_query_text = dshash_create(pgsp_area, &pgsp_query_text_params,
+										NULL);
+		pgsp->pgsp_query_text_handle =
+			dshash_get_hash_table_handle(pgsp_query_text);
+	}
+	else
+	{
+		pgsp_query_text = dshash_attach(pgsp_area, &pgsp_query_text_params,
+										pgsp->pgsp_query_text_handle, NULL);
+	}
 	LWLockRelease(pgsp->lock);
 
 	MemoryContextSwitchTo(oldcontext);
@@ -1037,15 +1689,24 @@ pg_shared_plans_reset_internal(Oid userid, Oid dbid, uint64 queryid)
 
 		SpinLockAcquire(&s->mutex);
 		s->dealloc = 0;
+		s->rdepend_refused = 0;
 		s->stats_reset = stats_reset;
 		SpinLockRelease(&s->mutex);
+		pg_atomic_write_u64(&pgsp->plantime_rejected, 0);
+
+		pgsp->removed_bypass = 0;
+		pgsp->removed_custom_plans = 0;
+		pgsp->removed_discard = 0;
+
+		pgsp_churn_reset();
 	}
 
 	LWLockRelease(pgsp->lock);
 }
 
 /*
- * Accumulate statistics for custom planing.  Caller mustn't hold the LWLock.
+ * Accumulate statistics for custom planing, with the time it took to get the
+ * custom plan.  Caller mustn't hold the LWLock.
  *
  * Note that even though caller should only call that function if the number of
  * custom plans hasn't reached pgsp_threshold, it may not be the case anymore
@@ -1054,20 +1715,25 @@ pg_shared_plans_reset_internal(Oid userid, Oid dbid, uint64 queryid)
  * information about it.
  */
 static void
-pgsp_accum_custom_plan(pgspHashKey *key, Cost custom_cost)
+pgsp_accum_custom_plan(pgspHashKey *key, uint32 hashvalue, PlannedStmt *custom,
+					   double plantime)
 {
 	pgspEntry *entry;
+	Cost		custom_cost = pgsp_cached_plan_cost(custom, true);
+	Cost		custom_exec_cost = pgsp_cached_plan_cost(custom, false);
 
 	Assert(!LWLockHeldByMe(pgsp->lock));
 	LWLockAcquire(pgsp->lock, LW_SHARED);
 
-	entry = hash_search(pgsp_hash, key, HASH_FIND, NULL);
+	entry = pgsp_index_lookup(key, hashvalue);
 	if (entry)
 	{
 		volatile pgspEntry *e = (volatile pgspEntry *) entry;
 
 		SpinLockAcquire(&e->mutex);
 		e->total_custom_cost += custom_cost;
+		e->total_custom_exec_cost += custom_exec_cost;
+		e->total_custom_plantime += plantime;
 		e->num_custom_plans += 1;
 		SpinLockRelease(&e->mutex);
 	}
@@ -1075,6 +1741,37 @@ pgsp_accum_custom_plan(pgspHashKey *key, Cost custom_cost)
 	LWLockRelease(pgsp->lock);
 }
 
+/*
+ * Accumulate statistics for a shared plan that would have been used if shadow
+ * mode wasn't enabled.  The planning time we just spent is what would have
+ * been saved, and the difference between the estimated costs of the shared
+ * plan and the custom plan gives an idea of how good the shared plan would
+ * have been.  Caller mustn't hold the LWLock.
+ */
+static void
+pgsp_accum_shadow_hit(pgspHashKey *key, uint32 hashvalue, double plantime,
+					  Cost custom_cost)
+{
+	pgspEntry *entry;
+
+	Assert(!LWLockHeldByMe(pgsp->lock));
+	LWLockAcquire(pgsp->lock, LW_SHARED);
+
+	entry = pgsp_index_lookup(key, hashvalue);
+	if (entry)
+	{
+		volatile pgspEntry *e = (volatile pgspEntry *) entry;
+
+		SpinLockAcquire(&e->mutex);
+		e->shadow_hits += 1;
+		e->shadow_time_saved += plantime;
+		e->shadow_cost_diff += e->generic_cost - custom_cost;
+		SpinLockRelease(&e->mutex);
+	}
+
+	LWLockRelease(pgsp->lock);
+}
+
 /*
  * Acquire locks needed for execution of a cached plan;
  * or release them if acquire is false.
@@ -1125,20 +1822,21 @@ pgsp_acquire_executor_locks(PlannedStmt *plannedstmt, bool acquire)
 #define PGSP_ITEM_NOT_HANDLED(i)	((i)->cacheId != TYPEOID && \
 									(i)->cacheId != PROCOID)
 static bool
-pgsp_allocate_plan(Query *parse, PlannedStmt *stmt, pgspDsaContext *context,
-				   pgspHashKey *key)
+pgsp_allocate_plan(Query *parse, PlannedStmt *stmt, pgspDsaContext *context)
 {
-	char	   *local;
 	char	   *serialized;
-	List	   *oids = NIL;
+	Oid		   *oids;
+	int			num_oids = 0;
 	List	   *invalItems = NIL, *rels = NIL;
 	bool		hasRowSecurity;
 	Oid		   *array = NULL;
 	ListCell   *lc;
 	bool		ok = true;
+	bool		reserved = false;
 	int			i;
 	int			nb_alloced_rels = 0;
-	int			nb_alloced_inval;
+	int			nb_alloced_inval = 0;
+	int			num_inval = 0;
 	pgspRdependKey *rdeps, *rdeps_tmp;
 
 	Assert(!LWLockHeldByMe(pgsp->lock));
@@ -1150,23 +1848,19 @@ pgsp_allocate_plan(Query *parse, PlannedStmt *stmt, pgspDsaContext *context,
 	serialized = nodeToString(stmt);
 	context->len = strlen(serialized) + 1;
 
-	context->plan = dsa_allocate_extended(pgsp_area,
-										  context->len,
-										  DSA_ALLOC_NO_OOM);
+	context->plan = pgsp_plan_alloc(serialized, context->len);
 
 	/* If we couldn't allocate memory for the plan, inform caller. */
 	if (context->plan == InvalidDsaPointer)
 		return false;
 
-	PGSP_USEDSMEM(context->len);
-
-	local = dsa_get_address(pgsp_area, context->plan);
-	Assert(local != NULL);
-
-	/* And copy the plan. */
-	memcpy(local, serialized, context->len);
-
-	/* Compute base relations the plan is referencing. */
+	/*
+	 * Compute base relations the plan is referencing.  The array is kept
+	 * sorted, so that it can be deduplicated and later compared with another
+	 * plan's in linear time, as plans on big partitioning trees can reference
+	 * thousands of relations.
+	 */
+	oids = (Oid *) palloc(sizeof(Oid) * Max(list_length(stmt->rtable), 1));
 	foreach(lc, stmt->rtable)
 	{
 		RangeTblEntry  *rte = lfirst_node(RangeTblEntry, lc);
@@ -1182,18 +1876,17 @@ pgsp_allocate_plan(Query *parse, PlannedStmt *stmt, pgspDsaContext *context,
 		}
 
 		Assert(OidIsValid(rte->relid));
-		oids = list_append_unique_oid(oids, rte->relid);
+		oids[num_oids++] = rte->relid;
 	}
-	context->num_rels = list_length(oids);
+	num_oids = pgsp_sort_oids(oids, num_oids);
+	context->num_rels = num_oids;
 
 	/* Save the list of relations in shared memory if any. */
-	if (list_length(oids) != 0)
+	if (num_oids != 0)
 	{
 		size_t array_len;
 
-		Assert(oids != NIL);
-
-		array_len = sizeof(Oid) * list_length(oids);
+		array_len = sizeof(Oid) * num_oids;
 		context->rels = dsa_allocate_extended(pgsp_area,
 											  array_len,
 											  DSA_ALLOC_NO_OOM);
@@ -1211,40 +1904,41 @@ pgsp_allocate_plan(Query *parse, PlannedStmt *stmt, pgspDsaContext *context,
 		PGSP_USEDSMEM(array_len);
 
 		array = dsa_get_address(pgsp_area, context->rels);
-
-		i = 0;
-		foreach(lc, oids)
-			array[i++] = lfirst_oid(lc);
-
-		Assert(i == list_length(oids));
+		memcpy(array, oids, array_len);
 	}
 
 	LWLockAcquire(pgsp->lock, LW_EXCLUSIVE);
 
-	/* Save the list of relation dependencies */
-	for (i = 0; i < context->num_rels; i++)
+	/*
+	 * Reserve a slot for the entry, the reverse dependencies are registered
+	 * using it.  If the entry already exists, they will be made to point to
+	 * the entry's slot instead, see pgsp_entry_alloc().
+	 */
+	if (!pgsp_slot_reserve(&context->ref))
 	{
-		ok = pgsp_entry_register_rdepend(MyDatabaseId, RELOID, array[i],
-										 key);
+		ok = false;
+		goto free_rels;
+	}
+	reserved = true;
 
-		if (!ok)
-		{
-			/* We'll have to unregister up to previous relation. */
-			nb_alloced_rels = i;
-			goto free_rels;
-		}
+	/* Save the list of relation dependencies */
+	nb_alloced_rels = pgsp_entry_register_rdepends(MyDatabaseId, RELOID,
+												   array, context->num_rels,
+												   &context->ref);
+	if (nb_alloced_rels != context->num_rels)
+	{
+		/* We'll have to unregister up to previous relation. */
+		ok = false;
+		goto free_rels;
 	}
-	/* We'll have to unregister all relations. */
-	nb_alloced_rels = i;
 
 	/* Also save handled PlanInvanItem dependencies. */
 	extract_query_dependencies((Node *) parse, &rels, &invalItems,
 			&hasRowSecurity);
 	invalItems = list_concat(invalItems, stmt->invalItems);
 
-	nb_alloced_inval = 0;
 	rdeps_tmp = (pgspRdependKey *) palloc(sizeof(pgspRdependKey) *
-			list_length(invalItems));
+			Max(list_length(invalItems), 1));
 	foreach(lc, invalItems)
 	{
 		PlanInvalItem *item = (PlanInvalItem *) lfirst(lc);
@@ -1252,15 +1946,36 @@ pgsp_allocate_plan(Query *parse, PlannedStmt *stmt, pgspDsaContext *context,
 		if (PGSP_ITEM_NOT_HANDLED(item))
 			continue;
 
-		ok = pgsp_entry_register_rdepend(MyDatabaseId, item->cacheId,
-										 item->hashValue, key);
+		rdeps_tmp[num_inval].dbid = MyDatabaseId;
+		rdeps_tmp[num_inval].classid = item->cacheId;
+		rdeps_tmp[num_inval].oid = item->hashValue;
+		num_inval++;
+	}
+
+	/* Sorted and deduplicated too, see above. */
+	if (num_inval > 1)
+	{
+		int		j = 0;
+
+		qsort(rdeps_tmp, num_inval, sizeof(pgspRdependKey),
+			  pgsp_rdepend_key_cmp);
+		for (i = 1; i < num_inval; i++)
+		{
+			if (pgsp_rdepend_key_cmp(&rdeps_tmp[j], &rdeps_tmp[i]) != 0)
+				rdeps_tmp[++j] = rdeps_tmp[i];
+		}
+		num_inval = j + 1;
+	}
+
+	for (nb_alloced_inval = 0; nb_alloced_inval < num_inval;
+		 nb_alloced_inval++)
+	{
+		pgspRdependKey *rkey = &rdeps_tmp[nb_alloced_inval];
+
+		ok = pgsp_entry_register_rdepend(rkey->dbid, rkey->classid,
+										 rkey->oid, &context->ref);
 		if (!ok)
 			goto free_invals;
-
-		rdeps_tmp[nb_alloced_inval].dbid = MyDatabaseId;
-		rdeps_tmp[nb_alloced_inval].classid = item->cacheId;
-		rdeps_tmp[nb_alloced_inval].oid = item->hashValue;
-		nb_alloced_inval++;
 	}
 
 	if (nb_alloced_inval > 0)
@@ -1292,21 +2007,10 @@ free_invals:
 	{
 		Assert(context->rdeps == InvalidDsaPointer);
 
-		i = 0;
-		foreach(lc, invalItems)
-		{
-			PlanInvalItem *item = (PlanInvalItem *) lfirst(lc);
-
-			if (PGSP_ITEM_NOT_HANDLED(item))
-				continue;
-
-			pgsp_entry_unregister_rdepend(MyDatabaseId, item->cacheId,
-										  item->hashValue, key);
-
-			i++;
-			if (i > nb_alloced_inval)
-				break;
-		}
+		for (i = 0; i < nb_alloced_inval; i++)
+			pgsp_entry_unregister_rdepend(rdeps_tmp[i].dbid,
+										  rdeps_tmp[i].classid,
+										  rdeps_tmp[i].oid, &context->ref);
 	}
 
 free_rels:
@@ -1317,17 +2021,17 @@ free_rels:
 	if (!ok && context->num_rels > 0)
 	{
 		Assert(context->plan != InvalidDsaPointer && context->len > 0);
-		Assert(oids != NIL && list_length(oids) >= nb_alloced_rels);
+		Assert(num_oids >= nb_alloced_rels);
 
 		Assert(array != NULL);
 		/* Free all saved rdepend. */
-		for (i = 0; i < nb_alloced_rels; i++)
-			pgsp_entry_unregister_rdepend(MyDatabaseId, RELOID, array[i], key);
+		pgsp_entry_unregister_rdepends(MyDatabaseId, RELOID, array,
+									   nb_alloced_rels, &context->ref);
 
 		/* And free the array of Oid. */
 		Assert(context->rels != InvalidDsaPointer);
 		dsa_free(pgsp_area, context->rels);
-		PGSP_FREEDSMEM(list_length(oids) * sizeof(Oid));
+		PGSP_FREEDSMEM(num_oids * sizeof(Oid));
 	}
 
 free_plan:
@@ -1335,8 +2039,11 @@ free_plan:
 	if (!ok)
 	{
 		/* Free the plan. */
-		dsa_free(pgsp_area, context->plan);
-		PGSP_FREEDSMEM(context->len);
+		pgsp_plan_unpin(context->plan);
+
+		/* And the reserved slot. */
+		if (reserved)
+			pgsp_slot_release(&context->ref);
 	}
 
 	LWLockRelease(pgsp->lock);
@@ -1357,7 +2064,7 @@ pgsp_evict_by_oid(Oid dbid, Oid classid, Oid oid, pgspEvictionKind kind)
 {
 	pgspRdependKey		rkey = {dbid, classid, oid};
 	pgspRdependEntry   *rentry;
-	pgspHashKey		   *rkeys;
+	pgspEntryRef	   *rkeys;
 	size_t				size;
 	int					i, num_keys;
 
@@ -1400,9 +2107,28 @@ pgsp_evict_by_oid(Oid dbid, Oid classid, Oid oid, pgspEvictionKind kind)
 	Assert(dsa_get_address(pgsp_area, rentry->keys) != NULL);
 
 	num_keys = rentry->num_keys;
-	size = sizeof(pgspHashKey) * num_keys;
-	rkeys = (pgspHashKey *) palloc(size);
-	memcpy(rkeys, dsa_get_address(pgsp_area, rentry->keys), size);
+	rkeys = (pgspEntryRef *) dsa_get_address(pgsp_area, rentry->keys);
+
+	/*
+	 * Removing the entries will unregister their reverse dependencies, and
+	 * thus modify or free the array, so we need to work on a copy.  Otherwise
+	 * the array can't change as long as we hold a lock on pgsp->lock.
+	 */
+	if (kind == PGSP_EVICT)
+	{
+		size = sizeof(pgspEntryRef) * num_keys;
+		rkeys = (pgspEntryRef *) memcpy(palloc(size), rkeys, size);
+	}
+
+	/*
+	 * Keep track of the churn caused by this object.  Note that the rdepend
+	 * entry is removed when no more entries depend on it, which is always the
+	 * case after an eviction unless new entries were registered since.
+	 */
+	if (kind == PGSP_EVICT)
+		rentry->evictions += num_keys;
+	else if (kind != PGSP_UNLOCK)
+		rentry->discards += num_keys;
 
 	/*
 	 * We can release the lock now as we hold a (possibly shared) lock on
@@ -1415,7 +2141,7 @@ pgsp_evict_by_oid(Oid dbid, Oid classid, Oid oid, pgspEvictionKind kind)
 	{
 		pgspEntry *entry;
 
-		entry = hash_search(pgsp_hash, &rkeys[i], HASH_FIND, NULL);
+		entry = pgsp_slot_get(&rkeys[i]);
 		if (!entry)
 			continue;
 
@@ -1439,97 +2165,319 @@ pgsp_evict_by_oid(Oid dbid, Oid classid, Oid oid, pgspEvictionKind kind)
 			/* We only report a discard of a plan that was previously valid. */
 			if (entry->plan != InvalidDsaPointer)
 			{
-				PGSP_FREERELEASEDSMEM(entry, plan, entry->len, len);
+				PGSP_RELEASEPLAN(entry);
 
 				if (kind != PGSP_EVICT)
+				{
 					entry->discard++;
+					pgsp_entry_add_history(entry, PGSP_PLAN_DISCARD);
+				}
+			}
+
+			/* The query may not be valid anymore either. */
+			if (entry->query != InvalidDsaPointer)
+			{
+				PGSP_FREERELEASEDSMEM(entry, query, entry->query_len,
+									  query_len);
+			}
+
+			/* Nor the memoized plans. */
+			pgsp_memo_reset(entry);
+
+			if(kind == PGSP_EVICT)
+			{
+				/* We don't hold any lock on the pgsp_rdepend at this point. */
+				pgsp_entry_remove(entry);
+			}
+		}
+	}
+}
+
+/*
+ * Decide whether to use a cached plan or not, and if caller should accumulate
+ * custom plan statistics.
+ * Also takes care of maintaining bypass and usage counters.
+ * Caller must hold a shared lock on pgsp->lock.
+ */
+static bool
+pgsp_choose_cache_plan(pgspEntry *entry, bool *accum_custom_stats)
+{
+	/* Grab the spinlock while updating the counters. */
+	volatile pgspEntry *e = (volatile pgspEntry *) entry;
+	bool				use_cached = false;
+	TimestampTz			now;
+	TimestampTz			last_hit_at;
+	double				decay;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_SHARED));
+
+	/* Cheap enough for the hit path as it doesn't read the clock. */
+	now = GetCurrentStatementStartTimestamp();
+
+	/*
+	 * We should already have computed a custom plan, and other immutable
+	 * fields values.
+	 * NOTE: A plan can have a zero cost, if it's Result with a One-Time
+	 * Filter: false
+	 */
+	Assert(e->generic_cost >= 0 && e->len > 0 && e->plan != InvalidDsaPointer
+		   && e->plantime > 0);
+
+	/*
+	 * Compute the hit rate decay before acquiring the spinlock, as exp() is
+	 * too expensive to be called while holding it.  last_hit_at is read
+	 * without the spinlock and checked once it's held: if a concurrent hit
+	 * changed it, the rate has just been decayed and is used as-is.
+	 */
+	last_hit_at = e->last_hit_at;
+	decay = pgsp_hit_rate_decay(last_hit_at, now);
+
+	SpinLockAcquire(&e->mutex);
+
+	if (e->num_custom_plans >= pgsp_threshold)
+	{
+		use_cached = pgsp_generic_plan_cheaper(e);
+
+		if (use_cached)
+		{
+			/* In shadow mode, caller will count a shadow hit instead. */
+			if (!pgsp_shadow)
+			{
+				if (e->last_hit_at != last_hit_at)
+					decay = 1.0;
+
+				e->bypass += 1;
+				e->hit_rate = e->hit_rate * decay + 1.0 / PGSP_HIT_RATE_WINDOW;
+				if (now > e->last_hit_at)
+					e->last_hit_at = now;
 			}
+			e->usage += e->plantime;
+		}
+	}
+	else
+	{
+		/* Increment usage so that it doesn't get evicted too soon */
+		e->usage += e->plantime;
+		/* And tell caller to later accumulate custom plan statistics. */
+		*accum_custom_stats = true;
+	}
+	SpinLockRelease(&e->mutex);
+
+	return use_cached;
+}
+
+/*
+ * Is the stored generic plan cheaper than the average custom plan, including
+ * the effort needed to get them?  Caller must hold the entry's spinlock.
+ *
+ * With estimated plan_cost_mode, the planning effort is plancache's estimate,
+ * already part of total_custom_cost, while using the stored plan is
+ * considered free.  With measured plan_cost_mode, it's the measured planning
+ * and hit times, converted using pg_shared_plans.plantime_cost.
+ */
+bool
+pgsp_generic_plan_cheaper(volatile pgspEntry *e)
+{
+	double		avg;
+
+	Assert(e->num_custom_plans > 0);
+
+	if (pgsp_plan_cost_mode == PGSP_PLAN_COST_ESTIMATED)
+	{
+		avg = e->total_custom_cost / e->num_custom_plans;
+
+		return (e->generic_cost < avg);
+	}
+
+	avg = (e->total_custom_exec_cost +
+		   e->total_custom_plantime * pgsp_plantime_cost) /
+		e->num_custom_plans;
+
+	return (e->generic_cost + e->hit_time * pgsp_plantime_cost < avg);
+}
+
+/*
+ * Record the time it took to use the stored plan of the given entry, since
+ * the given start of the lookup.  Caller must hold a lock on pgsp->lock.
+ */
+static void
+pgsp_entry_record_hit_time(pgspEntry *entry, instr_time start)
+{
+	volatile pgspEntry *e = (volatile pgspEntry *) entry;
+	instr_time	duration;
+	double		hit_time;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	hit_time = INSTR_TIME_GET_DOUBLE(duration) * 1000.0;
+
+	SpinLockAcquire(&e->mutex);
+	if (e->hit_time == 0)
+		e->hit_time = hit_time;
+	else
+		e->hit_time = e->hit_time * (1.0 - PGSP_HIT_TIME_WEIGHT) +
+			hit_time * PGSP_HIT_TIME_WEIGHT;
+	SpinLockRelease(&e->mutex);
+}
+
+static const char *
+pgsp_get_plan(dsa_pointer plan)
+{
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_SHARED));
+	Assert(pgsp_area != NULL);
+
+	if (plan == InvalidDsaPointer)
+		return NULL;
+
+	return ((pgspPlanBuffer *) dsa_get_address(pgsp_area, plan))->data;
+}
+
+/*
+ * Store the given serialized plan in a new plan buffer, whose reference is
+ * owned by the caller.  Returns InvalidDsaPointer if there isn't enough shared
+ * memory.
+ */
+dsa_pointer
+pgsp_plan_alloc(const char *serialized, size_t len)
+{
+	dsa_pointer plan;
+	pgspPlanBuffer *buffer;
+
+	Assert(pgsp_area != NULL);
+
+	plan = dsa_allocate_extended(pgsp_area, PGSP_PLAN_BUFFER_SIZE(len),
+								 DSA_ALLOC_NO_OOM);
+	if (plan == InvalidDsaPointer)
+		return InvalidDsaPointer;
+
+	PGSP_USEDSMEM(PGSP_PLAN_BUFFER_SIZE(len));
 
-			if(kind == PGSP_EVICT)
-			{
-				/* We don't hold any lock on the pgsp_rdepend at this point. */
-				pgsp_entry_remove(entry);
-			}
-		}
-	}
+	buffer = dsa_get_address(pgsp_area, plan);
+	Assert(buffer != NULL);
+
+	pg_atomic_init_u32(&buffer->refcount, 1);
+	buffer->len = len;
+	memcpy(buffer->data, serialized, len);
+
+	return plan;
 }
 
 /*
- * Decide whether to use a cached plan or not, and if caller should accumulate
- * custom plan statistics.
- * Also takes care of maintaining bypass and usage counters.
- * Caller must hold a shared lock on pgsp->lock.
+ * Pin the given plan buffer, so that it can be deserialized after releasing
+ * pgsp->lock, and return the serialized plan and its length.  Caller must hold
+ * a lock on pgsp->lock, which guarantees that the owning entry still holds its
+ * reference.
  */
-static bool
-pgsp_choose_cache_plan(pgspEntry *entry, bool *accum_custom_stats)
+const char *
+pgsp_plan_pin(dsa_pointer plan, size_t *len)
 {
-	/* Grab the spinlock while updating the counters. */
-	volatile pgspEntry *e = (volatile pgspEntry *) entry;
-	bool				use_cached = false;
+	pgspPlanBuffer *buffer;
 
-	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_SHARED));
+	Assert(LWLockHeldByMe(pgsp->lock));
+	Assert(plan != InvalidDsaPointer);
 
-	/*
-	 * We should already have computed a custom plan, and other immutable
-	 * fields values.
-	 * NOTE: A plan can have a zero cost, if it's Result with a One-Time
-	 * Filter: false
-	 */
-	Assert(e->generic_cost >= 0 && e->len > 0 && e->plan != InvalidDsaPointer
-		   && e->plantime > 0);
+	buffer = (pgspPlanBuffer *) dsa_get_address(pgsp_area, plan);
+	pg_atomic_fetch_add_u32(&buffer->refcount, 1);
+	*len = buffer->len;
 
-	SpinLockAcquire(&e->mutex);
+	return buffer->data;
+}
 
-	if (e->num_custom_plans >= pgsp_threshold)
-	{
-		double				avg;
+/*
+ * Release a reference on the given plan buffer, and free it if it was the
+ * last one.  Doesn't require any lock.
+ */
+void
+pgsp_plan_unpin(dsa_pointer plan)
+{
+	pgspPlanBuffer *buffer;
+	size_t		len;
 
-		avg = e->total_custom_cost / e->num_custom_plans;
-		use_cached = (e->generic_cost < avg);
+	Assert(plan != InvalidDsaPointer);
 
-		if (use_cached)
-		{
-			e->bypass += 1;
-			e->usage += e->plantime;
-		}
-	}
-	else
+	buffer = (pgspPlanBuffer *) dsa_get_address(pgsp_area, plan);
+	len = buffer->len;
+
+	if (pg_atomic_sub_fetch_u32(&buffer->refcount, 1) == 0)
 	{
-		/* Increment usage so that it doesn't get evicted too soon */
-		e->usage += e->plantime;
-		/* And tell caller to later accumulate custom plan statistics. */
-		*accum_custom_stats = true;
+		dsa_free(pgsp_area, plan);
+		PGSP_FREEDSMEM(PGSP_PLAN_BUFFER_SIZE(len));
 	}
-	SpinLockRelease(&e->mutex);
+}
 
-	return use_cached;
+/*
+ * Return the factor to apply to a hit rate to decay it from last_hit_at to
+ * now.  Adding 1 / PGSP_HIT_RATE_WINDOW for each hit makes the rate converge
+ * to the number of hits per second for a steady workload.
+ */
+static double
+pgsp_hit_rate_decay(TimestampTz last_hit_at, TimestampTz now)
+{
+	double		elapsed;
+
+	if (last_hit_at == 0 || now <= last_hit_at)
+		return 1.0;
+
+	elapsed = (double) (now - last_hit_at) / USECS_PER_SEC;
+
+	return exp(-elapsed / PGSP_HIT_RATE_WINDOW);
 }
 
-static const char *
-pgsp_get_plan(dsa_pointer plan)
+/*
+ * Save a serialized version of the query in shared memory, so that it can
+ * later be planned again.  This is only informational, so failing to allocate
+ * the memory isn't a problem.
+ */
+static void
+pgsp_allocate_query(Query *parse, pgspDsaContext *context)
 {
-	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_SHARED));
-	Assert(pgsp_area != NULL);
+	char	   *serialized;
+	char	   *local;
+	size_t		len;
 
-	if (plan == InvalidDsaPointer)
-		return NULL;
+	Assert(!LWLockHeldByMe(pgsp->lock));
+	Assert(context->query == InvalidDsaPointer);
+
+	serialized = nodeToString(parse);
+	len = strlen(serialized) + 1;
+
+	context->query = dsa_allocate_extended(pgsp_area, len, DSA_ALLOC_NO_OOM);
+	if (context->query == InvalidDsaPointer)
+		return;
+
+	PGSP_USEDSMEM(len);
+	context->query_len = len;
 
-	return (const char *) dsa_get_address(pgsp_area, plan);
+	local = dsa_get_address(pgsp_area, context->query);
+	Assert(local != NULL);
+	memcpy(local, serialized, len);
+	pfree(serialized);
 }
 
 /*
  * Store a generic plan in shared memory, and allocate a new entry to associate
- * the plan with.
+ * the plan with.  Returns the size of the stored plan, or 0 if it couldn't be
+ * stored.
  */
-static void
-pgsp_cache_plan(Query *parse, PlannedStmt *custom, PlannedStmt *generic,
-				pgspHashKey *key, double plantime, int num_const)
+static size_t
+pgsp_cache_plan(Query *parse, const char *query_string, PlannedStmt *custom,
+				PlannedStmt *generic, pgspHashKey *key, uint32 hashvalue,
+				double plantime, int num_const, uint64 epoch)
 {
 	pgspDsaContext context = {0};
 	pgspEntry *entry PG_USED_FOR_ASSERTS_ONLY;
+	char	   *query_text;
+	size_t		len;
 
 	Assert(!LWLockHeldByMe(pgsp->lock));
 
+	/* Don't store yet another variant of a query having too many of them. */
+	if (!pgsp_churn_check(key, hashvalue))
+		return 0;
+
+	/* Only stored if the entry is created, but avoid doing it under lock. */
+	query_text = pgsp_query_text_normalize(parse, query_string);
+
 	/*
 	 * We store the plan is shared memory before acquiring the lwlock.  It
 	 * means that we may have to free it, but it avoids locking overhead.
@@ -1537,23 +2485,35 @@ pgsp_cache_plan(Query *parse, PlannedStmt *custom, PlannedStmt *generic,
 	 * permanently.
 	 */
 	HOLD_INTERRUPTS();
-	if (!pgsp_allocate_plan(parse, generic, &context, key))
+	if (!pgsp_allocate_plan(parse, generic, &context))
 	{
 		/*
 		 * Don't try to allocate a new entry if we couldn't store the plan in
 		 * shared memory.
 		 */
 		RESUME_INTERRUPTS();
-		return;
+		return 0;
 	}
+	len = context.len;
+	context.epoch = epoch;
+
+	if (pgsp_store_query)
+		pgsp_allocate_query(parse, &context);
 
 	LWLockAcquire(pgsp->lock, LW_EXCLUSIVE);
-	entry = pgsp_entry_alloc(key, &context, plantime, num_const,
+	entry = pgsp_entry_alloc(key, hashvalue, &context, plantime, num_const,
 							 pgsp_cached_plan_cost(custom, true),
-							 pgsp_cached_plan_cost(generic, false));
+							 pgsp_cached_plan_cost(custom, false),
+							 pgsp_cached_plan_cost(generic, false),
+							 pgsp_plan_fingerprint(generic), query_text);
 	Assert(entry);
 	LWLockRelease(pgsp->lock);
 	RESUME_INTERRUPTS();
+
+	if (query_text)
+		pfree(query_text);
+
+	return len;
 }
 
 /* Calculate a hash value for a given key. */
@@ -1598,19 +2558,63 @@ pgsp_memsize(void)
 
 	size = CACHELINEALIGN(sizeof(pgspSharedState));
 	size = add_size(size, hash_estimate_size(pgsp_max, sizeof(pgspEntry)));
+	size = add_size(size, pgsp_snapshot_memsize());
+	size = add_size(size, pgsp_backend_memsize());
+	size = add_size(size, pgsp_churn_memsize());
+	size = add_size(size, pgsp_epoch_memsize());
+	size = add_size(size, pgsp_index_memsize());
+	size = add_size(size, pgsp_slot_memsize());
 
 	return size;
 }
 
+/*
+ * Record a plan change for the given entry, using its current fingerprint and
+ * generic cost.  Caller must hold an exclusive lock on pgsp->lock.
+ */
+static void
+pgsp_entry_add_history(pgspEntry *entry, pgspPlanChangeReason reason)
+{
+	pgspPlanChange *change;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+
+	change = &entry->history[entry->history_next];
+	change->fingerprint = entry->fingerprint;
+	change->generic_cost = entry->generic_cost;
+	change->ts = GetCurrentTimestamp();
+	change->reason = reason;
+
+	switch (reason)
+	{
+		case PGSP_PLAN_NEW:
+			entry->created_at = change->ts;
+			break;
+		case PGSP_PLAN_DISCARD:
+			entry->last_discard_at = change->ts;
+			break;
+		case PGSP_PLAN_REPLAN:
+			entry->last_replanned_at = change->ts;
+			break;
+	}
+
+	entry->history_next = (entry->history_next + 1) % PGSP_PLAN_HISTORY;
+	if (entry->history_count < PGSP_PLAN_HISTORY)
+		entry->history_count++;
+}
+
 /*
  * Allocate a new hashtable entry if no one did the job before, and associate
  * it with the given dsa_pointers that holds the generic plan (and the
- * underlying relations if any) for that entry.  Caller must hold an exclusive
+ * underlying relations if any) for that entry.  The given normalized query
+ * text, if any, is only used for new entries.  Caller must hold an exclusive
  * lock on pgsp->lock
  */
 static pgspEntry *
-pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context, double plantime,
-				 int num_const, Cost custom_cost, Cost generic_cost)
+pgsp_entry_alloc(pgspHashKey *key, uint32 hashvalue, pgspDsaContext *context,
+				 double plantime, int num_const, Cost custom_cost,
+				 Cost custom_exec_cost, Cost generic_cost,
+				 uint64 fingerprint, const char *query_text)
 {
 	pgspEntry  *entry;
 	bool		found;
@@ -1628,7 +2632,29 @@ pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context, double plantime,
 		pgsp_entry_dealloc();
 
 	/* Find or create an entry with desired hash code */
-	entry = (pgspEntry *) hash_search(pgsp_hash, key, HASH_ENTER, &found);
+	entry = (pgspEntry *) hash_search_with_hash_value(pgsp_hash, key,
+													  hashvalue, HASH_ENTER,
+													  &found);
+	if (!found)
+		pgsp_index_insert(entry, hashvalue);
+
+	/*
+	 * In lazy validation mode, the stored plan may be outdated.  Discard it so
+	 * that the new one is registered.
+	 */
+	if (found && entry->plan != InvalidDsaPointer &&
+		pgsp_validation == PGSP_VALIDATION_LAZY &&
+		!pgsp_entry_epoch_valid(entry))
+	{
+		PGSP_RELEASEPLAN(entry);
+		if (entry->query != InvalidDsaPointer)
+		{
+			PGSP_FREERELEASEDSMEM(entry, query, entry->query_len, query_len);
+		}
+		pgsp_memo_reset(entry);
+		entry->discard++;
+		pgsp_entry_add_history(entry, PGSP_PLAN_DISCARD);
+	}
 
 	if (!found)
 	{
@@ -1639,10 +2665,25 @@ pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context, double plantime,
 		entry->rels = context->rels;
 		entry->num_rdeps = context->num_rdeps;
 		entry->rdeps = context->rdeps;
+		entry->memo = InvalidDsaPointer;
+		entry->has_query_text = (query_text != NULL &&
+								 pgsp_query_text_acquire(key->dbid,
+														 key->queryid,
+														 query_text));
 		entry->num_const = num_const;
 		entry->plantime = plantime;
 		entry->generic_cost = generic_cost;
+		entry->epoch = context->epoch;
+		entry->ref = context->ref;
+		pgsp_slot_attach(&entry->ref, entry);
 		entry->discard = 0;
+		entry->fingerprint = fingerprint;
+		entry->history_next = 0;
+		entry->history_count = 0;
+		entry->last_discard_at = 0;
+		entry->last_replanned_at = 0;
+		pgsp_entry_add_history(entry, PGSP_PLAN_NEW);
+		pgsp_churn_entry_added(key);
 		pg_atomic_init_u32(&entry->lockers, 0);
 
 		/* re-initialize the mutex each time ... we assume no one using it */
@@ -1650,12 +2691,21 @@ pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context, double plantime,
 		entry->bypass = 0;
 		entry->usage = PGSP_USAGE_INIT;
 		entry->total_custom_cost = custom_cost;
+		entry->total_custom_exec_cost = custom_exec_cost;
+		entry->total_custom_plantime = plantime;
+		entry->hit_time = 0;
 		entry->num_custom_plans = 1.0;
+		entry->shadow_hits = 0;
+		entry->shadow_time_saved = 0;
+		entry->shadow_cost_diff = 0;
+		entry->last_hit_at = 0;
+		entry->hit_rate = 0;
 
 		/* The context DSM were moved to the entry */
 		PGSP_TRANSFER(entry, context, plan, len);
 		PGSP_TRANSFER(entry, context, rels, num_rels);
 		PGSP_TRANSFER(entry, context, rdeps, num_rdeps);
+		PGSP_TRANSFER(entry, context, query, query_len);
 	}
 	else if (entry->plan == InvalidDsaPointer)
 	{
@@ -1672,7 +2722,7 @@ pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context, double plantime,
 			int		i;
 
 			/* Free the plan. */
-			PGSP_FREERELEASEDSMEM(context, plan, context->len, len);
+			PGSP_RELEASEPLAN(context);
 
 			/* Free all saved rdepend. */
 			if (context->num_rels > 0)
@@ -1680,9 +2730,9 @@ pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context, double plantime,
 				array = dsa_get_address(pgsp_area, context->rels);
 				Assert(array != NULL);
 
-				for (i = 0; i < context->num_rels; i++)
-					pgsp_entry_unregister_rdepend(MyDatabaseId, RELOID,
-												  array[i], key);
+				pgsp_entry_unregister_rdepends(MyDatabaseId, RELOID, array,
+											   context->num_rels,
+											   &context->ref);
 			}
 
 			if (context->num_rdeps > 0)
@@ -1696,7 +2746,7 @@ pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context, double plantime,
 					pgsp_entry_unregister_rdepend(rdeps[i].dbid,
 												  rdeps[i].classid,
 												  rdeps[i].oid,
-												  key);
+												  &context->ref);
 				}
 			}
 
@@ -1716,16 +2766,66 @@ pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context, double plantime,
 		{
 			/* Transfer the plan to the entry */
 			PGSP_TRANSFER(entry, context, plan, len);
+
+			/* The new plan may be different. */
+			entry->generic_cost = generic_cost;
+			entry->fingerprint = fingerprint;
+			entry->epoch = context->epoch;
+			pgsp_entry_add_history(entry, PGSP_PLAN_REPLAN);
+
+			Assert(entry->query == InvalidDsaPointer);
+			PGSP_TRANSFER(entry, context, query, query_len);
 		}
 	}
 
+	/* Free the query if it wasn't transferred */
+	if (context->query != InvalidDsaPointer)
+	{
+		PGSP_FREERELEASEDSMEM(context, query, context->query_len, query_len);
+	}
+
 	/* Free the plan if it wasn't transferred */
 	if (context->plan != InvalidDsaPointer)
 	{
-		PGSP_FREERELEASEDSMEM(context, plan, context->len, len);
+		PGSP_RELEASEPLAN(context);
+	}
+
+	/*
+	 * The reverse dependencies that are kept were registered with the slot we
+	 * reserved, make them point to the existing entry and release the slot.
+	 */
+	if (found)
+	{
+		int		i;
+
+		if (context->num_rels > 0)
+		{
+			Oid *array = dsa_get_address(pgsp_area, context->rels);
+
+			for (i = 0; i < context->num_rels; i++)
+				pgsp_entry_retarget_rdepend(MyDatabaseId, RELOID, array[i],
+											&context->ref, &entry->ref);
+		}
+
+		if (context->num_rdeps > 0)
+		{
+			pgspRdependKey *rdeps = dsa_get_address(pgsp_area,
+													context->rdeps);
+
+			for (i = 0; i < context->num_rdeps; i++)
+				pgsp_entry_retarget_rdepend(rdeps[i].dbid, rdeps[i].classid,
+											rdeps[i].oid, &context->ref,
+											&entry->ref);
+		}
+
+		pgsp_slot_release(&context->ref);
 	}
 
-	/* Update reverse dependencies */
+	/*
+	 * Update reverse dependencies.  Both the old and new arrays are sorted,
+	 * see pgsp_allocate_plan(), so a single merge pass finds the ones that are
+	 * no longer referenced.
+	 */
 	if (found && entry->plan != InvalidDsaPointer)
 	{
 		if (entry->rels != InvalidDsaPointer)
@@ -1733,6 +2833,7 @@ pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context, double plantime,
 			Oid *old = dsa_get_address(pgsp_area, entry->rels);
 			Oid *new = NULL;
 			int i;
+			int j = 0;
 
 			Assert(entry->num_rels > 0);
 
@@ -1749,24 +2850,15 @@ pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context, double plantime,
 			/* Remove rels that are no longer referenced */
 			for (i = 0; i < entry->num_rels; i++)
 			{
-				int j;
-				bool rel_found = false;
-
 				Assert(OidIsValid(old[i]));
 
-				for (j = 0; j < context->num_rels; j++)
-				{
-					if (old[i] == new[j])
-					{
-						rel_found = true;
-						break;
-					}
-				}
+				while (j < context->num_rels && new[j] < old[i])
+					j++;
 
-				if (!rel_found)
+				if (j >= context->num_rels || new[j] != old[i])
 				{
 					pgsp_entry_unregister_rdepend(MyDatabaseId, RELOID,
-												  old[i], key);
+												  old[i], &entry->ref);
 				}
 			}
 			PGSP_FREERELEASEDSMEM(entry, rels, entry->num_rels * sizeof(Oid),
@@ -1780,6 +2872,7 @@ pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context, double plantime,
 			pgspRdependKey *old = dsa_get_address(pgsp_area, entry->rdeps);
 			pgspRdependKey *new = NULL;
 			int i;
+			int j = 0;
 
 			Assert(entry->num_rdeps > 0);
 
@@ -1796,25 +2889,18 @@ pgsp_entry_alloc(pgspHashKey *key, pgspDsaContext *context, double plantime,
 			/* Remove rdeps that are no longer referenced */
 			for (i = 0; i < entry->num_rdeps; i++)
 			{
-				int j;
-				bool rdep_found = false;
-
-				for (j = 0; j < context->num_rdeps; j++)
-				{
-					if (pgsp_rdepend_fn_compare(&old[i], &new[j], 0, NULL) == 0)
-					{
-						rdep_found = true;
-						break;
-					}
-				}
+				while (j < context->num_rdeps &&
+					   pgsp_rdepend_key_cmp(&new[j], &old[i]) < 0)
+					j++;
 
-				if (!rdep_found)
+				if (j >= context->num_rdeps ||
+					pgsp_rdepend_key_cmp(&new[j], &old[i]) != 0)
 				{
 					Assert(old[i].dbid == MyDatabaseId);
 					pgsp_entry_unregister_rdepend(old[i].dbid,
 												  old[i].classid,
 												  old[i].oid,
-												  key);
+												  &entry->ref);
 				}
 			}
 			PGSP_FREERELEASEDSMEM(entry, rdeps,
@@ -1912,6 +2998,28 @@ pgsp_entry_dealloc(void)
 	}
 }
 
+/*
+ * Check that none of the dependencies of the entry's plan were invalidated
+ * since it was generated.  Caller must hold a lock on pgsp->lock.
+ */
+bool
+pgsp_entry_epoch_valid(pgspEntry *entry)
+{
+	Oid		   *rels = NULL;
+	pgspRdependKey *rdeps = NULL;
+
+	Assert(LWLockHeldByMe(pgsp->lock));
+
+	if (entry->num_rels > 0)
+		rels = (Oid *) dsa_get_address(pgsp_area, entry->rels);
+	if (entry->num_rdeps > 0)
+		rdeps = (pgspRdependKey *) dsa_get_address(pgsp_area, entry->rdeps);
+
+	return pgsp_epoch_valid(entry->epoch, entry->key.dbid,
+							rels, entry->num_rels,
+							rdeps, entry->num_rdeps);
+}
+
 /*
  * Completely remove an entry:
  * - free associated dsa pointers and underlying memory
@@ -1924,12 +3032,33 @@ pgsp_entry_remove(pgspEntry *entry)
 	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
 	Assert(pgsp_area != NULL);
 
+	/*
+	 * Keep track of the counters of the removed entry, so that the cumulative
+	 * counters reported in snapshots don't go backward.  No need to hold the
+	 * entry's spinlock as we have an exclusive lock on pgsp->lock.
+	 */
+	pgsp->removed_bypass += entry->bypass;
+	pgsp->removed_custom_plans += entry->num_custom_plans;
+	pgsp->removed_discard += entry->discard;
+
 	/* Free the dsa allocated memory. */
 	if (entry->plan != InvalidDsaPointer)
 	{
-		PGSP_FREERELEASEDSMEM(entry, plan, entry->len, len);
+		PGSP_RELEASEPLAN(entry);
+	}
+
+	if (entry->query != InvalidDsaPointer)
+	{
+		PGSP_FREERELEASEDSMEM(entry, query, entry->query_len, query_len);
 	}
 
+	pgsp_memo_reset(entry);
+
+	if (entry->has_query_text)
+		pgsp_query_text_release(entry->key.dbid, entry->key.queryid);
+
+	pgsp_churn_entry_removed(&entry->key);
+
 	if (entry->num_rels > 0)
 	{
 		Oid *array = NULL;
@@ -1941,7 +3070,7 @@ pgsp_entry_remove(pgspEntry *entry)
 
 		for(i = 0; i < entry->num_rels; i++)
 			pgsp_entry_unregister_rdepend(entry->key.dbid, RELOID,
-										  array[i], &entry->key);
+										  array[i], &entry->ref);
 
 		PGSP_FREERELEASEDSMEM(entry, rels, entry->num_rels * sizeof(Oid),
 				num_rels);
@@ -1961,7 +3090,7 @@ pgsp_entry_remove(pgspEntry *entry)
 		rdeps = (pgspRdependKey *) dsa_get_address(pgsp_area, entry->rdeps);
 		for (i = 0; i < entry->num_rdeps; i++)
 			pgsp_entry_unregister_rdepend(rdeps[i].dbid, rdeps[i].classid,
-										  rdeps[i].oid, &entry->key);
+										  rdeps[i].oid, &entry->ref);
 
 		PGSP_FREERELEASEDSMEM(entry, rdeps,
 				entry->num_rdeps * sizeof(pgspRdependKey),
@@ -1972,7 +3101,9 @@ pgsp_entry_remove(pgspEntry *entry)
 		Assert(entry->rdeps == InvalidDsaPointer);
 	}
 
-	/* And remove the hash entry. */
+	/* And remove the hash entry, any remaining reference to it is now stale. */
+	pgsp_slot_release(&entry->ref);
+	pgsp_index_delete(entry);
 	hash_search(pgsp_hash, &entry->key, HASH_REMOVE, NULL);
 }
 
@@ -2170,6 +3301,30 @@ entry_cmp(const void *lhs, const void *rhs)
 		return 0;
 }
 
+/*
+ * Sort the given array of Oid and remove the duplicates.  Returns the number
+ * of remaining elements.
+ */
+static int
+pgsp_sort_oids(Oid *oids, int num)
+{
+	int			i;
+	int			j = 0;
+
+	if (num <= 1)
+		return num;
+
+	qsort(oids, num, sizeof(Oid), oid_cmp);
+
+	for (i = 1; i < num; i++)
+	{
+		if (oids[i] != oids[j])
+			oids[++j] = oids[i];
+	}
+
+	return j + 1;
+}
+
 static Datum
 do_showrels(dsa_pointer rels, int num_rels)
 {
@@ -2255,7 +3410,7 @@ pg_shared_plans_reset(PG_FUNCTION_ARGS)
 }
 
 /* Number of output arguments (columns) for pg_shared_plans_info */
-#define PG_SHARED_PLANS_INFO_COLS	4
+#define PG_SHARED_PLANS_INFO_COLS	6
 
 /*
  * Return statistics of pg_shared_plans.
@@ -2288,6 +3443,8 @@ pg_shared_plans_info(PG_FUNCTION_ARGS)
 		values[i++] = Int32GetDatum(s->rdepend_num);
 		values[i++] = Int64GetDatum(s->alloced_size);
 		values[i++] = Int64GetDatum(s->dealloc);
+		values[i++] = Int64GetDatum(s->rdepend_refused);
+		values[i++] = Int64GetDatum(pg_atomic_read_u64(&s->plantime_rejected));
 		values[i++] = TimestampTzGetDatum(s->stats_reset);
 		SpinLockRelease(&s->mutex);
 	}
@@ -2295,7 +3452,7 @@ pg_shared_plans_info(PG_FUNCTION_ARGS)
 	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
-#define PG_SHARED_PLANS_COLS			17
+#define PG_SHARED_PLANS_COLS			27
 Datum
 pg_shared_plans(PG_FUNCTION_ARGS)
 {
@@ -2308,10 +3465,11 @@ pg_shared_plans(PG_FUNCTION_ARGS)
 	Tuplestorestate *tupstore;
 	MemoryContext per_query_ctx;
 	MemoryContext oldcontext;
-	pgspHashKey	   *rkeys;
+	pgspEntryRef   *rkeys;
 	int				rkeys_max, rkeys_cpt;
 	HASH_SEQ_STATUS hash_seq;
 	pgspEntry  *entry;
+	TimestampTz	now = GetCurrentTimestamp();
 
 	/* check to see if caller supports us returning a tuplestore */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
@@ -2363,7 +3521,7 @@ pg_shared_plans(PG_FUNCTION_ARGS)
 	{
 		pgspRdependKey		rkey = {dbid, RELOID, relid};
 		pgspRdependEntry   *rentry;
-		pgspHashKey		   *tmp_rkeys;
+		pgspEntryRef	   *tmp_rkeys;
 		Size				size;
 
 		rentry = dshash_find(pgsp_rdepend, &rkey, false);
@@ -2382,16 +3540,16 @@ pg_shared_plans(PG_FUNCTION_ARGS)
 		rkeys_max = rentry->num_keys;
 		Assert(rkeys_max > 0);
 		rkeys_cpt = 0;
-		tmp_rkeys = (pgspHashKey *) dsa_get_address(pgsp_area, rentry->keys);
+		tmp_rkeys = (pgspEntryRef *) dsa_get_address(pgsp_area, rentry->keys);
 		Assert(tmp_rkeys != NULL);
 
-		size = sizeof(pgspHashKey) * rentry->num_keys;
-		rkeys = (pgspHashKey *) palloc(size);
+		size = sizeof(pgspEntryRef) * rentry->num_keys;
+		rkeys = (pgspEntryRef *) palloc(size);
 		memcpy(rkeys, tmp_rkeys, size);
 
 		/*
 		 * Release the rdepend entry, we'll iterate over the copy of the stored
-		 * hash keys in the main loop.
+		 * entry references in the main loop.
 		 */
 		dshash_release_lock(pgsp_rdepend, rentry);
 	}
@@ -2416,6 +3574,11 @@ pg_shared_plans(PG_FUNCTION_ARGS)
 		int64		num_custom_plans;
 		double		generic_cost;
 		int64		discard;
+		int64		shadow_hits;
+		double		shadow_time_saved;
+		double		shadow_cost_diff;
+		TimestampTz	last_hit_at;
+		double		hit_rate;
 
 		memset(values, 0, sizeof(values));
 		memset(nulls, 0, sizeof(nulls));
@@ -2430,9 +3593,10 @@ pg_shared_plans(PG_FUNCTION_ARGS)
 			if(rkeys_cpt == rkeys_max)
 				break;
 
-			entry = hash_search(pgsp_hash, &rkeys[rkeys_cpt++], HASH_FIND,
-								NULL);
-			Assert(entry);
+			/* Skip the slots reserved for entries not created yet. */
+			entry = pgsp_slot_get(&rkeys[rkeys_cpt++]);
+			if (!entry)
+				continue;
 		}
 		else
 		{
@@ -2453,8 +3617,16 @@ pg_shared_plans(PG_FUNCTION_ARGS)
 		bypass = entry->bypass;
 		total_custom_cost = entry-> total_custom_cost;
 		num_custom_plans = entry->num_custom_plans;
+		shadow_hits = entry->shadow_hits;
+		shadow_time_saved = entry->shadow_time_saved;
+		shadow_cost_diff = entry->shadow_cost_diff;
+		last_hit_at = entry->last_hit_at;
+		hit_rate = entry->hit_rate;
 		SpinLockRelease(&e->mutex);
 
+		/* The stored rate is only decayed when the entry is hit. */
+		hit_rate *= pgsp_hit_rate_decay(last_hit_at, now);
+
 		if (OidIsValid(entry->key.userid))
 			values[i++] = ObjectIdGetDatum(entry->key.userid);
 		else
@@ -2476,6 +3648,38 @@ pg_shared_plans(PG_FUNCTION_ARGS)
 		values[i++] = Int32GetDatum(entry->num_rdeps);
 		values[i++] = Int64GetDatumFast(discard);
 		values[i++] = UInt32GetDatum(pg_atomic_read_u32(&entry->lockers));
+		values[i++] = Int64GetDatumFast(shadow_hits);
+		values[i++] = Float8GetDatumFast(shadow_time_saved);
+		values[i++] = Float8GetDatumFast(shadow_cost_diff);
+		values[i++] = Int64GetDatum((int64) entry->fingerprint);
+		values[i++] = TimestampTzGetDatum(entry->created_at);
+		if (last_hit_at != 0)
+			values[i++] = TimestampTzGetDatum(last_hit_at);
+		else
+			nulls[i++] = true;
+		if (entry->last_discard_at != 0)
+			values[i++] = TimestampTzGetDatum(entry->last_discard_at);
+		else
+			nulls[i++] = true;
+		if (entry->last_replanned_at != 0)
+			values[i++] = TimestampTzGetDatum(entry->last_replanned_at);
+		else
+			nulls[i++] = true;
+		values[i++] = Float8GetDatum(hit_rate);
+
+		if (entry->has_query_text)
+		{
+			char	   *query_text;
+
+			query_text = pgsp_query_text_get(entry->key.dbid,
+											 entry->key.queryid);
+			if (query_text)
+				values[i++] = CStringGetTextDatum(query_text);
+			else
+				nulls[i++] = true;
+		}
+		else
+			nulls[i++] = true;
 
 		if (showrels)
 		{
@@ -2517,3 +3721,109 @@ pg_shared_plans(PG_FUNCTION_ARGS)
 #endif
 	return (Datum) 0;
 }
+
+static const char *const pgspPlanChangeReasonNames[] = {
+	"new",
+	"discard",
+	"replan"
+};
+
+#define PG_SHARED_PLANS_PLAN_CHANGES_COLS	8
+/*
+ * Return the recorded plan changes of all entries, oldest first for each
+ * entry.
+ */
+Datum
+pg_shared_plans_plan_changes(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	pgspEntry  *entry;
+
+	if (!pgsp || !pgsp_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_shared_plans must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(pgsp->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, pgsp_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		int			first;
+		int			h;
+
+		first = (entry->history_next - entry->history_count +
+				 PGSP_PLAN_HISTORY) % PGSP_PLAN_HISTORY;
+
+		for (h = 0; h < entry->history_count; h++)
+		{
+			Datum		values[PG_SHARED_PLANS_PLAN_CHANGES_COLS];
+			bool		nulls[PG_SHARED_PLANS_PLAN_CHANGES_COLS];
+			pgspPlanChange *change;
+			int			i = 0;
+
+			change = &entry->history[(first + h) % PGSP_PLAN_HISTORY];
+
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			if (OidIsValid(entry->key.userid))
+				values[i++] = ObjectIdGetDatum(entry->key.userid);
+			else
+				nulls[i++] = true;
+			values[i++] = ObjectIdGetDatum(entry->key.dbid);
+			values[i++] = Int64GetDatum((int64) entry->key.queryid);
+			if (OidIsValid(entry->key.constid))
+				values[i++] = ObjectIdGetDatum(entry->key.constid);
+			else
+				nulls[i++] = true;
+			values[i++] = Int64GetDatum((int64) change->fingerprint);
+			values[i++] = Float8GetDatum(change->generic_cost);
+			values[i++] = TimestampTzGetDatum(change->ts);
+			values[i++] = CStringGetTextDatum(
+									pgspPlanChangeReasonNames[change->reason]);
+
+			Assert(i == PG_SHARED_PLANS_PLAN_CHANGES_COLS);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	LWLockRelease(pgsp->lock);
+
+#if PG_VERSION_NUM < 170000
+	/* Should be a no-op anyway. */
+	tuplestore_donestoring(tupstore);
+#endif
+	return (Datum) 0;
+}
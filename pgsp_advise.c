@@ -0,0 +1,333 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_advise.c: Configuration recommendations based on the observed shared
+ *                plan cache behavior.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <math.h>
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "utils/builtins.h"
+
+#include "include/pg_shared_plans.h"
+#include "include/pgsp_rdepend.h"
+
+/* Minimum number of entries having reached the threshold to judge it. */
+#define PGSP_ADVISE_MIN_ENTRIES		10
+
+/*
+ * Summary of the shared plan cache content and counters.
+ */
+typedef struct pgspAdviseStats
+{
+	int64		num_entries;	/* # of entries */
+	int64		num_plans;		/* # of entries having a plan */
+	int64		never_hit;		/* # of entries with a plan never used */
+	double		min_hit_plantime;	/* lowest plantime of a used entry */
+	int64		num_judged;		/* # of entries having reached threshold */
+	int64		num_accepted;	/* # of those preferring the cached plan */
+	double		saved;			/* planning time saved, in ms */
+	int64		dealloc;
+	int64		rdepend_refused;
+	int64		plantime_rejected;
+	int64		alloced_size;
+} pgspAdviseStats;
+
+PG_FUNCTION_INFO_V1(pg_shared_plans_advise);
+
+static void pgsp_advise_collect(pgspAdviseStats *stats);
+static void pgsp_advise_add(Tuplestorestate *tupstore, TupleDesc tupdesc,
+							const char *parameter, const char *setting,
+							const char *recommended, const char *reason);
+static char *pgsp_advise_size(int64 size);
+
+/*
+ * Gather the current counters of all entries and the global statistics.
+ */
+static void
+pgsp_advise_collect(pgspAdviseStats *stats)
+{
+	volatile pgspSharedState *s = (volatile pgspSharedState *) pgsp;
+	HASH_SEQ_STATUS hash_seq;
+	pgspEntry  *entry;
+
+	memset(stats, 0, sizeof(pgspAdviseStats));
+	stats->min_hit_plantime = -1;
+
+	LWLockAcquire(pgsp->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, pgsp_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		volatile pgspEntry *e = (volatile pgspEntry *) entry;
+		int64		bypass;
+		int64		num_custom_plans;
+		bool		cheaper;
+
+		SpinLockAcquire(&e->mutex);
+		bypass = e->bypass;
+		num_custom_plans = e->num_custom_plans;
+		cheaper = (num_custom_plans > 0 && pgsp_generic_plan_cheaper(e));
+		SpinLockRelease(&e->mutex);
+
+		stats->num_entries++;
+		stats->saved += bypass * entry->plantime;
+
+		if (entry->plan == InvalidDsaPointer)
+			continue;
+
+		stats->num_plans++;
+
+		if (bypass == 0)
+			stats->never_hit++;
+		else if (stats->min_hit_plantime < 0 ||
+				 entry->plantime < stats->min_hit_plantime)
+			stats->min_hit_plantime = entry->plantime;
+
+		if (num_custom_plans >= pgsp_threshold)
+		{
+			stats->num_judged++;
+			if (cheaper)
+				stats->num_accepted++;
+		}
+	}
+
+	LWLockRelease(pgsp->lock);
+
+	SpinLockAcquire(&s->mutex);
+	stats->dealloc = s->dealloc;
+	stats->rdepend_refused = s->rdepend_refused;
+	stats->alloced_size = s->alloced_size;
+	SpinLockRelease(&s->mutex);
+	stats->plantime_rejected = pg_atomic_read_u64(&pgsp->plantime_rejected);
+}
+
+static void
+pgsp_advise_add(Tuplestorestate *tupstore, TupleDesc tupdesc,
+				const char *parameter, const char *setting,
+				const char *recommended, const char *reason)
+{
+	Datum		values[4];
+	bool		nulls[4];
+
+	memset(nulls, 0, sizeof(nulls));
+
+	values[0] = CStringGetTextDatum(parameter);
+	values[1] = CStringGetTextDatum(setting);
+	if (recommended)
+		values[2] = CStringGetTextDatum(recommended);
+	else
+		nulls[2] = true;
+	values[3] = CStringGetTextDatum(reason);
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+static char *
+pgsp_advise_size(int64 size)
+{
+	return text_to_cstring(DatumGetTextPP(DirectFunctionCall1(pg_size_pretty,
+												Int64GetDatum(size))));
+}
+
+/*
+ * Recommend values for the main GUCs, based on what has been observed since
+ * the last stats reset, along with the expected memory footprint and planning
+ * time saved.  The heuristics are deliberately simple so that the reason
+ * column can explain them.
+ */
+Datum
+pg_shared_plans_advise(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	pgspAdviseStats stats;
+	int			rec_max = pgsp_max;
+	int			rec_min_plantime = pgsp_min_plantime;
+	int			rec_threshold = pgsp_threshold;
+	int			rec_rdepend_max = pgsp_rdepend_max;
+	char	   *reason;
+	int64		cur_size;
+	int64		rec_size;
+	double		rec_saved;
+
+	if (!pgsp || !pgsp_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_shared_plans must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	pgsp_advise_collect(&stats);
+
+	/*
+	 * pg_shared_plans.max and pg_shared_plans.min_plan_time.  If entries are
+	 * evicted but most of the cached plans are never used, it's better to
+	 * stop admitting cheap plans than to make the cache bigger.
+	 */
+	if (stats.dealloc > 0 && stats.never_hit * 2 > stats.num_plans &&
+		stats.min_hit_plantime > pgsp_min_plantime)
+	{
+		rec_min_plantime = (int) ceil(stats.min_hit_plantime);
+		reason = psprintf(INT64_FORMAT " evictions and " INT64_FORMAT " out of "
+						  INT64_FORMAT " cached plans never used, the cheapest"
+						  " used plan took %.2f ms to plan",
+						  stats.dealloc, stats.never_hit, stats.num_plans,
+						  stats.min_hit_plantime);
+		pgsp_advise_add(tupstore, tupdesc, "pg_shared_plans.min_plan_time",
+						psprintf("%dms", pgsp_min_plantime),
+						psprintf("%dms", rec_min_plantime), reason);
+
+		pgsp_advise_add(tupstore, tupdesc, "pg_shared_plans.max",
+						psprintf("%d", pgsp_max), psprintf("%d", rec_max),
+						"evictions should go away with a higher min_plan_time");
+	}
+	else
+	{
+		if (stats.dealloc > 0)
+		{
+			rec_max = (pgsp_max > INT_MAX / 2) ? INT_MAX : pgsp_max * 2;
+			reason = psprintf(INT64_FORMAT " evictions since stats reset, the cache is"
+							  " too small for the workload", stats.dealloc);
+		}
+		else if (stats.num_entries * 4 < pgsp_max)
+		{
+			rec_max = Max(5, (int) stats.num_entries * 2);
+			reason = psprintf("only " INT64_FORMAT " entries used and no eviction",
+							  stats.num_entries);
+		}
+		else
+			reason = pstrdup("no eviction");
+
+		pgsp_advise_add(tupstore, tupdesc, "pg_shared_plans.max",
+						psprintf("%d", pgsp_max), psprintf("%d", rec_max),
+						reason);
+
+		if (stats.dealloc == 0 && stats.plantime_rejected > 0 &&
+			pgsp_min_plantime > 0 && stats.num_entries < pgsp_max)
+		{
+			rec_min_plantime = pgsp_min_plantime / 2;
+			reason = psprintf(INT64_FORMAT " plans not cached because of"
+							  " min_plan_time while the cache has free room",
+							  stats.plantime_rejected);
+		}
+		else
+			reason = psprintf(INT64_FORMAT " plans not cached because of"
+							  " min_plan_time", stats.plantime_rejected);
+
+		pgsp_advise_add(tupstore, tupdesc, "pg_shared_plans.min_plan_time",
+						psprintf("%dms", pgsp_min_plantime),
+						psprintf("%dms", rec_min_plantime), reason);
+	}
+
+	/*
+	 * pg_shared_plans.threshold.  If almost all entries end up preferring the
+	 * cached plan, the custom plans generated before are wasted.  If most of
+	 * them don't, a more precise average custom cost might help.
+	 */
+	if (stats.num_judged < PGSP_ADVISE_MIN_ENTRIES)
+		reason = psprintf("not enough entries reached the threshold ("
+						  INT64_FORMAT ")", stats.num_judged);
+	else
+	{
+		double		ratio = (double) stats.num_accepted / stats.num_judged;
+
+		if (ratio >= 0.9 && pgsp_threshold > 1)
+			rec_threshold = Max(1, pgsp_threshold / 2);
+		else if (ratio < 0.5 && pgsp_threshold < PLANCACHE_THRESHOLD)
+			rec_threshold = Min(PLANCACHE_THRESHOLD, pgsp_threshold * 2);
+
+		reason = psprintf("%.0f%% of the entries reaching the threshold prefer"
+						  " the cached plan", ratio * 100);
+	}
+	pgsp_advise_add(tupstore, tupdesc, "pg_shared_plans.threshold",
+					psprintf("%d", pgsp_threshold),
+					psprintf("%d", rec_threshold), reason);
+
+	/* pg_shared_plans.rdepend_max */
+	if (stats.rdepend_refused > 0)
+	{
+		rec_rdepend_max = Min(10000, pgsp_rdepend_max * 2);
+		reason = psprintf(INT64_FORMAT " entries refused because of rdepend_max",
+						  stats.rdepend_refused);
+	}
+	else
+		reason = pstrdup("no entry refused");
+	pgsp_advise_add(tupstore, tupdesc, "pg_shared_plans.rdepend_max",
+					psprintf("%d", pgsp_rdepend_max),
+					psprintf("%d", rec_rdepend_max), reason);
+
+	/*
+	 * Expected memory footprint of the cached plans and their reverse
+	 * dependencies, assuming the average size of the current entries.  The
+	 * allocated size already accounts for the plans.
+	 */
+	cur_size = stats.alloced_size;
+	if (stats.num_plans > 0 && rec_max > pgsp_max)
+		rec_size = cur_size / stats.num_plans * rec_max;
+	else
+		rec_size = cur_size;
+	pgsp_advise_add(tupstore, tupdesc, "memory",
+					pgsp_advise_size(cur_size), pgsp_advise_size(rec_size),
+					psprintf("average of %s per cached plan",
+							 pgsp_advise_size(stats.num_plans > 0 ?
+											  cur_size / stats.num_plans : 0)));
+
+	/*
+	 * Planning time saved since the last stats reset.  If the cache is made
+	 * bigger, assume that the additional entries will be as useful as the
+	 * current ones.
+	 */
+	rec_saved = stats.saved;
+	if (stats.num_entries > 0 && rec_max > stats.num_entries &&
+		stats.dealloc > 0)
+		rec_saved += stats.saved / stats.num_entries *
+			(rec_max - stats.num_entries);
+	pgsp_advise_add(tupstore, tupdesc, "planning_time_saved",
+					psprintf("%.2f ms", stats.saved),
+					psprintf("%.2f ms", rec_saved),
+					"since stats reset");
+
+#if PG_VERSION_NUM < 170000
+	/* Should be a no-op anyway. */
+	tuplestore_donestoring(tupstore);
+#endif
+	return (Datum) 0;
+}
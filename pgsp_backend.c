@@ -0,0 +1,267 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_backend.c: Per-backend statistics of the shared plan cache usage.
+ *
+ * Each backend has its own slot in a shared array, indexed by its proc
+ * number, so that the counters can be updated without any contention and be
+ * joined with pg_stat_activity.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#if PG_VERSION_NUM < 150000
+#include "postmaster/autovacuum.h"
+#include "replication/walsender.h"
+#endif
+#include "storage/ipc.h"
+#if PG_VERSION_NUM >= 170000
+#include "storage/procnumber.h"
+#else
+#include "storage/backendid.h"
+#endif
+#include "storage/shmem.h"
+
+#include "include/pg_shared_plans.h"
+#include "include/pgsp_backend.h"
+
+#if PG_VERSION_NUM >= 170000
+#define PGSP_MY_SLOT			MyProcNumber
+#else
+#define PGSP_MY_SLOT			(MyBackendId - 1)
+#endif
+
+/*---- Local variables ----*/
+
+static pgspBackendStats *pgsp_backends = NULL;
+static pgspBackendStats *pgsp_my_backend = NULL;
+
+PG_FUNCTION_INFO_V1(pg_shared_plans_backends);
+
+static void pgsp_backend_exit(int code, Datum arg);
+
+/*
+ * Number of slots in the shared array.
+ */
+int
+pgsp_backend_num_slots(void)
+{
+#if PG_VERSION_NUM >= 150000
+	return MaxBackends;
+#else
+	/*
+	 * MaxBackends isn't initialized yet when the shared memory size is
+	 * requested, so compute it the same way InitializeMaxBackends() does.
+	 */
+	return MaxConnections + autovacuum_max_workers + 1 +
+		max_worker_processes + max_wal_senders;
+#endif
+}
+
+/*
+ * Estimate shared memory space needed for the per-backend statistics.
+ */
+Size
+pgsp_backend_memsize(void)
+{
+	return mul_size(pgsp_backend_num_slots(), sizeof(pgspBackendStats));
+}
+
+/*
+ * Allocate or attach to the per-backend statistics.  Caller must hold
+ * AddinShmemInitLock.
+ */
+void
+pgsp_backend_shmem_startup(void)
+{
+	bool		found;
+	int			i;
+
+	pgsp_backends = ShmemInitStruct("pg_shared_plans backends",
+									pgsp_backend_memsize(),
+									&found);
+
+	if (!found)
+	{
+		memset(pgsp_backends, 0, pgsp_backend_memsize());
+		for (i = 0; i < pgsp_backend_num_slots(); i++)
+			SpinLockInit(&pgsp_backends[i].mutex);
+	}
+}
+
+/*
+ * Reset the slot of the exiting backend.
+ */
+static void
+pgsp_backend_exit(int code, Datum arg)
+{
+	volatile pgspBackendStats *b = pgsp_my_backend;
+
+	SpinLockAcquire(&b->mutex);
+	b->pid = 0;
+	b->lookups = 0;
+	b->hits = 0;
+	b->misses = 0;
+	b->stores = 0;
+	b->validation_failures = 0;
+	b->hook_time = 0;
+	b->bytes_deserialized = 0;
+	SpinLockRelease(&b->mutex);
+
+	pgsp_my_backend = NULL;
+}
+
+/*
+ * Account a shared cache lookup that started at the given time in the
+ * current backend's slot.
+ */
+void
+pgsp_backend_record(instr_time start, pgspBackendLookup lookup, bool stored,
+					bool validation_failed, size_t bytes_deserialized)
+{
+	volatile pgspBackendStats *b;
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	if (pgsp_my_backend == NULL)
+	{
+		int			slot = PGSP_MY_SLOT;
+
+		if (pgsp_backends == NULL || slot < 0 ||
+			slot >= pgsp_backend_num_slots())
+			return;
+
+		/* The slot may still contain the counters of a crashed backend. */
+		pgsp_my_backend = &pgsp_backends[slot];
+		b = pgsp_my_backend;
+		SpinLockAcquire(&b->mutex);
+		b->pid = MyProcPid;
+		b->lookups = 0;
+		b->hits = 0;
+		b->misses = 0;
+		b->stores = 0;
+		b->validation_failures = 0;
+		b->hook_time = 0;
+		b->bytes_deserialized = 0;
+		SpinLockRelease(&b->mutex);
+
+		before_shmem_exit(pgsp_backend_exit, (Datum) 0);
+	}
+
+	b = pgsp_my_backend;
+	SpinLockAcquire(&b->mutex);
+	b->lookups += 1;
+	if (lookup == PGSP_LOOKUP_HIT)
+	{
+		b->hits += 1;
+		b->bytes_deserialized += bytes_deserialized;
+	}
+	else if (lookup == PGSP_LOOKUP_MISS)
+		b->misses += 1;
+	if (stored)
+		b->stores += 1;
+	if (validation_failed)
+		b->validation_failures += 1;
+	b->hook_time += INSTR_TIME_GET_MILLISEC(duration);
+	SpinLockRelease(&b->mutex);
+}
+
+#define PG_SHARED_PLANS_BACKENDS_COLS	8
+/*
+ * Display the counters of all the backends that looked up the shared cache.
+ */
+Datum
+pg_shared_plans_backends(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int			slot;
+
+	if (!pgsp || !pgsp_backends)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_shared_plans must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	for (slot = 0; slot < pgsp_backend_num_slots(); slot++)
+	{
+		volatile pgspBackendStats *b = &pgsp_backends[slot];
+		pgspBackendStats stats;
+		Datum		values[PG_SHARED_PLANS_BACKENDS_COLS];
+		bool		nulls[PG_SHARED_PLANS_BACKENDS_COLS];
+		int			i = 0;
+
+		SpinLockAcquire(&b->mutex);
+		stats.pid = b->pid;
+		stats.lookups = b->lookups;
+		stats.hits = b->hits;
+		stats.misses = b->misses;
+		stats.stores = b->stores;
+		stats.validation_failures = b->validation_failures;
+		stats.hook_time = b->hook_time;
+		stats.bytes_deserialized = b->bytes_deserialized;
+		SpinLockRelease(&b->mutex);
+
+		if (stats.pid == 0)
+			continue;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = Int32GetDatum(stats.pid);
+		values[i++] = Int64GetDatumFast(stats.lookups);
+		values[i++] = Int64GetDatumFast(stats.hits);
+		values[i++] = Int64GetDatumFast(stats.misses);
+		values[i++] = Int64GetDatumFast(stats.stores);
+		values[i++] = Int64GetDatumFast(stats.validation_failures);
+		values[i++] = Float8GetDatumFast(stats.hook_time);
+		values[i++] = Int64GetDatumFast(stats.bytes_deserialized);
+
+		Assert(i == PG_SHARED_PLANS_BACKENDS_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+#if PG_VERSION_NUM < 170000
+	/* Should be a no-op anyway. */
+	tuplestore_donestoring(tupstore);
+#endif
+	return (Datum) 0;
+}
@@ -0,0 +1,409 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_churn.c: Detection of queries cached with many different constants.
+ *
+ * Queries having hardcoded constants get a different constid for each set of
+ * constants, and each of them gets its own entry and plan in the shared
+ * cache.  For each dbid and queryid, the number of distinct constid is
+ * estimated with a small HyperLogLog sketch, so that the worst offenders can
+ * be found, and the number of entries cached for a single queryid can be
+ * limited with pg_shared_plans.max_entries_per_query.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <math.h>
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#endif
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/pg_bitutils.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+
+#include "include/pg_shared_plans.h"
+#include "include/pgsp_churn.h"
+#include "include/pgsp_index.h"
+
+/* Bias correction constant of the estimator for 64 registers */
+#define PGSP_CHURN_ALPHA		0.709
+
+typedef struct pgspChurnVictim
+{
+	pgspChurnEntry *entry;
+	double		estimate;
+} pgspChurnVictim;
+
+/*---- GUC variables ----*/
+
+int			pgsp_max_entries_per_query;
+
+/*---- Local variables ----*/
+
+static HTAB *pgsp_churn = NULL;
+
+PG_FUNCTION_INFO_V1(pg_shared_plans_churn);
+
+static void pgsp_churn_add(uint8 *registers, uint32 constid);
+static void pgsp_churn_dealloc(void);
+static double pgsp_churn_estimate(const uint8 *registers);
+static pgspChurnEntry *pgsp_churn_find(pgspHashKey *key);
+static int victim_cmp(const void *lhs, const void *rhs);
+
+/*
+ * Estimate shared memory space needed for the churn detection.
+ */
+Size
+pgsp_churn_memsize(void)
+{
+	return hash_estimate_size(PGSP_CHURN_MAX, sizeof(pgspChurnEntry));
+}
+
+/*
+ * Allocate or attach to the churn hash table.  Caller must hold
+ * AddinShmemInitLock.
+ */
+void
+pgsp_churn_shmem_startup(void)
+{
+	HASHCTL		info;
+
+	info.keysize = sizeof(pgspChurnKey);
+	info.entrysize = sizeof(pgspChurnEntry);
+	pgsp_churn = ShmemInitHash("pg_shared_plans churn",
+							   PGSP_CHURN_MAX, PGSP_CHURN_MAX,
+							   &info,
+							   HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * Add the given constid to the sketch.
+ */
+static void
+pgsp_churn_add(uint8 *registers, uint32 constid)
+{
+	uint32		h = DatumGetUInt32(hash_uint32(constid));
+	uint32		w = h >> PGSP_CHURN_BITS;
+	uint8		rank;
+
+	if (w == 0)
+		rank = 32 - PGSP_CHURN_BITS + 1;
+	else
+		rank = pg_rightmost_one_pos32(w) + 1;
+
+	if (registers[h & (PGSP_CHURN_REGISTERS - 1)] < rank)
+		registers[h & (PGSP_CHURN_REGISTERS - 1)] = rank;
+}
+
+/*
+ * Estimate the number of distinct constid added to the sketch.
+ */
+static double
+pgsp_churn_estimate(const uint8 *registers)
+{
+	double		sum = 0;
+	int			zeros = 0;
+	double		estimate;
+	int			i;
+
+	for (i = 0; i < PGSP_CHURN_REGISTERS; i++)
+	{
+		sum += ldexp(1.0, -registers[i]);
+		if (registers[i] == 0)
+			zeros++;
+	}
+
+	estimate = PGSP_CHURN_ALPHA * PGSP_CHURN_REGISTERS * PGSP_CHURN_REGISTERS
+		/ sum;
+
+	/* Use linear counting for small cardinalities. */
+	if (estimate <= 2.5 * PGSP_CHURN_REGISTERS && zeros > 0)
+		estimate = PGSP_CHURN_REGISTERS *
+			log((double) PGSP_CHURN_REGISTERS / zeros);
+
+	return estimate;
+}
+
+static pgspChurnEntry *
+pgsp_churn_find(pgspHashKey *key)
+{
+	pgspChurnKey ckey;
+
+	/* The key has padding bytes. */
+	memset(&ckey, 0, sizeof(pgspChurnKey));
+	ckey.dbid = key->dbid;
+	ckey.queryid = key->queryid;
+
+	return (pgspChurnEntry *) hash_search(pgsp_churn, &ckey, HASH_FIND, NULL);
+}
+
+/*
+ * Account a new plan about to be stored for the given key, and check whether
+ * its queryid can have yet another cached entry.  An already existing entry,
+ * e.g. one whose plan was discarded, can always store a new plan.  Caller
+ * mustn't hold the LWLock.
+ *
+ * The limit is checked before storing the plan to avoid wasting the effort,
+ * so concurrent backends may still exceed it slightly.
+ */
+bool
+pgsp_churn_check(pgspHashKey *key, uint32 hashvalue)
+{
+	pgspChurnEntry *entry;
+	bool		allowed = true;
+
+	Assert(!LWLockHeldByMe(pgsp->lock));
+	LWLockAcquire(pgsp->lock, LW_SHARED);
+
+	entry = pgsp_churn_find(key);
+	if (entry)
+	{
+		volatile pgspChurnEntry *e = (volatile pgspChurnEntry *) entry;
+
+		allowed = (pgsp_max_entries_per_query == 0 ||
+				   entry->num_entries < pgsp_max_entries_per_query ||
+				   pgsp_index_lookup(key, hashvalue) != NULL);
+
+		SpinLockAcquire(&e->mutex);
+		pgsp_churn_add(entry->registers, key->constid);
+		if (!allowed)
+			e->refused += 1;
+		SpinLockRelease(&e->mutex);
+	}
+
+	LWLockRelease(pgsp->lock);
+
+	return allowed;
+}
+
+/*
+ * Account a new entry in the shared cache.  Caller must hold an exclusive
+ * lock on pgsp->lock.
+ */
+void
+pgsp_churn_entry_added(pgspHashKey *key)
+{
+	pgspChurnEntry *entry;
+	pgspChurnKey ckey;
+	bool		found;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+
+	/* Make space if needed */
+	if (hash_get_num_entries(pgsp_churn) >= PGSP_CHURN_MAX)
+		pgsp_churn_dealloc();
+
+	memset(&ckey, 0, sizeof(pgspChurnKey));
+	ckey.dbid = key->dbid;
+	ckey.queryid = key->queryid;
+
+	entry = (pgspChurnEntry *) hash_search(pgsp_churn, &ckey, HASH_ENTER,
+										   &found);
+
+	if (!found)
+	{
+		entry->num_entries = 0;
+		SpinLockInit(&entry->mutex);
+		entry->refused = 0;
+		memset(entry->registers, 0, sizeof(entry->registers));
+	}
+
+	/* No need for the spinlock as we have an exclusive lock on pgsp->lock. */
+	entry->num_entries++;
+	pgsp_churn_add(entry->registers, key->constid);
+}
+
+/*
+ * Account an entry removed from the shared cache.  The churn entry is kept,
+ * so the number of distinct constid isn't lost when all the entries of a
+ * queryid are evicted.  Caller must hold an exclusive lock on pgsp->lock.
+ */
+void
+pgsp_churn_entry_removed(pgspHashKey *key)
+{
+	pgspChurnEntry *entry;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+
+	entry = pgsp_churn_find(key);
+
+	/* Should not happen, but be safe. */
+	if (!entry)
+		return;
+
+	Assert(entry->num_entries > 0);
+	entry->num_entries--;
+}
+
+/*
+ * Remove half of the tracked queries without any cached entry, those having
+ * the less distinct constid first.  As there can't be more queries having
+ * cached entries than pg_shared_plans.max, there are always enough of them.
+ *
+ * Caller must hold an exclusive lock on pgsp->lock.
+ */
+static void
+pgsp_churn_dealloc(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgspChurnVictim *victims;
+	pgspChurnEntry *entry;
+	int			nvictims = 0;
+	int			i;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+
+	victims = palloc(hash_get_num_entries(pgsp_churn) *
+					 sizeof(pgspChurnVictim));
+
+	hash_seq_init(&hash_seq, pgsp_churn);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->num_entries > 0)
+			continue;
+
+		victims[nvictims].entry = entry;
+		victims[nvictims].estimate = pgsp_churn_estimate(entry->registers);
+		nvictims++;
+	}
+
+	qsort(victims, nvictims, sizeof(pgspChurnVictim), victim_cmp);
+
+	/* Now zap the lower half of them, or the only one. */
+	nvictims = Min(nvictims, Max(1, nvictims / 2));
+
+	for (i = 0; i < nvictims; i++)
+		hash_search(pgsp_churn, &victims[i].entry->key, HASH_REMOVE, NULL);
+
+	pfree(victims);
+}
+
+/*
+ * Forget all the tracked queries without any cached entry.  Caller must hold
+ * an exclusive lock on pgsp->lock.
+ */
+void
+pgsp_churn_reset(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgspChurnEntry *entry;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+
+	hash_seq_init(&hash_seq, pgsp_churn);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (entry->num_entries == 0)
+			hash_search(pgsp_churn, &entry->key, HASH_REMOVE, NULL);
+	}
+}
+
+static int
+victim_cmp(const void *lhs, const void *rhs)
+{
+	double		l_estimate = ((const pgspChurnVictim *) lhs)->estimate;
+	double		r_estimate = ((const pgspChurnVictim *) rhs)->estimate;
+
+	if (l_estimate < r_estimate)
+		return -1;
+	else if (l_estimate > r_estimate)
+		return +1;
+	else
+		return 0;
+}
+
+#define PG_SHARED_PLANS_CHURN_COLS	5
+/*
+ * Display the estimated number of distinct constid of each tracked query.
+ */
+Datum
+pg_shared_plans_churn(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	pgspChurnEntry *entry;
+
+	if (!pgsp || !pgsp_churn)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_shared_plans must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(pgsp->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, pgsp_churn);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		volatile pgspChurnEntry *e = (volatile pgspChurnEntry *) entry;
+		Datum		values[PG_SHARED_PLANS_CHURN_COLS];
+		bool		nulls[PG_SHARED_PLANS_CHURN_COLS];
+		uint8		registers[PGSP_CHURN_REGISTERS];
+		int64		refused;
+		int			i = 0;
+
+		SpinLockAcquire(&e->mutex);
+		memcpy(registers, entry->registers, sizeof(registers));
+		refused = e->refused;
+		SpinLockRelease(&e->mutex);
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(entry->key.dbid);
+		values[i++] = Int64GetDatum((int64) entry->key.queryid);
+		values[i++] = Int64GetDatum((int64) rint(pgsp_churn_estimate(registers)));
+		values[i++] = Int32GetDatum(entry->num_entries);
+		values[i++] = Int64GetDatumFast(refused);
+
+		Assert(i == PG_SHARED_PLANS_CHURN_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(pgsp->lock);
+
+#if PG_VERSION_NUM < 170000
+	/* Should be a no-op anyway. */
+	tuplestore_donestoring(tupstore);
+#endif
+	return (Datum) 0;
+}
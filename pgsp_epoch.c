@@ -0,0 +1,219 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_epoch.c: Lazy validation of the cached plans.
+ *
+ * With pg_shared_plans.validation set to lazy, DDL doesn't look for the
+ * dependent entries to discard their plans.  Instead, every backend bumps a
+ * shared epoch for each relation and object it receives an invalidation for,
+ * the same invalidations the core plancache relies on, and an entry's plan is
+ * only used if none of its dependencies was invalidated since the epoch at
+ * which it was planned.  Outdated plans are replaced the next time the entry
+ * is stored.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#endif
+#include "miscadmin.h"
+#include "storage/shmem.h"
+#include "storage/sinval.h"
+#include "utils/inval.h"
+#include "utils/syscache.h"
+
+#include "include/pgsp_epoch.h"
+
+/*---- GUC variables ----*/
+
+int			pgsp_validation = PGSP_VALIDATION_EAGER;
+
+/*---- Local variables ----*/
+
+static pgspEpochs *pgsp_epochs = NULL;
+
+static pg_atomic_uint64 *pgsp_epoch_slot(Oid dbid, Oid classid, uint32 value);
+static void pgsp_epoch_bump(Oid classid, uint32 value);
+static void pgsp_epoch_relcache_callback(Datum arg, Oid relid);
+static void pgsp_epoch_syscache_callback(Datum arg, int cacheid,
+										 uint32 hashvalue);
+
+/*
+ * Estimate shared memory space needed for the epochs.
+ */
+Size
+pgsp_epoch_memsize(void)
+{
+	return sizeof(pgspEpochs);
+}
+
+/*
+ * Allocate or attach to the epochs.  Caller must hold AddinShmemInitLock.
+ */
+void
+pgsp_epoch_shmem_startup(void)
+{
+	bool		found;
+	int			i;
+
+	pgsp_epochs = ShmemInitStruct("pg_shared_plans epochs",
+								  pgsp_epoch_memsize(),
+								  &found);
+
+	if (!found)
+	{
+		pg_atomic_init_u64(&pgsp_epochs->current, 0);
+		for (i = 0; i < PGSP_EPOCH_SLOTS; i++)
+			pg_atomic_init_u64(&pgsp_epochs->slots[i], 0);
+	}
+}
+
+/*
+ * Register the invalidation callbacks.  Only needed in lazy mode, eager mode
+ * doesn't pay for it.
+ */
+void
+pgsp_epoch_register_callbacks(void)
+{
+	if (pgsp_validation != PGSP_VALIDATION_LAZY)
+		return;
+
+	CacheRegisterRelcacheCallback(pgsp_epoch_relcache_callback, (Datum) 0);
+
+	/* The dependencies we track. */
+	CacheRegisterSyscacheCallback(PROCOID, pgsp_epoch_syscache_callback,
+								  (Datum) 0);
+	CacheRegisterSyscacheCallback(TYPEOID, pgsp_epoch_syscache_callback,
+								  (Datum) 0);
+
+	/* The ones the core plancache also considers invalidating all plans. */
+	CacheRegisterSyscacheCallback(NAMESPACEOID, pgsp_epoch_syscache_callback,
+								  (Datum) 0);
+	CacheRegisterSyscacheCallback(OPEROID, pgsp_epoch_syscache_callback,
+								  (Datum) 0);
+	CacheRegisterSyscacheCallback(AMOPOPID, pgsp_epoch_syscache_callback,
+								  (Datum) 0);
+	CacheRegisterSyscacheCallback(FOREIGNSERVEROID,
+								  pgsp_epoch_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(FOREIGNDATAWRAPPEROID,
+								  pgsp_epoch_syscache_callback, (Datum) 0);
+}
+
+static pg_atomic_uint64 *
+pgsp_epoch_slot(Oid dbid, Oid classid, uint32 value)
+{
+	uint32		h;
+
+	h = hash_combine(DatumGetUInt32(hash_uint32(dbid)), classid);
+	h = hash_combine(h, DatumGetUInt32(hash_uint32(value)));
+
+	return &pgsp_epochs->slots[h & (PGSP_EPOCH_SLOTS - 1)];
+}
+
+/*
+ * Record that the given object was invalidated in the current database.  An
+ * InvalidOid classid means that everything was invalidated.
+ */
+static void
+pgsp_epoch_bump(Oid classid, uint32 value)
+{
+	pg_atomic_uint64 *slot;
+	uint64		epoch;
+	uint64		old;
+
+	if (pgsp_epochs == NULL)
+		return;
+
+	slot = pgsp_epoch_slot(MyDatabaseId, classid, value);
+	epoch = pg_atomic_add_fetch_u64(&pgsp_epochs->current, 1);
+
+	/* Concurrent bumps of the same slot must not make it go backward. */
+	old = pg_atomic_read_u64(slot);
+	while (old < epoch)
+	{
+		if (pg_atomic_compare_exchange_u64(slot, &old, epoch))
+			break;
+	}
+}
+
+static void
+pgsp_epoch_relcache_callback(Datum arg, Oid relid)
+{
+	/* InvalidOid means all relations. */
+	if (!OidIsValid(relid))
+		pgsp_epoch_bump(InvalidOid, 0);
+	else
+		pgsp_epoch_bump(RELOID, relid);
+}
+
+static void
+pgsp_epoch_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	/* Zero hash value means all entries of the cache. */
+	if ((cacheid == PROCOID || cacheid == TYPEOID) && hashvalue != 0)
+		pgsp_epoch_bump(cacheid, hashvalue);
+	else
+		pgsp_epoch_bump(InvalidOid, 0);
+}
+
+/*
+ * Return the epoch to associate with a plan about to be generated.
+ *
+ * The epoch is read before processing the pending invalidations, so that any
+ * invalidation a backend accounted for with an epoch lower or equal to it was
+ * already queued, and will be taken into account by the planner.
+ */
+uint64
+pgsp_epoch_start_planning(void)
+{
+	uint64		epoch;
+
+	if (pgsp_validation != PGSP_VALIDATION_LAZY)
+		return 0;
+
+	epoch = pg_atomic_read_u64(&pgsp_epochs->current);
+	AcceptInvalidationMessages();
+
+	return epoch;
+}
+
+/*
+ * Check that none of the given dependencies was invalidated since the given
+ * epoch.  Caller should have acquired the locks on the relations first, so
+ * that the pending invalidations are processed.
+ */
+bool
+pgsp_epoch_valid(uint64 epoch, Oid dbid, Oid *rels, int num_rels,
+				 pgspRdependKey *rdeps, int num_rdeps)
+{
+	int			i;
+
+	Assert(pgsp_validation == PGSP_VALIDATION_LAZY);
+
+	if (pg_atomic_read_u64(pgsp_epoch_slot(dbid, InvalidOid, 0)) > epoch)
+		return false;
+
+	for (i = 0; i < num_rels; i++)
+	{
+		if (pg_atomic_read_u64(pgsp_epoch_slot(dbid, RELOID, rels[i])) > epoch)
+			return false;
+	}
+
+	for (i = 0; i < num_rdeps; i++)
+	{
+		if (pg_atomic_read_u64(pgsp_epoch_slot(rdeps[i].dbid, rdeps[i].classid,
+											   rdeps[i].oid)) > epoch)
+			return false;
+	}
+
+	return true;
+}
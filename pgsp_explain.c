@@ -0,0 +1,255 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_explain.c: Shared cache provenance of the plans shown by EXPLAIN.
+ *
+ * The planner hook remembers the last plans it returned in the backend's
+ * local memory, with the shared cache key, whether the plan came from the
+ * shared cache and its total cost before the plancache bypass adjustment.
+ * Starting with PostgreSQL 18, this is added to the EXPLAIN output if
+ * pg_shared_plans.explain_provenance is enabled.  It relies on
+ * explain_per_plan_hook, which auto_explain doesn't call, so the plans it
+ * logs never include it.  On all versions, the same information is available
+ * with pg_shared_plans_provenance().
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#if PG_VERSION_NUM >= 180000
+#include "commands/explain.h"
+#include "commands/explain_format.h"
+#include "commands/explain_state.h"
+#endif
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "utils/builtins.h"
+
+#include "include/pgsp_explain.h"
+
+/*---- GUC variables ----*/
+
+bool		pgsp_explain_provenance;
+
+/*---- Local variables ----*/
+
+#if PG_VERSION_NUM >= 180000
+static explain_per_plan_hook_type prev_explain_per_plan_hook = NULL;
+#endif
+
+static pgspExplainRecord pgsp_explain_records[PGSP_EXPLAIN_RECORDS];
+static int	pgsp_explain_next = 0;
+static int	pgsp_explain_count = 0;
+
+static const char *const pgspBackendLookupNames[] = {
+	"hit",
+	"miss",
+	"custom"
+};
+
+PG_FUNCTION_INFO_V1(pg_shared_plans_provenance);
+
+#if PG_VERSION_NUM >= 180000
+static pgspExplainRecord *pgsp_explain_find(PlannedStmt *stmt);
+static void pgsp_explain_per_plan(PlannedStmt *plannedstmt,
+								  IntoClause *into,
+								  ExplainState *es,
+								  const char *queryString,
+								  ParamListInfo params,
+								  QueryEnvironment *queryEnv);
+#endif
+
+/*
+ * Install the explain hooks, if the server has any.
+ */
+void
+pgsp_explain_install_hooks(void)
+{
+#if PG_VERSION_NUM >= 180000
+	prev_explain_per_plan_hook = explain_per_plan_hook;
+	explain_per_plan_hook = pgsp_explain_per_plan;
+#endif
+}
+
+/*
+ * Remember the provenance of a plan returned by the planner hook, for a
+ * lookup that started at the given time.
+ */
+void
+pgsp_explain_record(PlannedStmt *stmt, pgspHashKey *key,
+					pgspBackendLookup lookup, bool stored, Cost original_cost,
+					instr_time start)
+{
+	pgspExplainRecord *rec;
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	rec = &pgsp_explain_records[pgsp_explain_next];
+	rec->stmt = stmt;
+	rec->key = *key;
+	rec->lookup = lookup;
+	rec->stored = stored;
+	rec->original_cost = original_cost;
+	rec->cost = stmt->planTree->total_cost;
+	rec->lookup_time = INSTR_TIME_GET_MILLISEC(duration);
+
+	pgsp_explain_next = (pgsp_explain_next + 1) % PGSP_EXPLAIN_RECORDS;
+	if (pgsp_explain_count < PGSP_EXPLAIN_RECORDS)
+		pgsp_explain_count++;
+}
+
+#if PG_VERSION_NUM >= 180000
+/*
+ * Find the most recent record for the given plan.  The plan could have been
+ * freed and its memory reused for another plan, so also check that the query
+ * identifier and the cost still match.
+ */
+static pgspExplainRecord *
+pgsp_explain_find(PlannedStmt *stmt)
+{
+	int			i;
+
+	for (i = 1; i <= pgsp_explain_count; i++)
+	{
+		pgspExplainRecord *rec;
+
+		rec = &pgsp_explain_records[(pgsp_explain_next - i +
+									 PGSP_EXPLAIN_RECORDS) %
+									PGSP_EXPLAIN_RECORDS];
+
+		if (rec->stmt == stmt &&
+			rec->key.queryid == stmt->queryId &&
+			rec->cost == stmt->planTree->total_cost)
+			return rec;
+	}
+
+	return NULL;
+}
+
+static void
+pgsp_explain_per_plan(PlannedStmt *plannedstmt, IntoClause *into,
+					  ExplainState *es, const char *queryString,
+					  ParamListInfo params, QueryEnvironment *queryEnv)
+{
+	pgspExplainRecord *rec;
+
+	if (prev_explain_per_plan_hook)
+		prev_explain_per_plan_hook(plannedstmt, into, es, queryString, params,
+								   queryEnv);
+
+	if (!pgsp_explain_provenance)
+		return;
+
+	rec = pgsp_explain_find(plannedstmt);
+	if (rec == NULL)
+		return;
+
+	ExplainPropertyText("Shared Plan", pgspBackendLookupNames[rec->lookup],
+						es);
+	ExplainPropertyText("Shared Plan Key",
+						psprintf("userid=%u dbid=%u queryid=" INT64_FORMAT
+								 " constid=%u",
+								 rec->key.userid, rec->key.dbid,
+								 (int64) rec->key.queryid,
+								 rec->key.constid),
+						es);
+	if (rec->stored)
+		ExplainPropertyBool("Shared Plan Stored", true, es);
+	if (es->costs && rec->lookup == PGSP_LOOKUP_HIT)
+		ExplainPropertyFloat("Shared Plan Original Cost", NULL,
+							 rec->original_cost, 2, es);
+	if (es->analyze && es->timing)
+		ExplainPropertyFloat("Shared Plan Lookup Time", "ms",
+							 rec->lookup_time, 3, es);
+}
+#endif
+
+#define PG_SHARED_PLANS_PROVENANCE_COLS	10
+/*
+ * Return the provenance of the last plans returned by the planner hook in the
+ * current backend, most recent first.
+ */
+Datum
+pg_shared_plans_provenance(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int			n;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	for (n = 1; n <= pgsp_explain_count; n++)
+	{
+		pgspExplainRecord *rec;
+		Datum		values[PG_SHARED_PLANS_PROVENANCE_COLS];
+		bool		nulls[PG_SHARED_PLANS_PROVENANCE_COLS];
+		int			i = 0;
+
+		rec = &pgsp_explain_records[(pgsp_explain_next - n +
+									 PGSP_EXPLAIN_RECORDS) %
+									PGSP_EXPLAIN_RECORDS];
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		if (OidIsValid(rec->key.userid))
+			values[i++] = ObjectIdGetDatum(rec->key.userid);
+		else
+			nulls[i++] = true;
+		values[i++] = ObjectIdGetDatum(rec->key.dbid);
+		values[i++] = Int64GetDatum((int64) rec->key.queryid);
+		if (OidIsValid(rec->key.constid))
+			values[i++] = ObjectIdGetDatum(rec->key.constid);
+		else
+			nulls[i++] = true;
+		values[i++] = CStringGetTextDatum(pgspBackendLookupNames[rec->lookup]);
+		values[i++] = BoolGetDatum(rec->stored);
+		values[i++] = Float8GetDatumFast(rec->original_cost);
+		values[i++] = Float8GetDatumFast(rec->cost);
+		values[i++] = Float8GetDatumFast(rec->lookup_time);
+		values[i++] = Int32GetDatum(n);
+
+		Assert(i == PG_SHARED_PLANS_PROVENANCE_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+#if PG_VERSION_NUM < 170000
+	/* Should be a no-op anyway. */
+	tuplestore_donestoring(tupstore);
+#endif
+	return (Datum) 0;
+}
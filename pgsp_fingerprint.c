@@ -0,0 +1,346 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_fingerprint.c: Plan shape and query fingerprinting.
+ *
+ * The fingerprint of a plan only depends on its shape: the node types, join
+ * types, aggregation strategies and scanned relations and indexes.  Costs,
+ * row estimates and expressions are ignored, so that two plans having the
+ * same fingerprint would be displayed the same way by EXPLAIN (COSTS OFF),
+ * give or take the expressions.
+ *
+ * The fingerprint of a query is a hash of the whole analyzed query tree,
+ * ignoring the token locations, constant values, aliases and result column
+ * names like the core query identifier does, so that it can be used instead
+ * of the query identifier when none is otherwise computed.  The constid still
+ * accounts for what is ignored.  The fingerprints computed by this backend
+ * are remembered, so that the planner can tell them apart from query
+ * identifiers computed by a third-party module.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#endif
+#include "miscadmin.h"
+#include "nodes/nodes.h"
+#include "parser/parsetree.h"
+#include "utils/hsearch.h"
+
+#include "include/pgsp_fingerprint.h"
+
+/*
+ * Maximum number of query fingerprints remembered by a backend.  Forgetting
+ * one is safe, the query is then handled as if it had a third-party query
+ * identifier.
+ */
+#define PGSP_MAX_FINGERPRINTS		10000
+
+/* Query fingerprints computed by this backend */
+static HTAB *pgsp_fingerprints = NULL;
+
+static uint64 pgsp_fingerprint_plan(uint64 h, Plan *plan, PlannedStmt *stmt);
+static uint64 pgsp_fingerprint_list(uint64 h, List *plans, PlannedStmt *stmt);
+static bool pgsp_fingerprint_ignored_field(const char *name, int len);
+static char *pgsp_fingerprint_skip_value(char *p);
+
+static uint64
+pgsp_fingerprint_list(uint64 h, List *plans, PlannedStmt *stmt)
+{
+	ListCell   *lc;
+
+	foreach(lc, plans)
+		h = pgsp_fingerprint_plan(h, (Plan *) lfirst(lc), stmt);
+
+	return h;
+}
+
+static uint64
+pgsp_fingerprint_plan(uint64 h, Plan *plan, PlannedStmt *stmt)
+{
+	if (plan == NULL)
+		return hash_combine64(h, 0);
+
+	/* Guard against stack overflow due to overly complex plans */
+	check_stack_depth();
+
+	h = hash_combine64(h, nodeTag(plan));
+
+	switch (nodeTag(plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapIndexScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+#if PG_VERSION_NUM >= 140000
+		case T_TidRangeScan:
+#endif
+		case T_ForeignScan:
+		case T_CustomScan:
+			{
+				Index		scanrelid = ((Scan *) plan)->scanrelid;
+
+				if (scanrelid > 0)
+					h = hash_combine64(h, rt_fetch(scanrelid,
+												   stmt->rtable)->relid);
+			}
+			break;
+		case T_NestLoop:
+		case T_MergeJoin:
+		case T_HashJoin:
+			h = hash_combine64(h, ((Join *) plan)->jointype);
+			break;
+		case T_Agg:
+			h = hash_combine64(h, ((Agg *) plan)->aggstrategy);
+			break;
+		case T_SetOp:
+			h = hash_combine64(h, ((SetOp *) plan)->strategy);
+			break;
+		default:
+			break;
+	}
+
+	/* Indexes are part of the shape. */
+	switch (nodeTag(plan))
+	{
+		case T_IndexScan:
+			h = hash_combine64(h, ((IndexScan *) plan)->indexid);
+			break;
+		case T_IndexOnlyScan:
+			h = hash_combine64(h, ((IndexOnlyScan *) plan)->indexid);
+			break;
+		case T_BitmapIndexScan:
+			h = hash_combine64(h, ((BitmapIndexScan *) plan)->indexid);
+			break;
+		default:
+			break;
+	}
+
+	/* Children that aren't in lefttree / righttree. */
+	switch (nodeTag(plan))
+	{
+		case T_Append:
+			h = pgsp_fingerprint_list(h, ((Append *) plan)->appendplans, stmt);
+			break;
+		case T_MergeAppend:
+			h = pgsp_fingerprint_list(h, ((MergeAppend *) plan)->mergeplans,
+									  stmt);
+			break;
+		case T_BitmapAnd:
+			h = pgsp_fingerprint_list(h, ((BitmapAnd *) plan)->bitmapplans,
+									  stmt);
+			break;
+		case T_BitmapOr:
+			h = pgsp_fingerprint_list(h, ((BitmapOr *) plan)->bitmapplans,
+									  stmt);
+			break;
+		case T_SubqueryScan:
+			h = pgsp_fingerprint_plan(h, ((SubqueryScan *) plan)->subplan,
+									  stmt);
+			break;
+		case T_CustomScan:
+			h = pgsp_fingerprint_list(h, ((CustomScan *) plan)->custom_plans,
+									  stmt);
+			break;
+		default:
+			break;
+	}
+
+	h = pgsp_fingerprint_plan(h, plan->lefttree, stmt);
+	h = pgsp_fingerprint_plan(h, plan->righttree, stmt);
+
+	return h;
+}
+
+/*
+ * Compute the fingerprint of the given plan, including its subplans.
+ */
+uint64
+pgsp_plan_fingerprint(PlannedStmt *stmt)
+{
+	uint64		h;
+
+	h = pgsp_fingerprint_plan(0, stmt->planTree, stmt);
+	h = pgsp_fingerprint_list(h, stmt->subplans, stmt);
+
+	return h;
+}
+
+/*
+ * Should the given field of a serialized node be ignored in the query
+ * fingerprint?  The token locations and statement length only depend on the
+ * formatting of the query string, and the constant values, aliases and result
+ * column names are accounted for by the constid.
+ */
+static bool
+pgsp_fingerprint_ignored_field(const char *name, int len)
+{
+	if (len >= 8 && strncmp(name + len - 8, "location", 8) == 0)
+		return true;
+
+	if (len == 8 && strncmp(name, "stmt_len", 8) == 0)
+		return true;
+
+	if ((len == 10 && strncmp(name, "constvalue", 10) == 0) ||
+		(len == 11 && strncmp(name, "constisnull", 11) == 0))
+		return true;
+
+	if ((len == 5 && strncmp(name, "alias", 5) == 0) ||
+		(len == 4 && strncmp(name, "eref", 4) == 0) ||
+		(len == 7 && strncmp(name, "resname", 7) == 0))
+		return true;
+
+	return false;
+}
+
+/*
+ * Skip the value of a field of a serialized node, which is either a single
+ * token, a node, a list or a datum, and return a pointer just past it.
+ */
+static char *
+pgsp_fingerprint_skip_value(char *p)
+{
+	int			depth = 0;
+
+	p += strspn(p, " ");
+
+	/* A datum is its length followed by its bytes, or <> if null. */
+	if (*p >= '0' && *p <= '9')
+	{
+		p += strspn(p, "0123456789");
+		if (strncmp(p, " [", 2) == 0)
+		{
+			char	   *end = strchr(p, ']');
+
+			p = end ? end + 1 : p + strlen(p);
+		}
+		return p;
+	}
+
+	/* Nodes and lists are skipped as a whole, tokens escape their braces. */
+	for (; *p != '\0'; p++)
+	{
+		if (*p == '\\')
+		{
+			if (p[1] != '\0')
+				p++;
+			continue;
+		}
+
+		if (*p == '{' || *p == '(')
+			depth++;
+		else if (*p == '}' || *p == ')')
+		{
+			if (depth == 0)
+				break;
+			if (--depth == 0)
+				return p + 1;
+		}
+		else if (*p == ' ' && depth == 0)
+			break;
+	}
+
+	return p;
+}
+
+/*
+ * Compute the fingerprint of the given analyzed query.
+ *
+ * The query is serialized with nodeToString(), which covers every field of
+ * every node in a single pass and is what the catalogs rely on to store query
+ * trees, and the ignored fields are skipped while hashing the result.
+ */
+uint64
+pgsp_query_fingerprint(Query *query)
+{
+	char	   *str = nodeToString(query);
+	char	   *start = str;
+	char	   *p = str;
+	uint64		h = 0;
+
+	while ((p = strstr(p, " :")) != NULL)
+	{
+		char	   *name = p + 2;
+		int			len = strcspn(name, " ");
+
+		/* An escaped space is part of a token, not a field separator. */
+		if (p > str && p[-1] == '\\')
+		{
+			p = name;
+			continue;
+		}
+
+		if (!pgsp_fingerprint_ignored_field(name, len))
+		{
+			p = name + len;
+			continue;
+		}
+
+		/* Hash everything before the field, and skip the field and its value. */
+		h = hash_combine64(h, DatumGetUInt64(hash_any_extended(
+									(const unsigned char *) start,
+									p - start, 0)));
+
+		p = pgsp_fingerprint_skip_value(name + len);
+		start = p;
+	}
+
+	h = hash_combine64(h, DatumGetUInt64(hash_any_extended(
+								(const unsigned char *) start,
+								strlen(start), 0)));
+
+	pfree(str);
+
+	return h;
+}
+
+/*
+ * Remember that the given query identifier is one of our fingerprints.
+ */
+void
+pgsp_fingerprint_remember(uint64 fingerprint)
+{
+	if (pgsp_fingerprints != NULL &&
+		hash_get_num_entries(pgsp_fingerprints) >= PGSP_MAX_FINGERPRINTS)
+	{
+		hash_destroy(pgsp_fingerprints);
+		pgsp_fingerprints = NULL;
+	}
+
+	if (pgsp_fingerprints == NULL)
+	{
+		HASHCTL		info;
+
+		memset(&info, 0, sizeof(HASHCTL));
+		info.keysize = sizeof(uint64);
+		info.entrysize = sizeof(uint64);
+		pgsp_fingerprints = hash_create("pg_shared_plans fingerprints", 128,
+										&info, HASH_ELEM | HASH_BLOBS);
+	}
+
+	(void) hash_search(pgsp_fingerprints, &fingerprint, HASH_ENTER, NULL);
+}
+
+/*
+ * Is the given query identifier a fingerprint computed by this backend?
+ */
+bool
+pgsp_fingerprint_is_builtin(uint64 queryid)
+{
+	if (pgsp_fingerprints == NULL)
+		return false;
+
+	return hash_search(pgsp_fingerprints, &queryid, HASH_FIND, NULL) != NULL;
+}
@@ -0,0 +1,203 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_index.c: Open-addressing index of the pgsp_hash entries.
+ *
+ * pgsp_hash is a dynahash, which chains the entries in its buckets and
+ * computes the key hash on every search.  As the hit path needs to look up
+ * the entry several times, the lookups are done using this index instead: a
+ * linear probing table storing the hash of each entry inline, so that a probe
+ * only reads the hashes array and needs to compare the key of an entry if its
+ * hash matches, and whose hash value is computed once by the caller and
+ * reused.  The stored hashes have PGSP_INDEX_USED set, an empty bucket
+ * having a zero hash.  The table has
+ * at least twice as many buckets as pg_shared_plans.max, so probe sequences
+ * stay short, and deletions shift the following entries back rather than
+ * leaving tombstones.
+ *
+ * pgsp_hash still owns the entries, which never move, and is used to iterate
+ * over them.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+#include "include/pg_shared_plans.h"
+#include "include/pgsp_index.h"
+
+#define PGSP_INDEX_ENTRIES(index) \
+	((pgspEntry **) ((char *) (index) + \
+					 MAXALIGN(offsetof(pgspIndex, hashes) + \
+							  sizeof(uint32) * ((index)->mask + 1))))
+
+/*
+ * Flag set in all the stored hashes, so that the used buckets can be told
+ * apart without reading the entries array.  It's never part of the home
+ * bucket, see pgsp_index_num_buckets().
+ */
+#define PGSP_INDEX_USED				((uint32) 0x80000000)
+#define PGSP_INDEX_TAG(hashvalue)	((hashvalue) | PGSP_INDEX_USED)
+
+/*---- Local variables ----*/
+
+static pgspIndex *pgsp_index = NULL;
+
+/*
+ * Estimate shared memory space needed for the index.
+ */
+Size
+pgsp_index_memsize(void)
+{
+	uint32		num_buckets = pgsp_index_num_buckets();
+
+	return add_size(MAXALIGN(add_size(offsetof(pgspIndex, hashes),
+									  mul_size(num_buckets, sizeof(uint32)))),
+					mul_size(num_buckets, sizeof(pgspEntry *)));
+}
+
+/*
+ * Allocate or attach to the index.  Caller must hold AddinShmemInitLock.
+ */
+void
+pgsp_index_shmem_startup(void)
+{
+	bool		found;
+
+	pgsp_index = ShmemInitStruct("pg_shared_plans index",
+								 pgsp_index_memsize(),
+								 &found);
+
+	if (!found)
+	{
+		uint32		num_buckets = pgsp_index_num_buckets();
+
+		pgsp_index->mask = num_buckets - 1;
+		pgsp_index->num_entries = 0;
+		memset(pgsp_index->hashes, 0, sizeof(uint32) * num_buckets);
+		memset(PGSP_INDEX_ENTRIES(pgsp_index), 0,
+			   sizeof(pgspEntry *) * num_buckets);
+	}
+}
+
+/*
+ * Find the entry for the given key, whose hash value is given by the caller,
+ * see pgsp_index_hash().  Caller must hold a lock on pgsp->lock.
+ */
+pgspEntry *
+pgsp_index_lookup(const pgspHashKey *key, uint32 hashvalue)
+{
+	pgspEntry **entries = PGSP_INDEX_ENTRIES(pgsp_index);
+	uint32		tag = PGSP_INDEX_TAG(hashvalue);
+	uint32		pos = hashvalue & pgsp_index->mask;
+
+	Assert(LWLockHeldByMe(pgsp->lock));
+
+	while (pgsp_index->hashes[pos] != 0)
+	{
+		if (pgsp_index->hashes[pos] == tag &&
+			pgsp_match_fn(&entries[pos]->key, key, sizeof(pgspHashKey)) == 0)
+			return entries[pos];
+
+		pos = (pos + 1) & pgsp_index->mask;
+	}
+
+	return NULL;
+}
+
+/*
+ * Add a newly created entry to the index.  Caller must hold an exclusive lock
+ * on pgsp->lock.
+ */
+void
+pgsp_index_insert(pgspEntry *entry, uint32 hashvalue)
+{
+	pgspEntry **entries = PGSP_INDEX_ENTRIES(pgsp_index);
+	uint32		pos = hashvalue & pgsp_index->mask;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+	Assert(hashvalue == pgsp_index_hash(&entry->key));
+	Assert(pgsp_index->num_entries < pgsp_index->mask);
+
+	while (pgsp_index->hashes[pos] != 0)
+	{
+		Assert(entries[pos] != entry);
+		pos = (pos + 1) & pgsp_index->mask;
+	}
+
+	pgsp_index->hashes[pos] = PGSP_INDEX_TAG(hashvalue);
+	entries[pos] = entry;
+	pgsp_index->num_entries++;
+}
+
+/*
+ * Remove an entry from the index.  Caller must hold an exclusive lock on
+ * pgsp->lock.
+ */
+void
+pgsp_index_delete(pgspEntry *entry)
+{
+	pgspEntry **entries = PGSP_INDEX_ENTRIES(pgsp_index);
+	uint32		mask = pgsp_index->mask;
+	uint32		pos = pgsp_index_hash(&entry->key) & mask;
+	uint32		next;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+
+	while (entries[pos] != entry)
+	{
+		if (pgsp_index->hashes[pos] == 0)
+			elog(ERROR, "pgsp: entry not found in the index");
+		pos = (pos + 1) & mask;
+	}
+
+	pgsp_index->hashes[pos] = 0;
+	entries[pos] = NULL;
+	pgsp_index->num_entries--;
+
+	/*
+	 * Shift back the following entries of the probe sequence that can't be
+	 * found anymore, i.e. whose home bucket isn't after the freed one.
+	 */
+	next = (pos + 1) & mask;
+	while (pgsp_index->hashes[next] != 0)
+	{
+		uint32		home = pgsp_index->hashes[next] & mask;
+
+		if (((next - home) & mask) >= ((next - pos) & mask))
+		{
+			pgsp_index->hashes[pos] = pgsp_index->hashes[next];
+			entries[pos] = entries[next];
+			pgsp_index->hashes[next] = 0;
+			entries[next] = NULL;
+			pos = next;
+		}
+
+		next = (next + 1) & mask;
+	}
+}
+
+/*
+ * Number of buckets of the index: the smallest power of 2 at least twice as
+ * big as pg_shared_plans.max.  The GUC is bounded by PGSP_MAX_ENTRIES so that
+ * it can't overflow, and never reaches the PGSP_INDEX_USED flag.
+ */
+uint32
+pgsp_index_num_buckets(void)
+{
+	uint32		num_buckets = 1;
+
+	while (num_buckets < (uint32) pgsp_max * 2)
+		num_buckets <<= 1;
+
+	Assert(num_buckets <= PGSP_INDEX_USED);
+
+	return num_buckets;
+}
@@ -0,0 +1,558 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_memo.c: Memoized custom plans for repeated parameter values.
+ *
+ * When a custom plan is needed for an entry, it's remembered in a small LRU
+ * attached to the entry, keyed by the exact binary image of the bound
+ * parameters.  Later executions with the same parameter values can then use
+ * it at the cost of a shared cache hit rather than planning again.  The
+ * memoized plans are only valid as long as the entry's generic plan is, and
+ * are released whenever it's discarded.
+ *
+ * The same LRU also holds the generic plans restricted to some partitions, see
+ * pgsp_partition.c, and the plans generated for a parameter shape, see
+ * pgsp_shape.c, keyed by the set of partitions or the shape instead.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#endif
+#include "fmgr.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "nodes/parsenodes.h"
+#include "storage/lwlock.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/lsyscache.h"
+
+#include "include/pgsp_epoch.h"
+#include "include/pgsp_index.h"
+#include "include/pgsp_memo.h"
+
+/*---- GUC variables ----*/
+
+int			pgsp_memo_size = 0;
+
+PG_FUNCTION_INFO_V1(pg_shared_plans_memo);
+
+static void pgsp_memo_release_plan(pgspMemoPlan *mplan);
+static bool pgsp_memo_rels_covered(pgspEntry *entry, PlannedStmt *stmt);
+
+/*
+ * Compute the binary image of the given bound parameters, used as the memo
+ * key, and its hash.  Returns NULL if the parameters can't be memoized.
+ */
+char *
+pgsp_memo_params(ParamListInfo params, size_t *len, uint64 *hash)
+{
+	StringInfoData buf;
+	int			i;
+
+	/* Parameters fetched on demand can't be known in advance. */
+	if (params == NULL || params->numParams == 0 ||
+		params->paramFetch != NULL)
+		return NULL;
+
+	initStringInfo(&buf);
+
+	for (i = 0; i < params->numParams; i++)
+	{
+		ParamExternData *prm = &params->params[i];
+		int16		typlen;
+		bool		typbyval;
+		Datum		value;
+		Size		size;
+
+		appendBinaryStringInfo(&buf, (char *) &prm->ptype, sizeof(Oid));
+		appendBinaryStringInfo(&buf, (char *) &prm->isnull, sizeof(bool));
+
+		if (prm->isnull || !OidIsValid(prm->ptype))
+			continue;
+
+		get_typlenbyval(prm->ptype, &typlen, &typbyval);
+
+		if (typbyval)
+		{
+			appendBinaryStringInfo(&buf, (char *) &prm->value, sizeof(Datum));
+			continue;
+		}
+
+		value = prm->value;
+		if (typlen == -1)
+			value = PointerGetDatum(PG_DETOAST_DATUM_PACKED(value));
+
+		size = datumGetSize(value, typbyval, typlen);
+		appendBinaryStringInfo(&buf, (char *) &size, sizeof(Size));
+		appendBinaryStringInfo(&buf, DatumGetPointer(value), size);
+	}
+
+	*len = buf.len;
+	*hash = DatumGetUInt64(hash_any_extended((unsigned char *) buf.data,
+											 buf.len, 0));
+
+	return buf.data;
+}
+
+/*
+ * Look for a memoized plan for the given parameters image.  Returns the plan
+ * buffer, that caller should pin before releasing pgsp->lock, or
+ * InvalidDsaPointer.  Caller must hold a lock on pgsp->lock.
+ */
+dsa_pointer
+pgsp_memo_lookup(pgspEntry *entry, pgspMemoKind kind, const char *params,
+				 size_t len, uint64 hash)
+{
+	pgspMemo   *memo;
+	int			i;
+
+	Assert(LWLockHeldByMe(pgsp->lock));
+
+	if (entry->memo == InvalidDsaPointer)
+		return InvalidDsaPointer;
+
+	memo = (pgspMemo *) dsa_get_address(pgsp_area, entry->memo);
+
+	for (i = 0; i < memo->num_plans; i++)
+	{
+		pgspMemoPlan *mplan = &memo->plans[i];
+
+		if (mplan->kind != kind || mplan->params_hash != hash ||
+			mplan->params_len != len)
+			continue;
+
+		if (memcmp(dsa_get_address(pgsp_area, mplan->params), params,
+				   len) != 0)
+			continue;
+
+		if (!pgsp_memo_valid(entry, mplan->plan))
+			return InvalidDsaPointer;
+
+		pg_atomic_fetch_add_u64(&mplan->hits, 1);
+		pg_atomic_write_u64(&mplan->last_used,
+							pg_atomic_add_fetch_u64(&memo->clock, 1));
+
+		return mplan->plan;
+	}
+
+	return InvalidDsaPointer;
+}
+
+/*
+ * Check that the given memoized plan still belongs to the entry and, in lazy
+ * validation mode, that none of its dependencies were invalidated since it
+ * was generated.  Caller must hold a lock on pgsp->lock.
+ */
+bool
+pgsp_memo_valid(pgspEntry *entry, dsa_pointer plan)
+{
+	pgspMemo   *memo;
+	int			i;
+
+	Assert(LWLockHeldByMe(pgsp->lock));
+
+	if (entry->memo == InvalidDsaPointer)
+		return false;
+
+	memo = (pgspMemo *) dsa_get_address(pgsp_area, entry->memo);
+
+	for (i = 0; i < memo->num_plans; i++)
+	{
+		pgspMemoPlan *mplan = &memo->plans[i];
+		Oid		   *rels = NULL;
+		pgspRdependKey *rdeps = NULL;
+
+		if (mplan->plan != plan)
+			continue;
+
+		if (pgsp_validation != PGSP_VALIDATION_LAZY)
+			return true;
+
+		/* The custom plan dependencies are covered by the entry's ones. */
+		if (entry->num_rels > 0)
+			rels = (Oid *) dsa_get_address(pgsp_area, entry->rels);
+		if (entry->num_rdeps > 0)
+			rdeps = (pgspRdependKey *) dsa_get_address(pgsp_area,
+													   entry->rdeps);
+
+		return pgsp_epoch_valid(mplan->epoch, entry->key.dbid,
+								rels, entry->num_rels,
+								rdeps, entry->num_rdeps);
+	}
+
+	return false;
+}
+
+/*
+ * Remember the plan generated for the given parameters image, evicting the
+ * least recently used memoized plan if needed.  Nothing is done if the entry's
+ * plan was discarded since the lookup, as given by discard.
+ */
+void
+pgsp_memo_remember(pgspHashKey *key, int64 discard, PlannedStmt *stmt,
+				   pgspMemoKind kind, const char *params, size_t len,
+				   uint64 hash, uint64 epoch)
+{
+	volatile pgspSharedState *s = (volatile pgspSharedState *) pgsp;
+	pgspEntry  *entry;
+	pgspMemo   *memo;
+	pgspMemoPlan *mplan;
+	char	   *serialized;
+	dsa_pointer plan;
+	dsa_pointer params_p;
+	int			i;
+
+	Assert(!LWLockHeldByMe(pgsp->lock));
+
+	serialized = nodeToString(stmt);
+
+	/*
+	 * Store the plan and the parameters before acquiring the lwlock, like
+	 * pgsp_cache_plan() does.  We don't allow interrupts here as we could
+	 * otherwise leak memory permanently.
+	 */
+	HOLD_INTERRUPTS();
+
+	plan = pgsp_plan_alloc(serialized, strlen(serialized) + 1);
+	if (plan == InvalidDsaPointer)
+	{
+		RESUME_INTERRUPTS();
+		return;
+	}
+
+	params_p = dsa_allocate_extended(pgsp_area, len, DSA_ALLOC_NO_OOM);
+	if (params_p == InvalidDsaPointer)
+	{
+		pgsp_plan_unpin(plan);
+		RESUME_INTERRUPTS();
+		return;
+	}
+	memcpy(dsa_get_address(pgsp_area, params_p), params, len);
+
+	SpinLockAcquire(&s->mutex);
+	s->alloced_size += len;
+	SpinLockRelease(&s->mutex);
+
+	LWLockAcquire(pgsp->lock, LW_EXCLUSIVE);
+
+	entry = pgsp_index_lookup(key, pgsp_index_hash(key));
+
+	/*
+	 * The plan was generated for the entry's plan we found, and can only be
+	 * memoized if it doesn't depend on any relation the entry's plan doesn't
+	 * depend on, as it would otherwise not be discarded when needed.
+	 */
+	if (entry == NULL || entry->plan == InvalidDsaPointer ||
+		entry->discard != discard ||
+		pg_atomic_read_u32(&entry->lockers) != 0 ||
+		!pgsp_memo_rels_covered(entry, stmt))
+		goto cleanup;
+
+	if (entry->memo == InvalidDsaPointer)
+	{
+		entry->memo = dsa_allocate_extended(pgsp_area,
+											PGSP_MEMO_SIZE(pgsp_memo_size),
+											DSA_ALLOC_NO_OOM);
+		if (entry->memo == InvalidDsaPointer)
+			goto cleanup;
+
+		SpinLockAcquire(&s->mutex);
+		s->alloced_size += PGSP_MEMO_SIZE(pgsp_memo_size);
+		SpinLockRelease(&s->mutex);
+
+		memo = (pgspMemo *) dsa_get_address(pgsp_area, entry->memo);
+		pg_atomic_init_u64(&memo->clock, 0);
+		memo->num_plans = 0;
+		memo->max_plans = pgsp_memo_size;
+	}
+	else
+		memo = (pgspMemo *) dsa_get_address(pgsp_area, entry->memo);
+
+	/*
+	 * Someone else may have memoized a plan for the same values.  If it's
+	 * outdated, replace it.
+	 */
+	mplan = NULL;
+	for (i = 0; i < memo->num_plans; i++)
+	{
+		if (memo->plans[i].kind == kind &&
+			memo->plans[i].params_hash == hash &&
+			memo->plans[i].params_len == len &&
+			memcmp(dsa_get_address(pgsp_area, memo->plans[i].params), params,
+				   len) == 0)
+		{
+			if (pgsp_memo_valid(entry, memo->plans[i].plan))
+				goto cleanup;
+
+			mplan = &memo->plans[i];
+			pgsp_memo_release_plan(mplan);
+			break;
+		}
+	}
+
+	if (mplan == NULL && memo->num_plans < memo->max_plans)
+		mplan = &memo->plans[memo->num_plans++];
+	else if (mplan == NULL)
+	{
+		uint64		oldest = PG_UINT64_MAX;
+
+		/* Evict the least recently used plan. */
+		for (i = 0; i < memo->num_plans; i++)
+		{
+			uint64		last_used = pg_atomic_read_u64(&memo->plans[i].last_used);
+
+			if (last_used < oldest)
+			{
+				oldest = last_used;
+				mplan = &memo->plans[i];
+			}
+		}
+		Assert(mplan != NULL);
+
+		pgsp_memo_release_plan(mplan);
+	}
+
+	mplan->kind = kind;
+	mplan->params_hash = hash;
+	mplan->params_len = len;
+	mplan->params = params_p;
+	mplan->plan = plan;
+	mplan->cost = stmt->planTree->total_cost;
+	mplan->epoch = epoch;
+	pg_atomic_init_u64(&mplan->hits, 0);
+	pg_atomic_init_u64(&mplan->last_used,
+					   pg_atomic_add_fetch_u64(&memo->clock, 1));
+
+	LWLockRelease(pgsp->lock);
+	RESUME_INTERRUPTS();
+
+	pfree(serialized);
+	return;
+
+cleanup:
+	LWLockRelease(pgsp->lock);
+
+	pgsp_plan_unpin(plan);
+	dsa_free(pgsp_area, params_p);
+
+	SpinLockAcquire(&s->mutex);
+	Assert(s->alloced_size >= len);
+	s->alloced_size -= len;
+	SpinLockRelease(&s->mutex);
+
+	RESUME_INTERRUPTS();
+
+	pfree(serialized);
+}
+
+/*
+ * Release all the memoized plans of the given entry.  Caller must hold an
+ * exclusive lock on pgsp->lock.
+ */
+void
+pgsp_memo_reset(pgspEntry *entry)
+{
+	volatile pgspSharedState *s = (volatile pgspSharedState *) pgsp;
+	pgspMemo   *memo;
+	int			i;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+
+	if (entry->memo == InvalidDsaPointer)
+		return;
+
+	memo = (pgspMemo *) dsa_get_address(pgsp_area, entry->memo);
+
+	for (i = 0; i < memo->num_plans; i++)
+		pgsp_memo_release_plan(&memo->plans[i]);
+
+	SpinLockAcquire(&s->mutex);
+	Assert(s->alloced_size >= PGSP_MEMO_SIZE(memo->max_plans));
+	s->alloced_size -= PGSP_MEMO_SIZE(memo->max_plans);
+	SpinLockRelease(&s->mutex);
+
+	dsa_free(pgsp_area, entry->memo);
+	entry->memo = InvalidDsaPointer;
+}
+
+/*
+ * Free the parameters image of a memoized plan and drop its reference on the
+ * plan buffer.
+ */
+static void
+pgsp_memo_release_plan(pgspMemoPlan *mplan)
+{
+	volatile pgspSharedState *s = (volatile pgspSharedState *) pgsp;
+
+	pgsp_plan_unpin(mplan->plan);
+	mplan->plan = InvalidDsaPointer;
+
+	dsa_free(pgsp_area, mplan->params);
+	mplan->params = InvalidDsaPointer;
+
+	SpinLockAcquire(&s->mutex);
+	Assert(s->alloced_size >= mplan->params_len);
+	s->alloced_size -= mplan->params_len;
+	SpinLockRelease(&s->mutex);
+}
+
+/*
+ * Check that all the relations the given plan references are also referenced
+ * by the entry's plan.
+ */
+static bool
+pgsp_memo_rels_covered(pgspEntry *entry, PlannedStmt *stmt)
+{
+	Oid		   *rels = NULL;
+	ListCell   *lc;
+
+	if (entry->num_rels > 0)
+		rels = (Oid *) dsa_get_address(pgsp_area, entry->rels);
+
+	foreach(lc, stmt->rtable)
+	{
+		RangeTblEntry *rte = lfirst_node(RangeTblEntry, lc);
+
+		if (rte->rtekind != RTE_RELATION
+#if PG_VERSION_NUM >= 160000
+				&& !(rte->rtekind == RTE_SUBQUERY && OidIsValid(rte->relid))
+#endif
+		   )
+		{
+			continue;
+		}
+
+		/* The entry's relations are sorted, see pgsp_allocate_plan(). */
+		if (entry->num_rels == 0 ||
+			bsearch(&rte->relid, rels, entry->num_rels, sizeof(Oid),
+					oid_cmp) == NULL)
+			return false;
+	}
+
+	return true;
+}
+
+static const char *const pgspMemoKindNames[] = {
+	"params",
+	"partitions",
+	"shape"
+};
+
+/*
+ * Display the memoized plans of all entries.
+ */
+#define PG_SHARED_PLANS_MEMO_COLS		9
+Datum
+pg_shared_plans_memo(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	pgspEntry  *entry;
+
+	if (!pgsp || !pgsp_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_shared_plans must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Create or attach to the dsa. */
+	pgsp_attach_dsa();
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(pgsp->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, pgsp_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		pgspMemo   *memo;
+		int			j;
+
+		if (entry->memo == InvalidDsaPointer)
+			continue;
+
+		memo = (pgspMemo *) dsa_get_address(pgsp_area, entry->memo);
+
+		for (j = 0; j < memo->num_plans; j++)
+		{
+			pgspMemoPlan *mplan = &memo->plans[j];
+			pgspPlanBuffer *buffer;
+			Datum		values[PG_SHARED_PLANS_MEMO_COLS];
+			bool		nulls[PG_SHARED_PLANS_MEMO_COLS];
+			int			i = 0;
+
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			buffer = (pgspPlanBuffer *) dsa_get_address(pgsp_area,
+														mplan->plan);
+
+			if (OidIsValid(entry->key.userid))
+				values[i++] = ObjectIdGetDatum(entry->key.userid);
+			else
+				nulls[i++] = true;
+			values[i++] = ObjectIdGetDatum(entry->key.dbid);
+			values[i++] = Int64GetDatum((int64) entry->key.queryid);
+			if (OidIsValid(entry->key.constid))
+				values[i++] = ObjectIdGetDatum(entry->key.constid);
+			else
+				nulls[i++] = true;
+			values[i++] = CStringGetTextDatum(pgspMemoKindNames[mplan->kind]);
+			values[i++] = Int64GetDatum((int64) mplan->params_hash);
+			values[i++] = Int64GetDatum((int64) buffer->len);
+			values[i++] = Float8GetDatum(mplan->cost);
+			values[i++] = Int64GetDatum((int64) pg_atomic_read_u64(&mplan->hits));
+
+			Assert(i == PG_SHARED_PLANS_MEMO_COLS);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	LWLockRelease(pgsp->lock);
+
+#if PG_VERSION_NUM < 170000
+	/* Should be a no-op anyway. */
+	tuplestore_donestoring(tupstore);
+#endif
+
+	return (Datum) 0;
+}
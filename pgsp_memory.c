@@ -0,0 +1,398 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_memory.c: Breakdown of the shared memory used by pg_shared_plans.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "catalog/pg_class_d.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "utils/builtins.h"
+
+#include "include/pg_shared_plans.h"
+#include "include/pgsp_backend.h"
+#include "include/pgsp_churn.h"
+#include "include/pgsp_epoch.h"
+#include "include/pgsp_index.h"
+#include "include/pgsp_memo.h"
+#include "include/pgsp_query_text.h"
+#include "include/pgsp_rdepend.h"
+#include "include/pgsp_slot.h"
+#include "include/pgsp_snapshot.h"
+
+/* Per-database components, all stored in the DSA area. */
+typedef enum pgspMemComponent
+{
+	PGSP_MEM_PLANS,				/* serialized plans */
+	PGSP_MEM_QUERIES,			/* serialized queries */
+	PGSP_MEM_QUERY_TEXTS,		/* normalized query texts */
+	PGSP_MEM_RELS,				/* per-entry arrays of relation oids */
+	PGSP_MEM_RDEPS,				/* per-entry arrays of pgspRdependKey */
+	PGSP_MEM_RDEPEND_ARRAYS,	/* used part of the rdepend arrays */
+	PGSP_MEM_RDEPEND_SLACK,		/* unused part of the rdepend arrays */
+	PGSP_MEM_RDEPEND_ENTRIES,	/* pgsp_rdepend dshash entries */
+	PGSP_MEM_MEMO_ARRAYS,		/* per-entry pgspMemo arrays */
+	PGSP_MEM_MEMO_PLANS,		/* serialized memoized plans, of any kind */
+	PGSP_MEM_MEMO_PARAMS		/* images of the memoized plans' keys */
+} pgspMemComponent;
+
+#define PGSP_MEM_NUM_COMPONENTS		(PGSP_MEM_MEMO_PARAMS + 1)
+
+static const char *const pgspMemComponentNames[] = {
+	"plans",
+	"queries",
+	"query texts",
+	"relations",
+	"rdeps",
+	"rdepend arrays",
+	"rdepend slack",
+	"rdepend entries",
+	"memo arrays",
+	"memo plans",
+	"memo params"
+};
+
+typedef struct pgspMemEntry
+{
+	Oid			dbid;			/* hash key - MUST BE FIRST */
+	int64		num[PGSP_MEM_NUM_COMPONENTS];
+	int64		bytes[PGSP_MEM_NUM_COMPONENTS];
+} pgspMemEntry;
+
+PG_FUNCTION_INFO_V1(pg_shared_plans_memory);
+
+static pgspMemEntry *pgsp_memory_get(HTAB *dbs, Oid dbid);
+static void pgsp_memory_add(HTAB *dbs, Oid dbid, pgspMemComponent comp,
+							int64 num, int64 bytes);
+static void pgsp_memory_add_rdepend(HTAB *rdepends, Oid dbid, Oid classid,
+									Oid oid);
+static void pgsp_memory_put(Tuplestorestate *tupstore, TupleDesc tupdesc,
+							Oid dbid, const char *component, int64 num,
+							int64 bytes, bool isnull);
+
+static pgspMemEntry *
+pgsp_memory_get(HTAB *dbs, Oid dbid)
+{
+	pgspMemEntry *entry;
+	bool		found;
+
+	entry = (pgspMemEntry *) hash_search(dbs, &dbid, HASH_ENTER, &found);
+	if (!found)
+	{
+		memset(entry->num, 0, sizeof(entry->num));
+		memset(entry->bytes, 0, sizeof(entry->bytes));
+	}
+
+	return entry;
+}
+
+static void
+pgsp_memory_add(HTAB *dbs, Oid dbid, pgspMemComponent comp, int64 num,
+				int64 bytes)
+{
+	pgspMemEntry *entry = pgsp_memory_get(dbs, dbid);
+
+	entry->num[comp] += num;
+	entry->bytes[comp] += bytes;
+}
+
+static void
+pgsp_memory_add_rdepend(HTAB *rdepends, Oid dbid, Oid classid, Oid oid)
+{
+	pgspRdependKey rkey = {dbid, classid, oid};
+
+	(void) hash_search(rdepends, &rkey, HASH_ENTER, NULL);
+}
+
+static void
+pgsp_memory_put(Tuplestorestate *tupstore, TupleDesc tupdesc, Oid dbid,
+				const char *component, int64 num, int64 bytes, bool isnull)
+{
+	Datum		values[4];
+	bool		nulls[4];
+
+	memset(nulls, 0, sizeof(nulls));
+
+	if (OidIsValid(dbid))
+		values[0] = ObjectIdGetDatum(dbid);
+	else
+		nulls[0] = true;
+	values[1] = CStringGetTextDatum(component);
+	values[2] = Int64GetDatum(num);
+	if (isnull)
+		nulls[3] = true;
+	else
+		values[3] = Int64GetDatum(bytes);
+
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+/*
+ * Report the memory used by each component, per database.
+ *
+ * The per-database rows only account for the logical size of what's stored
+ * in the DSA area.  The global rows report the fixed size shared memory
+ * structures, sized for the given number of items, and, if the server exposes
+ * it, the total size of the DSA area and the difference with the logical size,
+ * i.e. the chunk overhead, the dshash buckets and the fragmentation.
+ */
+Datum
+pg_shared_plans_memory(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASHCTL		info;
+	HTAB	   *dbs;
+	HTAB	   *rdepends;
+	HTAB	   *texts;
+	HASH_SEQ_STATUS hash_seq;
+	pgspEntry  *entry;
+	pgspRdependKey *rkey;
+	pgspQueryTextKey *tkey;
+	pgspMemEntry *dbentry;
+#if PG_VERSION_NUM >= 170000
+	int64		dsa_logical = 0;
+#endif
+	int			i;
+
+	if (!pgsp || !pgsp_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_shared_plans must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Create or attach to the dsa. */
+	pgsp_attach_dsa();
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	memset(&info, 0, sizeof(HASHCTL));
+	info.keysize = sizeof(Oid);
+	info.entrysize = sizeof(pgspMemEntry);
+	dbs = hash_create("pg_shared_plans memory dbs", 10, &info,
+					  HASH_ELEM | HASH_BLOBS);
+
+	memset(&info, 0, sizeof(HASHCTL));
+	info.keysize = sizeof(pgspRdependKey);
+	info.entrysize = sizeof(pgspRdependKey);
+	rdepends = hash_create("pg_shared_plans memory rdepends", 100, &info,
+						   HASH_ELEM | HASH_BLOBS);
+
+	memset(&info, 0, sizeof(HASHCTL));
+	info.keysize = sizeof(pgspQueryTextKey);
+	info.entrysize = sizeof(pgspQueryTextKey);
+	texts = hash_create("pg_shared_plans memory query texts", 100, &info,
+						HASH_ELEM | HASH_BLOBS);
+
+	LWLockAcquire(pgsp->lock, LW_SHARED);
+
+	/*
+	 * Go through all the entries, and remember all the reverse dependencies
+	 * they're registered in and the query texts they share.
+	 */
+	hash_seq_init(&hash_seq, pgsp_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Oid			dbid = entry->key.dbid;
+
+		/* Make sure that each database with an entry is reported. */
+		(void) pgsp_memory_get(dbs, dbid);
+
+		if (entry->plan != InvalidDsaPointer)
+			pgsp_memory_add(dbs, dbid, PGSP_MEM_PLANS, 1, entry->len);
+
+		if (entry->query != InvalidDsaPointer)
+			pgsp_memory_add(dbs, dbid, PGSP_MEM_QUERIES, 1, entry->query_len);
+
+		if (entry->has_query_text)
+		{
+			pgspQueryTextKey key;
+
+			memset(&key, 0, sizeof(pgspQueryTextKey));
+			key.dbid = dbid;
+			key.queryid = entry->key.queryid;
+			(void) hash_search(texts, &key, HASH_ENTER, NULL);
+		}
+
+		if (entry->num_rels > 0)
+		{
+			Oid		   *rels = dsa_get_address(pgsp_area, entry->rels);
+
+			pgsp_memory_add(dbs, dbid, PGSP_MEM_RELS, entry->num_rels,
+							entry->num_rels * sizeof(Oid));
+
+			for (i = 0; i < entry->num_rels; i++)
+				pgsp_memory_add_rdepend(rdepends, dbid, RELOID, rels[i]);
+		}
+
+		if (entry->num_rdeps > 0)
+		{
+			pgspRdependKey *rdeps = dsa_get_address(pgsp_area, entry->rdeps);
+
+			pgsp_memory_add(dbs, dbid, PGSP_MEM_RDEPS, entry->num_rdeps,
+							entry->num_rdeps * sizeof(pgspRdependKey));
+
+			for (i = 0; i < entry->num_rdeps; i++)
+				pgsp_memory_add_rdepend(rdepends, rdeps[i].dbid,
+										rdeps[i].classid, rdeps[i].oid);
+		}
+
+		/*
+		 * The memoized plans and their keys are only modified holding an
+		 * exclusive lock on pgsp->lock.
+		 */
+		if (entry->memo != InvalidDsaPointer)
+		{
+			pgspMemo   *memo = dsa_get_address(pgsp_area, entry->memo);
+
+			pgsp_memory_add(dbs, dbid, PGSP_MEM_MEMO_ARRAYS, 1,
+							PGSP_MEMO_SIZE(memo->max_plans));
+
+			for (i = 0; i < memo->num_plans; i++)
+			{
+				pgspMemoPlan *mplan = &memo->plans[i];
+				pgspPlanBuffer *buffer;
+
+				if (mplan->plan == InvalidDsaPointer)
+					continue;
+
+				buffer = dsa_get_address(pgsp_area, mplan->plan);
+				pgsp_memory_add(dbs, dbid, PGSP_MEM_MEMO_PLANS, 1,
+								buffer->len);
+
+				if (mplan->params != InvalidDsaPointer)
+					pgsp_memory_add(dbs, dbid, PGSP_MEM_MEMO_PARAMS, 1,
+									mplan->params_len);
+			}
+		}
+	}
+
+	/* And now get the details of all those reverse dependencies. */
+	hash_seq_init(&hash_seq, rdepends);
+	while ((rkey = hash_seq_search(&hash_seq)) != NULL)
+	{
+		pgspRdependEntry *rentry;
+
+		rentry = dshash_find(pgsp_rdepend, rkey, false);
+		if (rentry == NULL)
+			continue;
+
+		pgsp_memory_add(dbs, rkey->dbid, PGSP_MEM_RDEPEND_ENTRIES, 1,
+						sizeof(pgspRdependEntry));
+		pgsp_memory_add(dbs, rkey->dbid, PGSP_MEM_RDEPEND_ARRAYS,
+						rentry->num_keys,
+						rentry->num_keys * sizeof(pgspEntryRef));
+		pgsp_memory_add(dbs, rkey->dbid, PGSP_MEM_RDEPEND_SLACK,
+						rentry->max_keys - rentry->num_keys,
+						(rentry->max_keys - rentry->num_keys) *
+						sizeof(pgspEntryRef));
+
+		dshash_release_lock(pgsp_rdepend, rentry);
+	}
+
+	hash_seq_init(&hash_seq, texts);
+	while ((tkey = hash_seq_search(&hash_seq)) != NULL)
+	{
+		pgspQueryTextEntry *tentry;
+
+		tentry = dshash_find(pgsp_query_text, tkey, false);
+		if (tentry == NULL)
+			continue;
+
+		pgsp_memory_add(dbs, tkey->dbid, PGSP_MEM_QUERY_TEXTS, 1,
+						tentry->stored_len);
+
+		dshash_release_lock(pgsp_query_text, tentry);
+	}
+
+	LWLockRelease(pgsp->lock);
+
+	hash_seq_init(&hash_seq, dbs);
+	while ((dbentry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		for (i = 0; i < PGSP_MEM_NUM_COMPONENTS; i++)
+		{
+			pgsp_memory_put(tupstore, tupdesc, dbentry->dbid,
+							pgspMemComponentNames[i], dbentry->num[i],
+							dbentry->bytes[i], false);
+#if PG_VERSION_NUM >= 170000
+			dsa_logical += dbentry->bytes[i];
+#endif
+		}
+	}
+
+	pgsp_memory_put(tupstore, tupdesc, InvalidOid, "fixed hash", pgsp_max,
+					hash_estimate_size(pgsp_max, sizeof(pgspEntry)), false);
+	pgsp_memory_put(tupstore, tupdesc, InvalidOid, "fixed index",
+					pgsp_index_num_buckets(), pgsp_index_memsize(), false);
+	pgsp_memory_put(tupstore, tupdesc, InvalidOid, "fixed slots",
+					PGSP_NUM_SLOTS, pgsp_slot_memsize(), false);
+	pgsp_memory_put(tupstore, tupdesc, InvalidOid, "fixed epochs",
+					PGSP_EPOCH_SLOTS, pgsp_epoch_memsize(), false);
+	pgsp_memory_put(tupstore, tupdesc, InvalidOid, "fixed backends",
+					pgsp_backend_num_slots(), pgsp_backend_memsize(), false);
+	pgsp_memory_put(tupstore, tupdesc, InvalidOid, "fixed churn hash",
+					PGSP_CHURN_MAX, pgsp_churn_memsize(), false);
+	pgsp_memory_put(tupstore, tupdesc, InvalidOid, "fixed snapshots",
+					pgsp_snapshot_max, pgsp_snapshot_memsize(), false);
+
+#if PG_VERSION_NUM >= 170000
+	{
+		int64		dsa_total = dsa_get_total_size(pgsp_area);
+
+		pgsp_memory_put(tupstore, tupdesc, InvalidOid, "dsa total", 1,
+						dsa_total, false);
+		pgsp_memory_put(tupstore, tupdesc, InvalidOid, "dsa overhead", 1,
+						dsa_total - dsa_logical, false);
+	}
+#else
+	/* The size of the DSA area isn't exposed before pg17. */
+	pgsp_memory_put(tupstore, tupdesc, InvalidOid, "dsa total", 1, 0, true);
+	pgsp_memory_put(tupstore, tupdesc, InvalidOid, "dsa overhead", 1, 0,
+					true);
+#endif
+
+	hash_destroy(texts);
+	hash_destroy(rdepends);
+	hash_destroy(dbs);
+
+#if PG_VERSION_NUM < 170000
+	/* Should be a no-op anyway. */
+	tuplestore_donestoring(tupstore);
+#endif
+	return (Datum) 0;
+}
@@ -0,0 +1,338 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_partition.c: Plans restricted to the partitions the parameters lead
+ *                   to.
+ *
+ * The generic plan of a query on a partitioned table contains all the
+ * partitions and relies on run-time pruning, and all of them have to be
+ * locked when the plan is used.  If, for each partitioned table of the query,
+ * a parameter compared for equality with the partition key leads to a single
+ * partition, a generic plan restricted to those partitions is generated and
+ * memoized with the entry, keyed by the set of partitions.  The plan is
+ * restricted by adding the partition constraints to the query, so that the
+ * planner prunes the other partitions.  The parameters are kept as is, so the
+ * plan is valid for any parameter values leading to the same partitions.
+ *
+ * Only list and range partitioning on a single column and partitions other
+ * than the default one are handled, as the partition constraint can't
+ * otherwise be used for plan-time pruning.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/relation.h"
+#include "access/stratnum.h"
+#include "access/table.h"
+#include "catalog/partition.h"
+#include "catalog/pg_class.h"
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#endif
+#include "nodes/makefuncs.h"
+#include "optimizer/optimizer.h"
+#include "optimizer/planner.h"
+#include "parser/parsetree.h"
+#include "partitioning/partbounds.h"
+#include "rewrite/rewriteManip.h"
+#include "storage/lmgr.h"
+#include "utils/lsyscache.h"
+#include "utils/partcache.h"
+#include "utils/rel.h"
+
+#include "include/pg_shared_plans.h"
+#include "include/pgsp_epoch.h"
+#include "include/pgsp_memo.h"
+#include "include/pgsp_partition.h"
+
+/* The partition chosen for a partitioned table of the query */
+typedef struct pgspPartitionChoice
+{
+	Index		rtindex;
+	Oid			partoid;
+} pgspPartitionChoice;
+
+/*---- GUC variables ----*/
+
+bool		pgsp_partition_plans = false;
+
+static Oid pgsp_partition_for_rte(RangeTblEntry *rte, Index rtindex,
+								  List *quals, ParamListInfo params);
+static ParamExternData *pgsp_partition_param(Node *qual, PartitionKey partkey,
+											 Index rtindex,
+											 ParamListInfo params);
+
+/*
+ * Compute the partitions the given parameters lead to, used as the memo key,
+ * and its hash.  Returns NULL if the query doesn't reference any partitioned
+ * table or if any of them can't be restricted to a single partition.  Caller
+ * must have locked the relations.
+ */
+char *
+pgsp_partition_key(Query *parse, ParamListInfo params, size_t *len,
+				   uint64 *hash)
+{
+	pgspPartitionChoice *choices;
+	List	   *quals;
+	ListCell   *lc;
+	Index		rtindex = 0;
+	int			nchoices = 0;
+
+	if (params == NULL || params->numParams == 0 ||
+		params->paramFetch != NULL)
+		return NULL;
+
+	if (parse->commandType != CMD_SELECT || parse->hasRowSecurity ||
+		parse->jointree == NULL)
+		return NULL;
+
+	quals = make_ands_implicit((Expr *) parse->jointree->quals);
+	choices = (pgspPartitionChoice *) palloc0(sizeof(pgspPartitionChoice) *
+											  list_length(parse->rtable));
+
+	foreach(lc, parse->rtable)
+	{
+		RangeTblEntry *rte = lfirst_node(RangeTblEntry, lc);
+		Oid			partoid;
+
+		rtindex++;
+
+		if (rte->rtekind != RTE_RELATION ||
+			rte->relkind != RELKIND_PARTITIONED_TABLE || !rte->inh)
+			continue;
+
+		partoid = pgsp_partition_for_rte(rte, rtindex, quals, params);
+		if (!OidIsValid(partoid))
+		{
+			pfree(choices);
+			return NULL;
+		}
+
+		choices[nchoices].rtindex = rtindex;
+		choices[nchoices].partoid = partoid;
+		nchoices++;
+	}
+
+	if (nchoices == 0)
+	{
+		pfree(choices);
+		return NULL;
+	}
+
+	*len = sizeof(pgspPartitionChoice) * nchoices;
+	*hash = DatumGetUInt64(hash_any_extended((unsigned char *) choices,
+											 *len, 0));
+
+	return (char *) choices;
+}
+
+/*
+ * Generate the generic plan restricted to the given partitions and remember
+ * it with the entry.
+ */
+void
+pgsp_partition_remember(pgspHashKey *key, int64 discard, Query *parse,
+						const char *query_string, int cursorOptions,
+						const char *partitions, size_t len, uint64 hash)
+{
+	pgspPartitionChoice *choices = (pgspPartitionChoice *) partitions;
+	int			nchoices = len / sizeof(pgspPartitionChoice);
+	Query	   *query = copyObject(parse);
+	PlannedStmt *stmt;
+	uint64		epoch;
+	int			i;
+
+	for (i = 0; i < nchoices; i++)
+	{
+		RangeTblEntry *rte = rt_fetch(choices[i].rtindex, query->rtable);
+		Relation	parent;
+		Relation	part;
+		List	   *qual;
+#if PG_VERSION_NUM < 130000
+		bool		found_whole_row;
+#endif
+
+		/* The plan will reference the partition, lock it like the parent. */
+		LockRelationOid(choices[i].partoid, rte->rellockmode);
+		part = try_relation_open(choices[i].partoid, NoLock);
+
+		/* The partition was concurrently dropped, just give up. */
+		if (part == NULL)
+			return;
+
+		parent = table_open(rte->relid, NoLock);
+
+		qual = RelationGetPartitionQual(part);
+#if PG_VERSION_NUM >= 130000
+		qual = map_partition_varattnos(qual, 1, parent, part);
+#else
+		qual = map_partition_varattnos(qual, 1, parent, part,
+									   &found_whole_row);
+#endif
+		if (choices[i].rtindex != 1)
+			ChangeVarNodes((Node *) qual, 1, choices[i].rtindex, 0);
+
+		query->jointree->quals = make_and_qual(query->jointree->quals,
+											   (Node *) make_ands_explicit(qual));
+
+		table_close(parent, NoLock);
+		relation_close(part, NoLock);
+	}
+
+	epoch = pgsp_epoch_start_planning();
+	stmt = pgsp_call_planner(query, query_string, cursorOptions, NULL);
+
+	pgsp_memo_remember(key, discard, stmt, PGSP_MEMO_PARTITIONS, partitions,
+					   len, hash, epoch);
+}
+
+/*
+ * Return the leaf partition of the given partitioned table that the
+ * parameters lead to, or InvalidOid.
+ */
+static Oid
+pgsp_partition_for_rte(RangeTblEntry *rte, Index rtindex, List *quals,
+					   ParamListInfo params)
+{
+	Relation	rel;
+	PartitionKey partkey;
+	PartitionDesc partdesc;
+	PartitionBoundInfo boundinfo;
+	ParamExternData *prm = NULL;
+	ListCell   *lc;
+	Oid			partoid = InvalidOid;
+	int			bound_offset;
+	int			part_index = -1;
+	bool		equal = false;
+
+	/* The relation is already locked. */
+	rel = table_open(rte->relid, NoLock);
+	partkey = RelationGetPartitionKey(rel);
+
+	if (partkey->partnatts != 1 || partkey->partattrs[0] == 0 ||
+		(partkey->strategy != PARTITION_STRATEGY_LIST &&
+		 partkey->strategy != PARTITION_STRATEGY_RANGE))
+		goto done;
+
+	foreach(lc, quals)
+	{
+		prm = pgsp_partition_param(lfirst(lc), partkey, rtindex, params);
+		if (prm != NULL)
+			break;
+	}
+
+	if (prm == NULL)
+		goto done;
+
+#if PG_VERSION_NUM >= 140000
+	partdesc = RelationGetPartitionDesc(rel, true);
+#else
+	partdesc = RelationGetPartitionDesc(rel);
+#endif
+	if (partdesc->nparts == 0)
+		goto done;
+
+	boundinfo = partdesc->boundinfo;
+
+	if (partkey->strategy == PARTITION_STRATEGY_LIST)
+	{
+		bound_offset = partition_list_bsearch(partkey->partsupfunc,
+											  partkey->partcollation,
+											  boundinfo, prm->value, &equal);
+		if (bound_offset >= 0 && equal)
+			part_index = boundinfo->indexes[bound_offset];
+	}
+	else
+	{
+		bound_offset = partition_range_datum_bsearch(partkey->partsupfunc,
+													 partkey->partcollation,
+													 boundinfo, 1,
+													 &prm->value, &equal);
+		part_index = boundinfo->indexes[bound_offset + 1];
+	}
+
+	/* The default partition isn't handled, see above. */
+	if (part_index >= 0 && partdesc->is_leaf[part_index])
+		partoid = partdesc->oids[part_index];
+
+done:
+	table_close(rel, NoLock);
+
+	return partoid;
+}
+
+/*
+ * Return the parameter the given qual compares for equality with the
+ * partition key of the given partitioned table, or NULL.
+ */
+static ParamExternData *
+pgsp_partition_param(Node *qual, PartitionKey partkey, Index rtindex,
+					 ParamListInfo params)
+{
+	OpExpr	   *op;
+	Node	   *left;
+	Node	   *right;
+	Var		   *var;
+	Param	   *param;
+	ParamExternData *prm;
+
+	if (!IsA(qual, OpExpr))
+		return NULL;
+
+	op = (OpExpr *) qual;
+	if (list_length(op->args) != 2)
+		return NULL;
+
+	left = linitial(op->args);
+	right = lsecond(op->args);
+
+	if (IsA(left, RelabelType))
+		left = (Node *) ((RelabelType *) left)->arg;
+	if (IsA(right, RelabelType))
+		right = (Node *) ((RelabelType *) right)->arg;
+
+	if (IsA(left, Var) && IsA(right, Param))
+	{
+		var = (Var *) left;
+		param = (Param *) right;
+	}
+	else if (IsA(left, Param) && IsA(right, Var))
+	{
+		var = (Var *) right;
+		param = (Param *) left;
+	}
+	else
+		return NULL;
+
+	if (var->varno != rtindex || var->varlevelsup != 0 ||
+		var->varattno != partkey->partattrs[0])
+		return NULL;
+
+	if (param->paramkind != PARAM_EXTERN || param->paramid < 1 ||
+		param->paramid > params->numParams)
+		return NULL;
+
+	/* The comparison must be the one the partition bounds rely on. */
+	if (OidIsValid(partkey->partcollation[0]) &&
+		op->inputcollid != partkey->partcollation[0])
+		return NULL;
+
+	if (!op_in_opfamily(op->opno, partkey->partopfamily[0]) ||
+		get_op_opfamily_strategy(op->opno, partkey->partopfamily[0]) !=
+		BTEqualStrategyNumber)
+		return NULL;
+
+	prm = &params->params[param->paramid - 1];
+	if (prm->isnull || prm->ptype != partkey->parttypid[0])
+		return NULL;
+
+	return prm;
+}
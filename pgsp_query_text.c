@@ -0,0 +1,476 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_query_text.c: Storage of the normalized query text of cached plans.
+ *
+ * The text is stored once per (dbid, queryid) in the pgsp_query_text dshash,
+ * and is shared by all the entries having the same queryid, whatever their
+ * userid and constid.  It's normalized the same way pg_stat_statements does,
+ * so that it doesn't show the constants of the first planned variant, and is
+ * optionally compressed.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "common/pg_lzcompress.h"
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#endif
+#include "lib/stringinfo.h"
+#include "nodes/nodeFuncs.h"
+#include "parser/scanner.h"
+#include "parser/scansup.h"
+
+#include "include/pgsp_query_text.h"
+
+/* Minimum text length to bother trying to compress it. */
+#define PGSP_QUERY_TEXT_COMPRESS_MIN	128
+
+typedef struct pgspConstLocation
+{
+	int			location;	/* start offset in the query text */
+	int			length;		/* length in bytes, or -1 to ignore */
+} pgspConstLocation;
+
+typedef struct pgspConstContext
+{
+	pgspConstLocation *locs;
+	int			count;
+	int			max;
+	int			highest_param;	/* highest PARAM_EXTERN paramid seen */
+} pgspConstContext;
+
+bool		pgsp_compress_query_text;
+
+static bool pgsp_const_walker(Node *node, pgspConstContext *context);
+static int	pgsp_const_cmp(const void *a, const void *b);
+static void pgsp_fill_const_lengths(pgspConstContext *context,
+									const char *query, int query_loc);
+
+/*
+ * Walker function to find the location of all the Const nodes and the highest
+ * external parameter number.
+ *
+ * Note that the Const coming from the rewriter (view definitions, RLS
+ * policies...) are read from the catalogs and don't have a location, so we
+ * only see the ones written in the query text.
+ */
+static bool
+pgsp_const_walker(Node *node, pgspConstContext *context)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Const))
+	{
+		Const	   *c = (Const *) node;
+
+		if (c->location < 0)
+			return false;
+
+		if (context->count >= context->max)
+		{
+			context->max *= 2;
+			context->locs = repalloc(context->locs,
+									 sizeof(pgspConstLocation) * context->max);
+		}
+		context->locs[context->count].location = c->location;
+		context->locs[context->count].length = -1;
+		context->count++;
+
+		return false;
+	}
+	else if (IsA(node, Param))
+	{
+		Param	   *p = (Param *) node;
+
+		if (p->paramkind == PARAM_EXTERN &&
+			p->paramid > context->highest_param)
+			context->highest_param = p->paramid;
+
+		return false;
+	}
+	else if (IsA(node, Query))
+		return query_tree_walker((Query *) node, pgsp_const_walker, context, 0);
+
+	return expression_tree_walker(node, pgsp_const_walker, context);
+}
+
+static int
+pgsp_const_cmp(const void *a, const void *b)
+{
+	int			l = ((const pgspConstLocation *) a)->location;
+	int			r = ((const pgspConstLocation *) b)->location;
+
+	if (l < r)
+		return -1;
+	else if (l > r)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * Compute the length of each constant token, using the core scanner as
+ * pg_stat_statements does.  Locations are sorted, and the ones that don't
+ * match the start of a token (duplicates or locations that don't belong to
+ * this statement) keep a -1 length and will be ignored.
+ */
+static void
+pgsp_fill_const_lengths(pgspConstContext *context, const char *query,
+						int query_loc)
+{
+	core_yyscan_t yyscanner;
+	core_yy_extra_type yyextra;
+	core_YYSTYPE yylval;
+	YYLTYPE		yylloc = -1;
+	int			last_loc = -1;
+	int			i;
+
+	if (context->count > 1)
+		qsort(context->locs, context->count, sizeof(pgspConstLocation),
+			  pgsp_const_cmp);
+
+	yyscanner = scanner_init(query, &yyextra, &ScanKeywords,
+							 ScanKeywordTokens);
+
+	/* We don't want to re-emit any escape string warnings. */
+	yyextra.escape_string_warning = false;
+
+	for (i = 0; i < context->count; i++)
+	{
+		int			loc = context->locs[i].location - query_loc;
+		int			tok = 1;
+
+		/* Duplicate constant, or not part of this statement. */
+		if (loc <= last_loc || loc < 0)
+			continue;
+
+		/*
+		 * Advance to the first token at or after this location.  The last
+		 * token read may already be there if the previous location didn't
+		 * match any token.
+		 */
+		while (yylloc < loc)
+		{
+			tok = core_yylex(&yylval, &yylloc, yyscanner);
+			if (tok == 0)
+				break;
+		}
+
+		if (tok == 0)
+			break;
+
+		if (yylloc == loc)
+		{
+			/*
+			 * A negative value is the only case where more than one token is
+			 * replaced.
+			 */
+			if (query[loc] == '-')
+			{
+				tok = core_yylex(&yylval, &yylloc, yyscanner);
+				if (tok == 0)
+					break;
+			}
+
+			/* The scanner puts a NUL byte after the current token. */
+			context->locs[i].length = strlen(yyextra.scanbuf + loc);
+		}
+
+		last_loc = loc;
+	}
+
+	scanner_finish(yyscanner);
+}
+
+/*
+ * Return a palloc'd normalized version of the source text of the given
+ * statement, with its constants replaced by $n parameter symbols, or NULL if
+ * no source text is available.
+ */
+char *
+pgsp_query_text_normalize(Query *parse, const char *query_string)
+{
+	pgspConstContext context;
+	StringInfoData buf;
+	const char *query;
+	char	   *local;
+	int			query_loc = parse->stmt_location;
+	int			query_len = parse->stmt_len;
+	int			pos = 0;
+	int			param;
+	int			i;
+
+	if (query_string == NULL)
+		return NULL;
+
+	/* Extract and trim the statement, as CleanQuerytext() does. */
+	if (query_loc >= 0)
+	{
+		Assert(query_loc <= strlen(query_string));
+		query = query_string + query_loc;
+		if (query_len <= 0)
+			query_len = strlen(query);
+	}
+	else
+	{
+		query_loc = 0;
+		query = query_string;
+		query_len = strlen(query);
+	}
+
+	while (query_len > 0 && scanner_isspace(query[0]))
+		query++, query_loc++, query_len--;
+	while (query_len > 0 && scanner_isspace(query[query_len - 1]))
+		query_len--;
+
+	if (query_len == 0)
+		return NULL;
+
+	/* The scanner needs a NUL terminated string. */
+	local = pnstrdup(query, query_len);
+
+	context.count = 0;
+	context.max = 8;
+	context.locs = palloc(sizeof(pgspConstLocation) * context.max);
+	context.highest_param = 0;
+
+	(void) pgsp_const_walker((Node *) parse, &context);
+
+	if (context.count == 0)
+	{
+		pfree(context.locs);
+		return local;
+	}
+
+	pgsp_fill_const_lengths(&context, local, query_loc);
+
+	initStringInfo(&buf);
+	param = context.highest_param;
+	for (i = 0; i < context.count; i++)
+	{
+		int			loc = context.locs[i].location - query_loc;
+		int			len = context.locs[i].length;
+
+		if (len < 0)
+			continue;
+
+		Assert(loc >= pos && loc + len <= query_len);
+		appendBinaryStringInfo(&buf, local + pos, loc - pos);
+		appendStringInfo(&buf, "$%d", ++param);
+		pos = loc + len;
+	}
+	appendBinaryStringInfo(&buf, local + pos, query_len - pos);
+
+	pfree(context.locs);
+	pfree(local);
+
+	return buf.data;
+}
+
+/*
+ * Register a reference to the text of the given (dbid, queryid), storing the
+ * given text if no one did it yet.  Returns whether the caller now holds a
+ * reference, which must later be released with pgsp_query_text_release().
+ * Caller must hold an exclusive lock on pgsp->lock.
+ */
+bool
+pgsp_query_text_acquire(Oid dbid, uint64 queryid, const char *text)
+{
+	pgspQueryTextKey key;
+	pgspQueryTextEntry *tentry;
+	volatile pgspSharedState *s = (volatile pgspSharedState *) pgsp;
+	char	   *compressed = NULL;
+	const char *data;
+	int			len;
+	int			stored_len;
+	bool		found;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+	Assert(pgsp_area != NULL && pgsp_query_text != NULL);
+
+	memset(&key, 0, sizeof(pgspQueryTextKey));
+	key.dbid = dbid;
+	key.queryid = queryid;
+
+	/*
+	 * The area is pinned, so we can't process an interrupt here as we
+	 * could otherwise leak memory permanently.
+	 */
+	HOLD_INTERRUPTS();
+
+	tentry = dshash_find_or_insert(pgsp_query_text, &key, &found);
+	if (found)
+	{
+		tentry->refcount++;
+		dshash_release_lock(pgsp_query_text, tentry);
+		RESUME_INTERRUPTS();
+		return true;
+	}
+
+	len = strlen(text) + 1;
+	data = text;
+	stored_len = len;
+
+	if (pgsp_compress_query_text && len >= PGSP_QUERY_TEXT_COMPRESS_MIN)
+	{
+		int32		clen;
+
+		compressed = palloc(PGLZ_MAX_OUTPUT(len));
+		clen = pglz_compress(text, len, compressed, PGLZ_strategy_default);
+
+		/* Only keep the compressed version if it's worth it. */
+		if (clen > 0 && clen < len)
+		{
+			data = compressed;
+			stored_len = clen;
+		}
+	}
+
+	tentry->text = dsa_allocate_extended(pgsp_area, stored_len,
+										 DSA_ALLOC_NO_OOM);
+	if (tentry->text == InvalidDsaPointer)
+	{
+		dshash_delete_entry(pgsp_query_text, tentry);
+		RESUME_INTERRUPTS();
+		if (compressed)
+			pfree(compressed);
+		return false;
+	}
+
+	memcpy(dsa_get_address(pgsp_area, tentry->text), data, stored_len);
+	tentry->refcount = 1;
+	tentry->len = len;
+	tentry->stored_len = stored_len;
+	tentry->compressed = (data == compressed);
+
+	SpinLockAcquire(&s->mutex);
+	s->alloced_size += stored_len;
+	SpinLockRelease(&s->mutex);
+
+	dshash_release_lock(pgsp_query_text, tentry);
+	RESUME_INTERRUPTS();
+
+	if (compressed)
+		pfree(compressed);
+
+	return true;
+}
+
+/*
+ * Release a reference to the text of the given (dbid, queryid), and remove it
+ * if it was the last one.  Caller must hold an exclusive lock on pgsp->lock.
+ */
+void
+pgsp_query_text_release(Oid dbid, uint64 queryid)
+{
+	pgspQueryTextKey key;
+	pgspQueryTextEntry *tentry;
+	volatile pgspSharedState *s = (volatile pgspSharedState *) pgsp;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+	Assert(pgsp_area != NULL && pgsp_query_text != NULL);
+
+	memset(&key, 0, sizeof(pgspQueryTextKey));
+	key.dbid = dbid;
+	key.queryid = queryid;
+
+	tentry = dshash_find(pgsp_query_text, &key, true);
+	Assert(tentry != NULL);
+	if (tentry == NULL)
+		return;
+
+	Assert(tentry->refcount > 0);
+	if (--tentry->refcount > 0)
+	{
+		dshash_release_lock(pgsp_query_text, tentry);
+		return;
+	}
+
+	dsa_free(pgsp_area, tentry->text);
+
+	SpinLockAcquire(&s->mutex);
+	Assert(s->alloced_size >= tentry->stored_len);
+	s->alloced_size -= tentry->stored_len;
+	SpinLockRelease(&s->mutex);
+
+	dshash_delete_entry(pgsp_query_text, tentry);
+}
+
+/*
+ * Return a palloc'd copy of the text of the given (dbid, queryid), or NULL if
+ * there's none.  Caller must hold a lock on pgsp->lock.
+ */
+char *
+pgsp_query_text_get(Oid dbid, uint64 queryid)
+{
+	pgspQueryTextKey key;
+	pgspQueryTextEntry *tentry;
+	char	   *result;
+
+	Assert(LWLockHeldByMe(pgsp->lock));
+	Assert(pgsp_area != NULL && pgsp_query_text != NULL);
+
+	memset(&key, 0, sizeof(pgspQueryTextKey));
+	key.dbid = dbid;
+	key.queryid = queryid;
+
+	tentry = dshash_find(pgsp_query_text, &key, false);
+	if (tentry == NULL)
+		return NULL;
+
+	result = palloc(tentry->len);
+	if (tentry->compressed)
+	{
+		if (pglz_decompress(dsa_get_address(pgsp_area, tentry->text),
+							tentry->stored_len, result, tentry->len,
+							true) != tentry->len)
+		{
+			dshash_release_lock(pgsp_query_text, tentry);
+			elog(ERROR, "pgsp: corrupted query text for queryid " INT64_FORMAT,
+				 (int64) queryid);
+		}
+	}
+	else
+		memcpy(result, dsa_get_address(pgsp_area, tentry->text), tentry->len);
+
+	dshash_release_lock(pgsp_query_text, tentry);
+
+	return result;
+}
+
+/* Compare two query text keys.  Zero means match. */
+int
+pgsp_query_text_fn_compare(const void *a, const void *b, size_t size,
+						   void *arg)
+{
+	pgspQueryTextKey *k1 = (pgspQueryTextKey *) a;
+	pgspQueryTextKey *k2 = (pgspQueryTextKey *) b;
+
+	if (k1->dbid == k2->dbid && k1->queryid == k2->queryid)
+		return 0;
+	else
+		return 1;
+}
+
+/* Calculate a hash value for a given query text key. */
+dshash_hash
+pgsp_query_text_fn_hash(const void *v, size_t size, void *arg)
+{
+	pgspQueryTextKey *k = (pgspQueryTextKey *) v;
+	uint32			h;
+
+	h = hash_combine(0, k->dbid);
+	h = hash_combine(h, k->queryid);
+
+	return h;
+}
@@ -14,8 +14,10 @@
 #include "postgres.h"
 
 #include "catalog/pg_class_d.h"
+#include "catalog/pg_proc_d.h"
 #include "catalog/pg_type.h"
 #include "commands/dbcommands.h"
+#include "funcapi.h"
 #include "storage/lwlock.h"
 #include "storage/shmem.h"
 #if PG_VERSION_NUM >= 130000
@@ -28,24 +30,27 @@
 #include "utils/syscache.h"
 
 #include "include/pgsp_rdepend.h"
+#include "include/pgsp_slot.h"
 
-#define RDEPEND_KEY_SIZE(nb)	(sizeof(pgspHashKey) * (nb))
+#define RDEPEND_KEY_SIZE(nb)	(sizeof(pgspEntryRef) * (nb))
 
 int pgsp_rdepend_max;
 
 static void pgsp_get_rdep_name(Oid classid, Oid oid, char **deptype,
 		char **depname);
 
+PG_FUNCTION_INFO_V1(pg_shared_plans_rdepends);
+
 /*
  * Add a reverse depdency for a (dbid, classid, oid) on the given pgspEntry,
- * identified by its key.
+ * identified by its slot reference.
  */
 bool
-pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
+pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid, pgspEntryRef *ref)
 {
 	pgspRdependKey rkey = {dbid, classid, oid};
 	pgspRdependEntry   *rentry;
-	pgspHashKey			*rkeys;
+	pgspEntryRef		*rkeys;
 	bool				found, dsfound;
 	int					i;
 
@@ -73,6 +78,9 @@ pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
 
 		rentry->max_keys = PGSP_RDEPEND_INIT;
 		rentry->num_keys = 0;
+		rentry->discards = 0;
+		rentry->evictions = 0;
+		rentry->refused = 0;
 		rentry->keys = dsa_allocate_extended(pgsp_area,
 				RDEPEND_KEY_SIZE(PGSP_RDEPEND_INIT),
 				DSA_ALLOC_NO_OOM);
@@ -89,19 +97,19 @@ pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
 		s->alloced_size += RDEPEND_KEY_SIZE(PGSP_RDEPEND_INIT);
 		SpinLockRelease(&s->mutex);
 
-		rkeys = (pgspHashKey *) dsa_get_address(pgsp_area, rentry->keys);
+		rkeys = (pgspEntryRef *) dsa_get_address(pgsp_area, rentry->keys);
 		Assert(rkeys != NULL);
 	}
 	else
 	{
 		/* Check first if the rdepend is already registered */
-		rkeys = (pgspHashKey *) dsa_get_address(pgsp_area, rentry->keys);
+		rkeys = (pgspEntryRef *) dsa_get_address(pgsp_area, rentry->keys);
 		Assert(rkeys != NULL);
 
 		found = false;
 		for (i = 0; i < rentry->num_keys; i++)
 		{
-			if (pgsp_match_fn(key, &(rkeys[i]), 0) == 0)
+			if (pgsp_entry_ref_equal(ref, &(rkeys[i])))
 			{
 				found = true;
 #if defined(USE_ASSERT_CHECKING)
@@ -111,7 +119,7 @@ pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
 #endif
 			}
 #if defined(USE_ASSERT_CHECKING)
-			Assert(pgsp_match_fn(key, &(rkeys[i]), 0) != 0);
+			Assert(!pgsp_entry_ref_equal(ref, &(rkeys[i])));
 #endif
 		}
 
@@ -128,7 +136,7 @@ pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
 	if (rentry->num_keys >= rentry->max_keys)
 	{
 		dsa_pointer new_rkeys_p;
-		pgspHashKey *new_rkeys;
+		pgspEntryRef *new_rkeys;
 		int new_max_keys = Max(rentry->max_keys * 2, pgsp_rdepend_max);
 		volatile pgspSharedState *s = (volatile pgspSharedState *) pgsp;
 
@@ -147,6 +155,11 @@ pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
 			char *deptype;
 			char *depname;
 
+			SpinLockAcquire(&s->mutex);
+			s->rdepend_refused += 1;
+			SpinLockRelease(&s->mutex);
+			rentry->refused += 1;
+
 			pgsp_get_rdep_name(classid, oid, &deptype, &depname);
 
 			ereport(WARNING,
@@ -162,7 +175,7 @@ pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
 		}
 
 		new_rkeys_p = dsa_allocate_extended(pgsp_area,
-											sizeof(pgspHashKey) * new_max_keys,
+											RDEPEND_KEY_SIZE(new_max_keys),
 											DSA_ALLOC_NO_OOM);
 		if (new_rkeys_p == InvalidDsaPointer)
 		{
@@ -181,10 +194,10 @@ pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
 			return false;
 		}
 
-		new_rkeys = (pgspHashKey *) dsa_get_address(pgsp_area, new_rkeys_p);
+		new_rkeys = (pgspEntryRef *) dsa_get_address(pgsp_area, new_rkeys_p);
 		Assert(new_rkeys != NULL);
 
-		memcpy(new_rkeys, rkeys, sizeof(pgspHashKey) * new_max_keys);
+		memcpy(new_rkeys, rkeys, RDEPEND_KEY_SIZE(rentry->num_keys));
 		rkeys = NULL;
 		dsa_free(pgsp_area, rentry->keys);
 
@@ -195,12 +208,12 @@ pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
 		rentry->keys = new_rkeys_p;
 		rentry->max_keys = new_max_keys;
 
-		rkeys = (pgspHashKey *) dsa_get_address(pgsp_area, rentry->keys);
+		rkeys = (pgspEntryRef *) dsa_get_address(pgsp_area, rentry->keys);
 	}
 
 	Assert(rkeys != NULL);
 
-	rkeys[rentry->num_keys++] = *key;
+	rkeys[rentry->num_keys++] = *ref;
 
 	dshash_release_lock(pgsp_rdepend, rentry);
 	RESUME_INTERRUPTS();
@@ -208,15 +221,37 @@ pgsp_entry_register_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
 	return true;
 }
 
+/*
+ * Register the reverse dependencies for an array of objects of the same class
+ * on the given pgspEntry, stopping at the first failure.  Returns the number
+ * of objects registered, which the caller has to unregister if it's not the
+ * whole array.
+ */
+int
+pgsp_entry_register_rdepends(Oid dbid, Oid classid, const Oid *oids, int num,
+							 pgspEntryRef *ref)
+{
+	int			i;
+
+	for (i = 0; i < num; i++)
+	{
+		if (!pgsp_entry_register_rdepend(dbid, classid, oids[i], ref))
+			break;
+	}
+
+	return i;
+}
+
 /*
  * Remove a reverse dependency for a (dbid, classid, oid) on the given pgspEntry,
- * indentified by its key.
+ * indentified by its slot reference.
  */
 void
-pgsp_entry_unregister_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
+pgsp_entry_unregister_rdepend(Oid dbid, Oid classid, Oid oid,
+							  pgspEntryRef *ref)
 {
 	pgspRdependEntry   *rentry;
-	pgspHashKey			*rkeys;
+	pgspEntryRef		*rkeys;
 	pgspRdependKey		rkey = {dbid, classid, oid};
 	int					delidx;
 
@@ -239,10 +274,10 @@ pgsp_entry_unregister_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
 	 */
 	HOLD_INTERRUPTS();
 
-	rkeys = (pgspHashKey *) dsa_get_address(pgsp_area, rentry->keys);
+	rkeys = (pgspEntryRef *) dsa_get_address(pgsp_area, rentry->keys);
 	for(delidx = 0; delidx < rentry->num_keys; delidx++)
 	{
-		if (pgsp_match_fn(key, &(rkeys[delidx]), 0) == 0)
+		if (pgsp_entry_ref_equal(ref, &(rkeys[delidx])))
 		{
 			int pos;
 
@@ -260,7 +295,7 @@ pgsp_entry_unregister_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
 #endif
 		}
 #if defined(USE_ASSERT_CHECKING)
-		Assert(pgsp_match_fn(key, &(rkeys[delidx]), 0) != 0);
+		Assert(!pgsp_entry_ref_equal(ref, &(rkeys[delidx])));
 #endif
 	}
 
@@ -285,6 +320,77 @@ pgsp_entry_unregister_rdepend(Oid dbid, Oid classid, Oid oid, pgspHashKey *key)
 	RESUME_INTERRUPTS();
 }
 
+/*
+ * Remove the reverse dependencies for an array of objects of the same class
+ * on the given pgspEntry.
+ */
+void
+pgsp_entry_unregister_rdepends(Oid dbid, Oid classid, const Oid *oids,
+							   int num, pgspEntryRef *ref)
+{
+	int			i;
+
+	for (i = 0; i < num; i++)
+		pgsp_entry_unregister_rdepend(dbid, classid, oids[i], ref);
+}
+
+/*
+ * Make a reverse dependency for a (dbid, classid, oid) registered with a
+ * reserved slot point to the entry that was eventually used instead, see
+ * pgsp_entry_alloc().  As the array never grows, this can't fail.
+ */
+void
+pgsp_entry_retarget_rdepend(Oid dbid, Oid classid, Oid oid,
+							pgspEntryRef *from, pgspEntryRef *to)
+{
+	pgspRdependEntry   *rentry;
+	pgspEntryRef		*rkeys;
+	pgspRdependKey		rkey = {dbid, classid, oid};
+	int					fromidx = -1;
+	bool				found = false;
+	int					i;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+	Assert(pgsp_area != NULL);
+
+	rentry = dshash_find(pgsp_rdepend, &rkey, true);
+
+	if(!rentry)
+		return;
+
+	Assert(rentry->keys != InvalidDsaPointer);
+
+	rkeys = (pgspEntryRef *) dsa_get_address(pgsp_area, rentry->keys);
+	for (i = 0; i < rentry->num_keys; i++)
+	{
+		if (pgsp_entry_ref_equal(from, &(rkeys[i])))
+			fromidx = i;
+		else if (pgsp_entry_ref_equal(to, &(rkeys[i])))
+			found = true;
+	}
+
+	if (fromidx != -1)
+	{
+		if (!found)
+			rkeys[fromidx] = *to;
+		else
+		{
+			/*
+			 * The entry already depends on that object, simply forget the
+			 * reserved slot.  There's at least the target reference left so
+			 * the rdepend entry is kept.
+			 */
+			for (i = fromidx + 1; i < rentry->num_keys; i++)
+				rkeys[i - 1] = rkeys[i];
+
+			Assert(rentry->num_keys > 1);
+			rentry->num_keys--;
+		}
+	}
+
+	dshash_release_lock(pgsp_rdepend, rentry);
+}
+
 static void
 pgsp_get_rdep_name(Oid classid, Oid oid, char **deptype, char **depname)
 {
@@ -336,6 +442,26 @@ pgsp_rdepend_fn_compare(const void *a, const void *b, size_t size,
 		return 1;
 }
 
+/*
+ * qsort comparator for pgspRdependKey, used to keep the entries' rdeps array
+ * sorted.
+ */
+int
+pgsp_rdepend_key_cmp(const void *a, const void *b)
+{
+	const pgspRdependKey *k1 = (const pgspRdependKey *) a;
+	const pgspRdependKey *k2 = (const pgspRdependKey *) b;
+
+	if (k1->dbid != k2->dbid)
+		return k1->dbid < k2->dbid ? -1 : 1;
+	if (k1->classid != k2->classid)
+		return k1->classid < k2->classid ? -1 : 1;
+	if (k1->oid != k2->oid)
+		return k1->oid < k2->oid ? -1 : 1;
+
+	return 0;
+}
+
 /* Calculate a hash value for a given rdepend key. */
 dshash_hash
 pgsp_rdepend_fn_hash(const void *v, size_t size, void *arg)
@@ -349,3 +475,122 @@ pgsp_rdepend_fn_hash(const void *v, size_t size, void *arg)
 
 	return h;
 }
+
+#define PG_SHARED_PLANS_RDEPENDS_COLS	10
+/*
+ * Display the content of the pgsp_rdepend dshash.
+ */
+Datum
+pg_shared_plans_rdepends(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 150000
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	dshash_seq_status status;
+	pgspRdependEntry *rentry;
+
+	if (!pgsp || !pgsp_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_shared_plans must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Create or attach to the dsa. */
+	pgsp_attach_dsa();
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Prevent any concurrent modification of the rdepend entries. */
+	LWLockAcquire(pgsp->lock, LW_SHARED);
+
+	dshash_seq_init(&status, pgsp_rdepend, false);
+	while ((rentry = dshash_seq_next(&status)) != NULL)
+	{
+		Datum		values[PG_SHARED_PLANS_RDEPENDS_COLS];
+		bool		nulls[PG_SHARED_PLANS_RDEPENDS_COLS];
+		int			i = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(rentry->key.dbid);
+
+		/*
+		 * For types and functions, we only know the syscache hash value of
+		 * the object, see pgsp_evict_by_oid().
+		 */
+		switch (rentry->key.classid)
+		{
+			case RELOID:
+				values[i++] = ObjectIdGetDatum(RelationRelationId);
+				values[i++] = ObjectIdGetDatum(rentry->key.oid);
+				nulls[i++] = true;
+				break;
+			case TYPEOID:
+				values[i++] = ObjectIdGetDatum(TypeRelationId);
+				nulls[i++] = true;
+				values[i++] = Int64GetDatum((int64) rentry->key.oid);
+				break;
+			case PROCOID:
+				values[i++] = ObjectIdGetDatum(ProcedureRelationId);
+				nulls[i++] = true;
+				values[i++] = Int64GetDatum((int64) rentry->key.oid);
+				break;
+			default:
+				elog(ERROR, "pgsp: rdepend classid %d not handled",
+					 rentry->key.classid);
+		}
+
+		values[i++] = Int32GetDatum(rentry->num_keys);
+		values[i++] = Int32GetDatum(rentry->max_keys);
+		values[i++] = Int64GetDatum(sizeof(pgspRdependEntry) +
+									RDEPEND_KEY_SIZE(rentry->max_keys));
+		values[i++] = Int64GetDatum(rentry->discards);
+		values[i++] = Int64GetDatum(rentry->evictions);
+		values[i++] = Int64GetDatum(rentry->refused);
+
+		Assert(i == PG_SHARED_PLANS_RDEPENDS_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	dshash_seq_term(&status);
+
+	LWLockRelease(pgsp->lock);
+
+#if PG_VERSION_NUM < 170000
+	/* Should be a no-op anyway. */
+	tuplestore_donestoring(tupstore);
+#endif
+	return (Datum) 0;
+#else
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("pg_shared_plans_rdepends() requires PostgreSQL 15 or later")));
+	return (Datum) 0;			/* keep compiler quiet */
+#endif
+}
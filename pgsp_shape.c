@@ -0,0 +1,132 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_shape.c: Plans generated for a parameter shape.
+ *
+ * Queries generated by ORMs often contain optional filters, like
+ * (col = $1 OR $1 IS NULL), or arrays whose size varies a lot, like
+ * col = ANY($1).  A single generic plan is a poor fit for those, and a custom
+ * plan costs a full planning for each execution.  Instead, when a custom plan
+ * is needed, a plan is generated for the shape of the parameters, which is
+ * which parameters are NULL and the log-bucketed number of elements of the
+ * arrays, and memoized with the entry, keyed by the shape.
+ *
+ * Such a plan is generated with the NULL parameters replaced by constants, so
+ * that the planner can simplify the expressions using them, while the other
+ * parameters are kept as is but their values are still used for the
+ * estimates.  It's therefore valid for any parameter values of the same
+ * shape.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#endif
+#include "port/pg_bitutils.h"
+#include "utils/array.h"
+#include "utils/lsyscache.h"
+
+#include "include/pgsp_shape.h"
+
+/* Shape of a single parameter */
+typedef struct pgspParamShape
+{
+	uint8		isnull;		/* is the parameter NULL */
+	uint8		bucket;		/* 0 if the array is empty or the parameter
+							   isn't an array, otherwise 1 + log2 of its
+							   number of elements */
+} pgspParamShape;
+
+/*---- GUC variables ----*/
+
+bool		pgsp_shape_plans = false;
+
+/*
+ * Compute the shape of the given bound parameters, used as the memo key, and
+ * its hash.  Returns NULL if the parameters can't be memoized, or if they
+ * don't have any NULL or array value, in which case the shape wouldn't be
+ * different from a generic plan.
+ */
+char *
+pgsp_shape_key(ParamListInfo params, size_t *len, uint64 *hash)
+{
+	pgspParamShape *shape;
+	bool		informative = false;
+	int			i;
+
+	/* Parameters fetched on demand can't be known in advance. */
+	if (params == NULL || params->numParams == 0 ||
+		params->paramFetch != NULL)
+		return NULL;
+
+	shape = (pgspParamShape *) palloc0(sizeof(pgspParamShape) *
+									   params->numParams);
+
+	for (i = 0; i < params->numParams; i++)
+	{
+		ParamExternData *prm = &params->params[i];
+		ArrayType  *array;
+		int			nitems;
+
+		if (prm->isnull)
+		{
+			shape[i].isnull = true;
+			informative = true;
+			continue;
+		}
+
+		if (!OidIsValid(prm->ptype) || !type_is_array(prm->ptype))
+			continue;
+
+		array = DatumGetArrayTypeP(prm->value);
+		nitems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+		if (nitems > 0)
+			shape[i].bucket = pg_leftmost_one_pos32((uint32) nitems) + 1;
+
+		if ((Pointer) array != DatumGetPointer(prm->value))
+			pfree(array);
+
+		informative = true;
+	}
+
+	if (!informative)
+	{
+		pfree(shape);
+		return NULL;
+	}
+
+	*len = sizeof(pgspParamShape) * params->numParams;
+	*hash = DatumGetUInt64(hash_any_extended((unsigned char *) shape,
+											 *len, 0));
+
+	return (char *) shape;
+}
+
+/*
+ * Return a copy of the given bound parameters that the planner will only
+ * replace with constants if they're NULL.
+ */
+ParamListInfo
+pgsp_shape_bind(ParamListInfo params)
+{
+	ParamListInfo result = copyParamList(params);
+	int			i;
+
+	for (i = 0; i < result->numParams; i++)
+	{
+		ParamExternData *prm = &result->params[i];
+
+		prm->pflags = prm->isnull ? PARAM_FLAG_CONST : 0;
+	}
+
+	return result;
+}
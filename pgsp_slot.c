@@ -0,0 +1,161 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_slot.c: Stable slot indexes for the pgsp_hash entries.
+ *
+ * Every entry is given a slot in a shared array for its whole lifetime, and
+ * the reverse dependencies only store an 8 bytes reference to that slot
+ * rather than the full pgspHashKey.  The reference also contains the
+ * generation of the slot, bumped each time the slot is released, so that a
+ * reference to a removed entry can never point to another entry that reused
+ * the slot.
+ *
+ * The slot has to be reserved before the entry is created, as the reverse
+ * dependencies are registered before the entry is inserted, see
+ * pgsp_allocate_plan().  There can therefore be more slots in use than
+ * entries in pgsp_hash, hence twice as many slots as pg_shared_plans.max.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+#include "include/pg_shared_plans.h"
+#include "include/pgsp_slot.h"
+
+/*---- Local variables ----*/
+
+static pgspSlots *pgsp_slots = NULL;
+
+/*
+ * Estimate shared memory space needed for the slots.
+ */
+Size
+pgsp_slot_memsize(void)
+{
+	return add_size(offsetof(pgspSlots, slots),
+					mul_size(PGSP_NUM_SLOTS, sizeof(pgspSlot)));
+}
+
+/*
+ * Allocate or attach to the slots.  Caller must hold AddinShmemInitLock.
+ */
+void
+pgsp_slot_shmem_startup(void)
+{
+	bool		found;
+	uint32		i;
+
+	pgsp_slots = ShmemInitStruct("pg_shared_plans slots",
+								 pgsp_slot_memsize(),
+								 &found);
+
+	if (!found)
+	{
+		pgsp_slots->num_slots = PGSP_NUM_SLOTS;
+		for (i = 0; i < PGSP_NUM_SLOTS; i++)
+		{
+			pgsp_slots->slots[i].entry = NULL;
+			pgsp_slots->slots[i].generation = 0;
+			pgsp_slots->slots[i].next_free = (i + 1 < PGSP_NUM_SLOTS ?
+											  i + 1 : PGSP_SLOT_NONE);
+		}
+		pgsp_slots->first_free = (PGSP_NUM_SLOTS > 0 ? 0 : PGSP_SLOT_NONE);
+	}
+}
+
+/*
+ * Reserve a free slot for an entry about to be created.  Returns false if
+ * there isn't any free slot left.  Caller must hold an exclusive lock on
+ * pgsp->lock.
+ */
+bool
+pgsp_slot_reserve(pgspEntryRef *ref)
+{
+	pgspSlot   *slot;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+
+	if (pgsp_slots->first_free == PGSP_SLOT_NONE)
+		return false;
+
+	ref->slot = pgsp_slots->first_free;
+	slot = &pgsp_slots->slots[ref->slot];
+
+	pgsp_slots->first_free = slot->next_free;
+	slot->next_free = PGSP_SLOT_NONE;
+	Assert(slot->entry == NULL);
+
+	ref->generation = slot->generation;
+
+	return true;
+}
+
+/*
+ * Associate a reserved slot with its newly created entry.  Caller must hold
+ * an exclusive lock on pgsp->lock.
+ */
+void
+pgsp_slot_attach(pgspEntryRef *ref, pgspEntry *entry)
+{
+	pgspSlot   *slot;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+	Assert(ref->slot < pgsp_slots->num_slots);
+
+	slot = &pgsp_slots->slots[ref->slot];
+	Assert(slot->generation == ref->generation);
+	Assert(slot->entry == NULL);
+
+	slot->entry = entry;
+}
+
+/*
+ * Release a slot, either reserved or attached to an entry being removed.  Any
+ * remaining reference to it becomes stale.  Caller must hold an exclusive lock
+ * on pgsp->lock.
+ */
+void
+pgsp_slot_release(pgspEntryRef *ref)
+{
+	pgspSlot   *slot;
+
+	Assert(LWLockHeldByMeInMode(pgsp->lock, LW_EXCLUSIVE));
+	Assert(ref->slot < pgsp_slots->num_slots);
+
+	slot = &pgsp_slots->slots[ref->slot];
+	Assert(slot->generation == ref->generation);
+
+	slot->entry = NULL;
+	slot->generation++;
+	slot->next_free = pgsp_slots->first_free;
+	pgsp_slots->first_free = ref->slot;
+}
+
+/*
+ * Return the entry the given reference points to, or NULL if the entry was
+ * removed or isn't created yet.  Caller must hold a lock on pgsp->lock.
+ */
+pgspEntry *
+pgsp_slot_get(pgspEntryRef *ref)
+{
+	pgspSlot   *slot;
+
+	Assert(LWLockHeldByMe(pgsp->lock));
+
+	if (ref->slot >= pgsp_slots->num_slots)
+		return NULL;
+
+	slot = &pgsp_slots->slots[ref->slot];
+	if (slot->generation != ref->generation)
+		return NULL;
+
+	return slot->entry;
+}
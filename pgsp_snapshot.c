@@ -0,0 +1,504 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_snapshot.c: Periodic snapshots of the shared plan cache statistics.
+ *
+ * A background worker samples the global counters every
+ * pg_shared_plans.snapshot_interval and stores them in a ring buffer in shared
+ * memory, holding the last pg_shared_plans.snapshot_max snapshots.  Each
+ * snapshot also keeps the counters of the pg_shared_plans.snapshot_entries
+ * most used entries at that time, so that changes of the hot set can be
+ * followed.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <signal.h>
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+
+#include "include/pg_shared_plans.h"
+#include "include/pgsp_snapshot.h"
+
+/*---- GUC variables ----*/
+
+int			pgsp_snapshot_interval;
+int			pgsp_snapshot_max;
+int			pgsp_snapshot_entries;
+
+/*---- Local variables ----*/
+
+static pgspSnapshotRing *pgsp_snapshots = NULL;
+static volatile sig_atomic_t got_sighup = false;
+
+PG_FUNCTION_INFO_V1(pg_shared_plans_snapshots);
+PG_FUNCTION_INFO_V1(pg_shared_plans_snapshots_entries);
+PG_FUNCTION_INFO_V1(pg_shared_plans_snapshot_take);
+
+static pgspSnapshotEntry *pgsp_snapshot_get_entries(int i);
+static void pgsp_snapshot_sighup(SIGNAL_ARGS);
+static void pgsp_snapshot_init_srf(FunctionCallInfo fcinfo,
+								   Tuplestorestate **tupstore,
+								   TupleDesc *tupdesc);
+
+/*
+ * Estimate shared memory space needed for the snapshots.
+ */
+Size
+pgsp_snapshot_memsize(void)
+{
+	Size		size;
+
+	size = offsetof(pgspSnapshotRing, snapshots);
+	size = add_size(size, mul_size(pgsp_snapshot_max, sizeof(pgspSnapshot)));
+	size = MAXALIGN(size);
+	size = add_size(size, mul_size(mul_size(pgsp_snapshot_max,
+											pgsp_snapshot_entries),
+								   sizeof(pgspSnapshotEntry)));
+
+	return size;
+}
+
+/*
+ * Return the per-entry records of the i-th slot of the ring.
+ */
+static pgspSnapshotEntry *
+pgsp_snapshot_get_entries(int i)
+{
+	char	   *ptr = (char *) pgsp_snapshots;
+
+	ptr += MAXALIGN(offsetof(pgspSnapshotRing, snapshots) +
+					pgsp_snapshot_max * sizeof(pgspSnapshot));
+
+	return (pgspSnapshotEntry *) ptr + i * pgsp_snapshot_entries;
+}
+
+/*
+ * Allocate or attach to the snapshot ring.  Caller must hold
+ * AddinShmemInitLock.
+ */
+void
+pgsp_snapshot_shmem_startup(LWLock *lock)
+{
+	bool		found;
+
+	pgsp_snapshots = ShmemInitStruct("pg_shared_plans snapshots",
+									 pgsp_snapshot_memsize(),
+									 &found);
+
+	if (!found)
+	{
+		pgsp_snapshots->lock = lock;
+		pgsp_snapshots->next = 0;
+		pgsp_snapshots->count = 0;
+	}
+}
+
+/*
+ * Register the snapshot background worker, if snapshots are enabled.
+ */
+void
+pgsp_snapshot_register_worker(void)
+{
+	BackgroundWorker worker;
+
+	if (pgsp_snapshot_max == 0)
+		return;
+
+	memset(&worker, 0, sizeof(BackgroundWorker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = 10;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_shared_plans");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "pgsp_snapshot_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_shared_plans snapshot");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_shared_plans snapshot");
+
+	RegisterBackgroundWorker(&worker);
+}
+
+static void
+pgsp_snapshot_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Main entry point of the snapshot background worker.
+ */
+void
+pgsp_snapshot_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, pgsp_snapshot_sighup);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	for (;;)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		pgsp_snapshot_take();
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 pgsp_snapshot_interval * 1000L,
+						 PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+	}
+}
+
+/*
+ * Sample the current counters and store them in the snapshot ring, along with
+ * the counters of the most used entries.  Usage is measured as the number of
+ * executions going through the entry, bypass or not.
+ */
+void
+pgsp_snapshot_take(void)
+{
+	volatile pgspSharedState *s = (volatile pgspSharedState *) pgsp;
+	pgspSnapshot snap;
+	pgspSnapshotEntry *top = NULL;
+	int			min_top = 0;
+	HASH_SEQ_STATUS hash_seq;
+	pgspEntry  *entry;
+
+	if (pgsp_snapshot_max == 0)
+		return;
+
+	memset(&snap, 0, sizeof(pgspSnapshot));
+	snap.ts = GetCurrentTimestamp();
+
+	if (pgsp_snapshot_entries > 0)
+		top = (pgspSnapshotEntry *) palloc(sizeof(pgspSnapshotEntry) *
+										   pgsp_snapshot_entries);
+
+	/*
+	 * The counters of removed entries are only modified while holding an
+	 * exclusive lock on pgsp->lock, so we get a consistent view with the
+	 * entries we iterate over.
+	 */
+	LWLockAcquire(pgsp->lock, LW_SHARED);
+
+	snap.bypass = pgsp->removed_bypass;
+	snap.num_custom_plans = pgsp->removed_custom_plans;
+	snap.discard = pgsp->removed_discard;
+
+	hash_seq_init(&hash_seq, pgsp_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		volatile pgspEntry *e = (volatile pgspEntry *) entry;
+		int64		bypass;
+		int64		num_custom_plans;
+		int			i;
+
+		snap.num_entries++;
+		if (entry->plan != InvalidDsaPointer)
+			snap.num_plans++;
+		snap.discard += entry->discard;
+
+		SpinLockAcquire(&e->mutex);
+		bypass = e->bypass;
+		num_custom_plans = e->num_custom_plans;
+		SpinLockRelease(&e->mutex);
+
+		snap.bypass += bypass;
+		snap.num_custom_plans += num_custom_plans;
+
+		if (top == NULL)
+			continue;
+
+		/*
+		 * Keep the entry if there's still room, or if it's more used than the
+		 * least used one kept so far, which it then replaces.
+		 */
+		if (snap.num_top < pgsp_snapshot_entries)
+			i = snap.num_top++;
+		else if (bypass + num_custom_plans >
+				 top[min_top].bypass + top[min_top].num_custom_plans)
+			i = min_top;
+		else
+			continue;
+
+		top[i].key = entry->key;
+		top[i].bypass = bypass;
+		top[i].num_custom_plans = num_custom_plans;
+		top[i].discard = entry->discard;
+
+		/* Find the new least used entry once all the room is used. */
+		if (snap.num_top == pgsp_snapshot_entries)
+		{
+			int			j;
+
+			min_top = 0;
+			for (j = 1; j < snap.num_top; j++)
+			{
+				if (top[j].bypass + top[j].num_custom_plans <
+					top[min_top].bypass + top[min_top].num_custom_plans)
+					min_top = j;
+			}
+		}
+	}
+
+	LWLockRelease(pgsp->lock);
+
+	SpinLockAcquire(&s->mutex);
+	snap.stats_reset = s->stats_reset;
+	snap.alloced_size = s->alloced_size;
+	snap.rdepend_num = s->rdepend_num;
+	snap.dealloc = s->dealloc;
+	SpinLockRelease(&s->mutex);
+
+	LWLockAcquire(pgsp_snapshots->lock, LW_EXCLUSIVE);
+	pgsp_snapshots->snapshots[pgsp_snapshots->next] = snap;
+	if (snap.num_top > 0)
+		memcpy(pgsp_snapshot_get_entries(pgsp_snapshots->next), top,
+			   sizeof(pgspSnapshotEntry) * snap.num_top);
+	pgsp_snapshots->next = (pgsp_snapshots->next + 1) % pgsp_snapshot_max;
+	if (pgsp_snapshots->count < pgsp_snapshot_max)
+		pgsp_snapshots->count++;
+	LWLockRelease(pgsp_snapshots->lock);
+
+	if (top)
+		pfree(top);
+}
+
+/*
+ * Common initialization of the snapshot SRFs.
+ */
+static void
+pgsp_snapshot_init_srf(FunctionCallInfo fcinfo, Tuplestorestate **tupstore,
+					   TupleDesc *tupdesc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+
+	if (!pgsp || !pgsp_snapshots)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_shared_plans must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	*tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = *tupstore;
+	rsinfo->setDesc = *tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Take a snapshot right away, without waiting for the background worker.
+ */
+Datum
+pg_shared_plans_snapshot_take(PG_FUNCTION_ARGS)
+{
+	if (!pgsp || !pgsp_snapshots)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_shared_plans must be loaded via shared_preload_libraries")));
+
+	pgsp_snapshot_take();
+
+	PG_RETURN_VOID();
+}
+
+#define PG_SHARED_PLANS_SNAPSHOTS_COLS	10
+Datum
+pg_shared_plans_snapshots(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	pgspSnapshot *snaps;
+	int			count;
+	int			first;
+	int			i;
+
+	pgsp_snapshot_init_srf(fcinfo, &tupstore, &tupdesc);
+
+	if (pgsp_snapshot_max == 0)
+	{
+#if PG_VERSION_NUM < 170000
+		/* Should be a no-op anyway. */
+		tuplestore_donestoring(tupstore);
+#endif
+		return (Datum) 0;
+	}
+
+	/* Work on a copy to hold the lock as little as possible. */
+	snaps = (pgspSnapshot *) palloc(sizeof(pgspSnapshot) * pgsp_snapshot_max);
+
+	LWLockAcquire(pgsp_snapshots->lock, LW_SHARED);
+	count = pgsp_snapshots->count;
+	first = (pgsp_snapshots->next - count + pgsp_snapshot_max) %
+		pgsp_snapshot_max;
+	memcpy(snaps, pgsp_snapshots->snapshots,
+		   sizeof(pgspSnapshot) * pgsp_snapshot_max);
+	LWLockRelease(pgsp_snapshots->lock);
+
+	/* Return the snapshots from the oldest to the newest. */
+	for (i = 0; i < count; i++)
+	{
+		Datum		values[PG_SHARED_PLANS_SNAPSHOTS_COLS];
+		bool		nulls[PG_SHARED_PLANS_SNAPSHOTS_COLS];
+		pgspSnapshot *snap = &snaps[(first + i) % pgsp_snapshot_max];
+		int			j = 0;
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		values[j++] = TimestampTzGetDatum(snap->ts);
+		if (snap->stats_reset != 0)
+			values[j++] = TimestampTzGetDatum(snap->stats_reset);
+		else
+			nulls[j++] = true;
+		values[j++] = Int64GetDatumFast(snap->num_entries);
+		values[j++] = Int64GetDatumFast(snap->num_plans);
+		values[j++] = Int64GetDatumFast(snap->alloced_size);
+		values[j++] = Int32GetDatum(snap->rdepend_num);
+		values[j++] = Int64GetDatumFast(snap->dealloc);
+		values[j++] = Int64GetDatumFast(snap->bypass);
+		values[j++] = Int64GetDatumFast(snap->num_custom_plans);
+		values[j++] = Int64GetDatumFast(snap->discard);
+
+		Assert(j == PG_SHARED_PLANS_SNAPSHOTS_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	pfree(snaps);
+
+#if PG_VERSION_NUM < 170000
+	/* Should be a no-op anyway. */
+	tuplestore_donestoring(tupstore);
+#endif
+	return (Datum) 0;
+}
+
+#define PG_SHARED_PLANS_SNAPSHOTS_ENTRIES_COLS	8
+Datum
+pg_shared_plans_snapshots_entries(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	pgspSnapshot *snaps;
+	pgspSnapshotEntry *entries;
+	int			count;
+	int			first;
+	int			i;
+
+	pgsp_snapshot_init_srf(fcinfo, &tupstore, &tupdesc);
+
+	if (pgsp_snapshot_max == 0 || pgsp_snapshot_entries == 0)
+	{
+#if PG_VERSION_NUM < 170000
+		/* Should be a no-op anyway. */
+		tuplestore_donestoring(tupstore);
+#endif
+		return (Datum) 0;
+	}
+
+	/* Work on a copy to hold the lock as little as possible. */
+	snaps = (pgspSnapshot *) palloc(sizeof(pgspSnapshot) * pgsp_snapshot_max);
+	entries = (pgspSnapshotEntry *) palloc(sizeof(pgspSnapshotEntry) *
+										   pgsp_snapshot_max *
+										   pgsp_snapshot_entries);
+
+	LWLockAcquire(pgsp_snapshots->lock, LW_SHARED);
+	count = pgsp_snapshots->count;
+	first = (pgsp_snapshots->next - count + pgsp_snapshot_max) %
+		pgsp_snapshot_max;
+	memcpy(snaps, pgsp_snapshots->snapshots,
+		   sizeof(pgspSnapshot) * pgsp_snapshot_max);
+	memcpy(entries, pgsp_snapshot_get_entries(0),
+		   sizeof(pgspSnapshotEntry) * pgsp_snapshot_max *
+		   pgsp_snapshot_entries);
+	LWLockRelease(pgsp_snapshots->lock);
+
+	/* Return the snapshots from the oldest to the newest. */
+	for (i = 0; i < count; i++)
+	{
+		int			slot = (first + i) % pgsp_snapshot_max;
+		pgspSnapshot *snap = &snaps[slot];
+		int			j;
+
+		for (j = 0; j < snap->num_top; j++)
+		{
+			Datum		values[PG_SHARED_PLANS_SNAPSHOTS_ENTRIES_COLS];
+			bool		nulls[PG_SHARED_PLANS_SNAPSHOTS_ENTRIES_COLS];
+			pgspSnapshotEntry *entry;
+			int			k = 0;
+
+			entry = &entries[slot * pgsp_snapshot_entries + j];
+
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			values[k++] = TimestampTzGetDatum(snap->ts);
+			values[k++] = ObjectIdGetDatum(entry->key.userid);
+			values[k++] = ObjectIdGetDatum(entry->key.dbid);
+			values[k++] = Int64GetDatumFast(entry->key.queryid);
+			values[k++] = ObjectIdGetDatum(entry->key.constid);
+			values[k++] = Int64GetDatumFast(entry->bypass);
+			values[k++] = Int64GetDatumFast(entry->num_custom_plans);
+			values[k++] = Int64GetDatumFast(entry->discard);
+
+			Assert(k == PG_SHARED_PLANS_SNAPSHOTS_ENTRIES_COLS);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+	pfree(snaps);
+	pfree(entries);
+
+#if PG_VERSION_NUM < 170000
+	/* Should be a no-op anyway. */
+	tuplestore_donestoring(tupstore);
+#endif
+	return (Datum) 0;
+}
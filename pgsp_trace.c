@@ -0,0 +1,587 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_trace.c: Recording and replay of shared plan cache accesses.
+ *
+ * When pg_shared_plans.trace is enabled, each access to the shared plan cache
+ * done in pgsp_planner_hook is appended to a binary trace file, which is
+ * rotated once it reaches pg_shared_plans.trace_size.  The trace can then be
+ * replayed by pg_shared_plans_simulate() against various eviction policies and
+ * cache sizes, to help sizing pg_shared_plans.max, and removed by
+ * pg_shared_plans_trace_reset().
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "catalog/pg_type.h"
+#include "funcapi.h"
+#include "lib/ilist.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/timestamp.h"
+
+#include "include/pgsp_import.h"
+#include "include/pgsp_trace.h"
+
+#define PGSP_TRACE_BUFSIZE		64		/* # of records buffered locally */
+#define PGSP_TRACE_FLUSH_MS		1000	/* max age of a buffered record */
+
+typedef enum pgspSimPolicy
+{
+	PGSP_SIM_USAGE,			/* current pg_shared_plans policy */
+	PGSP_SIM_LFU,			/* same, but usage isn't weighted by plantime */
+	PGSP_SIM_LRU			/* least recently used entry is evicted */
+} pgspSimPolicy;
+
+#define PGSP_SIM_NB_POLICIES	(PGSP_SIM_LRU + 1)
+
+static const char *const pgspSimPolicyNames[PGSP_SIM_NB_POLICIES] = {
+	"usage",
+	"lfu",
+	"lru"
+};
+
+typedef struct pgspSimEntry
+{
+	pgspHashKey key;		/* hash key of entry - MUST BE FIRST */
+	double		usage;
+	double		plantime;	/* last known planning time */
+	dlist_node	node;		/* position in the LRU list */
+} pgspSimEntry;
+
+typedef struct pgspSimResult
+{
+	int64		accesses;
+	int64		hits;
+	int64		evictions;
+	double		plantime_saved;
+} pgspSimResult;
+
+/*---- GUC variables ----*/
+
+bool		pgsp_trace_enabled;
+int			pgsp_trace_size;
+
+/*---- Local variables ----*/
+
+static pgspTraceRecord pgsp_trace_buf[PGSP_TRACE_BUFSIZE];
+static int	pgsp_trace_nbuf = 0;
+static int	pgsp_trace_fd = -1;
+static uint32 pgsp_trace_generation = 0;
+static bool pgsp_trace_exit_registered = false;
+
+PG_FUNCTION_INFO_V1(pg_shared_plans_simulate);
+PG_FUNCTION_INFO_V1(pg_shared_plans_trace_reset);
+
+static void pgsp_trace_flush(void);
+static void pgsp_trace_shmem_exit(int code, Datum arg);
+static void pgsp_simulate_run(const char **files, int nfiles,
+							  pgspSimPolicy policy, int capacity,
+							  pgspSimResult *res);
+static void pgsp_simulate_dealloc(HTAB *htab, pgspSimResult *res);
+static int sim_entry_cmp(const void *lhs, const void *rhs);
+
+/*
+ * Initialize the trace state in shared memory.  Caller must hold
+ * AddinShmemInitLock.
+ */
+void
+pgsp_trace_shmem_startup(void)
+{
+	struct stat st;
+	uint64		size = 0;
+
+	/* Keep appending to an existing trace file if any. */
+	if (stat(PGSP_TRACE_FILE, &st) == 0)
+		size = st.st_size;
+
+	pg_atomic_init_u64(&pgsp->trace_size, size);
+	pg_atomic_init_u32(&pgsp->trace_generation, 0);
+}
+
+/*
+ * Record an access to the shared plan cache.  The record is only buffered
+ * locally, to avoid a write() for each planner call.  The buffer is flushed
+ * when it's full, when its oldest record is too old or at backend exit.
+ */
+void
+pgsp_trace_record(pgspHashKey *key, pgspTraceKind kind, size_t len,
+				  double plantime)
+{
+	pgspTraceRecord *rec;
+	TimestampTz	now = GetCurrentTimestamp();
+
+	Assert(!LWLockHeldByMe(pgsp->lock));
+
+	if (!pgsp_trace_exit_registered)
+	{
+		before_shmem_exit(pgsp_trace_shmem_exit, (Datum) 0);
+		pgsp_trace_exit_registered = true;
+	}
+
+	rec = &pgsp_trace_buf[pgsp_trace_nbuf++];
+	memset(rec, 0, sizeof(pgspTraceRecord));
+	rec->ts = now;
+	rec->queryid = key->queryid;
+	rec->userid = key->userid;
+	rec->dbid = key->dbid;
+	rec->constid = key->constid;
+	rec->len = (uint32) Min(len, PG_UINT32_MAX);
+	rec->plantime = plantime;
+	rec->version = PGSP_TRACE_VERSION;
+	rec->kind = (uint8) kind;
+
+	if (pgsp_trace_nbuf == PGSP_TRACE_BUFSIZE ||
+		TimestampDifferenceExceeds(pgsp_trace_buf[0].ts, now,
+								   PGSP_TRACE_FLUSH_MS))
+		pgsp_trace_flush();
+}
+
+/*
+ * Append all locally buffered records to the trace file, and rotate it if
+ * needed.
+ *
+ * Errors are only reported at LOG level, as we don't want to make the query
+ * fail because of the trace.  The buffered records are discarded in that
+ * case.
+ */
+static void
+pgsp_trace_flush(void)
+{
+	Size		size = sizeof(pgspTraceRecord) * pgsp_trace_nbuf;
+	uint64		limit = (uint64) pgsp_trace_size * 1024;
+	uint64		cursize;
+	uint32		generation;
+
+	if (pgsp_trace_nbuf == 0)
+		return;
+
+	/* Reopen the file if another backend rotated it. */
+	generation = pg_atomic_read_u32(&pgsp->trace_generation);
+	if (pgsp_trace_fd >= 0 && generation != pgsp_trace_generation)
+	{
+		close(pgsp_trace_fd);
+		pgsp_trace_fd = -1;
+	}
+
+	if (pgsp_trace_fd < 0)
+	{
+		pgsp_trace_fd = BasicOpenFile(PGSP_TRACE_FILE,
+									  O_WRONLY | O_APPEND | O_CREAT | PG_BINARY);
+		if (pgsp_trace_fd < 0)
+		{
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("pgsp: could not open file \"%s\": %m",
+							PGSP_TRACE_FILE)));
+			pgsp_trace_nbuf = 0;
+			return;
+		}
+		pgsp_trace_generation = generation;
+	}
+
+	/*
+	 * Records are written in a single append-only write, so concurrent
+	 * writers can't interleave partial records.
+	 */
+	if (write(pgsp_trace_fd, pgsp_trace_buf, size) != (ssize_t) size)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("pgsp: could not write file \"%s\": %m",
+						PGSP_TRACE_FILE)));
+		pgsp_trace_nbuf = 0;
+		return;
+	}
+	pgsp_trace_nbuf = 0;
+
+	/*
+	 * Only the backend that crossed the size limit rotates the file.  Other
+	 * backends will notice the new generation on their next flush and reopen
+	 * the file, records they write in the meantime simply end up in the
+	 * rotated file.
+	 */
+	cursize = pg_atomic_add_fetch_u64(&pgsp->trace_size, size);
+	if (cursize >= limit && cursize - size < limit)
+	{
+		if (rename(PGSP_TRACE_FILE, PGSP_TRACE_OLD_FILE) != 0)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("pgsp: could not rename file \"%s\" to \"%s\": %m",
+							PGSP_TRACE_FILE, PGSP_TRACE_OLD_FILE)));
+
+		pg_atomic_write_u64(&pgsp->trace_size, 0);
+		pg_atomic_fetch_add_u32(&pgsp->trace_generation, 1);
+	}
+}
+
+static void
+pgsp_trace_shmem_exit(int code, Datum arg)
+{
+	pgsp_trace_flush();
+
+	if (pgsp_trace_fd >= 0)
+	{
+		close(pgsp_trace_fd);
+		pgsp_trace_fd = -1;
+	}
+}
+
+/*
+ * Replay a single trace against a simulated cache of the given capacity,
+ * using the given eviction policy.
+ *
+ * A record is counted as a hit if its key is present in the simulated cache.
+ * Planning time is only considered as saved if the record isn't
+ * PGSP_TRACE_CUSTOM, as in that case the cost model rejected the generic
+ * plan, whatever the cache size.  New entries are only admitted if their
+ * planning time is at least pg_shared_plans.min_plan_time.
+ */
+static void
+pgsp_simulate_run(const char **files, int nfiles, pgspSimPolicy policy,
+				  int capacity, pgspSimResult *res)
+{
+	HASHCTL		info;
+	HTAB	   *htab;
+	dlist_head	lru;
+	int			i;
+
+	memset(res, 0, sizeof(pgspSimResult));
+
+	memset(&info, 0, sizeof(HASHCTL));
+	info.keysize = sizeof(pgspHashKey);
+	info.entrysize = sizeof(pgspSimEntry);
+	info.hash = pgsp_hash_fn;
+	info.match = pgsp_match_fn;
+	info.hcxt = CurrentMemoryContext;
+	htab = hash_create("pg_shared_plans simulation", capacity, &info,
+					   HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+	dlist_init(&lru);
+
+	for (i = 0; i < nfiles; i++)
+	{
+		FILE	   *file;
+		pgspTraceRecord rec;
+
+		file = AllocateFile(files[i], PG_BINARY_R);
+		if (file == NULL)
+		{
+			/* The rotated or current file may legitimately not exist. */
+			if (errno == ENOENT)
+				continue;
+
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\" for reading: %m",
+							files[i])));
+		}
+
+		while (fread(&rec, sizeof(pgspTraceRecord), 1, file) == 1)
+		{
+			pgspHashKey		key;
+			pgspSimEntry   *entry;
+			bool			found;
+
+			CHECK_FOR_INTERRUPTS();
+
+			if (rec.version != PGSP_TRACE_VERSION)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("invalid record in trace file \"%s\"",
+								files[i])));
+
+			memset(&key, 0, sizeof(pgspHashKey));
+			key.userid = rec.userid;
+			key.dbid = rec.dbid;
+			key.queryid = rec.queryid;
+			key.constid = rec.constid;
+
+			res->accesses++;
+
+			entry = (pgspSimEntry *) hash_search(htab, &key, HASH_FIND, NULL);
+			if (entry)
+			{
+				res->hits++;
+
+				/* Hit records report the planning time of the cached plan. */
+				if (rec.kind == PGSP_TRACE_HIT)
+					entry->plantime = rec.plantime;
+
+				if (rec.kind != PGSP_TRACE_CUSTOM)
+					res->plantime_saved += entry->plantime;
+
+				if (policy == PGSP_SIM_LFU)
+					entry->usage += 1.0;
+				else
+					entry->usage += entry->plantime;
+
+				dlist_move_tail(&lru, &entry->node);
+				continue;
+			}
+
+			if (rec.plantime < pgsp_min_plantime)
+				continue;
+
+			/* Make space if needed */
+			while (hash_get_num_entries(htab) >= capacity)
+			{
+				if (policy == PGSP_SIM_LRU)
+				{
+					pgspSimEntry   *victim;
+
+					victim = dlist_container(pgspSimEntry, node,
+											 dlist_pop_head_node(&lru));
+					hash_search(htab, &victim->key, HASH_REMOVE, NULL);
+					res->evictions++;
+				}
+				else
+					pgsp_simulate_dealloc(htab, res);
+			}
+
+			entry = (pgspSimEntry *) hash_search(htab, &key, HASH_ENTER,
+												 &found);
+			Assert(!found);
+			entry->usage = PGSP_USAGE_INIT;
+			entry->plantime = rec.plantime;
+			dlist_push_tail(&lru, &entry->node);
+		}
+
+		if (ferror(file))
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", files[i])));
+
+		FreeFile(file);
+	}
+
+	hash_destroy(htab);
+}
+
+/*
+ * Same algorithm as pgsp_entry_dealloc(), working on the simulated cache.
+ */
+static void
+pgsp_simulate_dealloc(HTAB *htab, pgspSimResult *res)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pgspSimEntry **entries;
+	pgspSimEntry *entry;
+	int			nvictims;
+	int			i;
+
+	entries = palloc(hash_get_num_entries(htab) * sizeof(pgspSimEntry *));
+
+	i = 0;
+	hash_seq_init(&hash_seq, htab);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		entries[i++] = entry;
+		entry->usage *= USAGE_DECREASE_FACTOR;
+	}
+
+	qsort(entries, i, sizeof(pgspSimEntry *), sim_entry_cmp);
+
+	nvictims = Max(10, i * USAGE_DEALLOC_PERCENT / 100);
+	nvictims = Min(nvictims, i);
+
+	for (i = 0; i < nvictims; i++)
+	{
+		dlist_delete(&entries[i]->node);
+		hash_search(htab, &entries[i]->key, HASH_REMOVE, NULL);
+	}
+	res->evictions += nvictims;
+
+	pfree(entries);
+}
+
+/*
+ * qsort comparator for sorting into increasing usage order
+ */
+static int
+sim_entry_cmp(const void *lhs, const void *rhs)
+{
+	double		l_usage = (*(pgspSimEntry *const *) lhs)->usage;
+	double		r_usage = (*(pgspSimEntry *const *) rhs)->usage;
+
+	if (l_usage < r_usage)
+		return -1;
+	else if (l_usage > r_usage)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * Remove the current and rotated trace files, so that the next records start
+ * a new trace.  Other backends reopen the file on their next flush, records
+ * they write to the removed file in the meantime are lost.
+ */
+Datum
+pg_shared_plans_trace_reset(PG_FUNCTION_ARGS)
+{
+	if (!pgsp)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_shared_plans must be loaded via shared_preload_libraries")));
+
+	/* Our own buffered records belong to the old trace. */
+	pgsp_trace_nbuf = 0;
+
+	if (unlink(PGSP_TRACE_FILE) != 0 && errno != ENOENT)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", PGSP_TRACE_FILE)));
+
+	if (unlink(PGSP_TRACE_OLD_FILE) != 0 && errno != ENOENT)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m",
+						PGSP_TRACE_OLD_FILE)));
+
+	pg_atomic_write_u64(&pgsp->trace_size, 0);
+	pg_atomic_fetch_add_u32(&pgsp->trace_generation, 1);
+
+	PG_RETURN_VOID();
+}
+
+#define PG_SHARED_PLANS_SIMULATE_COLS	7
+Datum
+pg_shared_plans_simulate(PG_FUNCTION_ARGS)
+{
+	ArrayType  *capacities = PG_GETARG_ARRAYTYPE_P(0);
+	char	   *filename = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	const char *files[2];
+	int			nfiles;
+	Datum	   *elems;
+	bool	   *elemnulls;
+	int			nelems;
+	int			policy;
+	int			i;
+
+	if (!pgsp)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_shared_plans must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	if (ARR_NDIM(capacities) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("capacities must be a one-dimensional array")));
+
+	deconstruct_array(capacities, INT4OID, sizeof(int32), true, TYPALIGN_INT,
+					  &elems, &elemnulls, &nelems);
+
+	for (i = 0; i < nelems; i++)
+	{
+		if (elemnulls[i] || DatumGetInt32(elems[i]) < 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("capacities must be positive integers")));
+	}
+
+	/* Default to the current cache size. */
+	if (nelems == 0)
+	{
+		elems = (Datum *) palloc(sizeof(Datum));
+		elems[0] = Int32GetDatum(pgsp_max);
+		nelems = 1;
+	}
+
+	/* Replay the rotated file first, as it contains the oldest records. */
+	if (filename[0] == '\0')
+	{
+		files[0] = PGSP_TRACE_OLD_FILE;
+		files[1] = PGSP_TRACE_FILE;
+		nfiles = 2;
+	}
+	else
+	{
+		files[0] = filename;
+		nfiles = 1;
+	}
+
+	/* Make sure that our own records are visible. */
+	pgsp_trace_flush();
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	for (policy = 0; policy < PGSP_SIM_NB_POLICIES; policy++)
+	{
+		for (i = 0; i < nelems; i++)
+		{
+			Datum		values[PG_SHARED_PLANS_SIMULATE_COLS];
+			bool		nulls[PG_SHARED_PLANS_SIMULATE_COLS];
+			int			capacity = DatumGetInt32(elems[i]);
+			pgspSimResult res;
+			int			j = 0;
+
+			pgsp_simulate_run(files, nfiles, (pgspSimPolicy) policy, capacity,
+							  &res);
+
+			memset(values, 0, sizeof(values));
+			memset(nulls, 0, sizeof(nulls));
+
+			values[j++] = CStringGetTextDatum(pgspSimPolicyNames[policy]);
+			values[j++] = Int32GetDatum(capacity);
+			values[j++] = Int64GetDatumFast(res.accesses);
+			values[j++] = Int64GetDatumFast(res.hits);
+			if (res.accesses > 0)
+				values[j++] = Float8GetDatum((double) res.hits / res.accesses);
+			else
+				nulls[j++] = true;
+			values[j++] = Int64GetDatumFast(res.evictions);
+			values[j++] = Float8GetDatumFast(res.plantime_saved);
+
+			Assert(j == PG_SHARED_PLANS_SIMULATE_COLS);
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+	}
+
+#if PG_VERSION_NUM < 170000
+	/* Should be a no-op anyway. */
+	tuplestore_donestoring(tupstore);
+#endif
+	return (Datum) 0;
+}
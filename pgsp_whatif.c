@@ -0,0 +1,315 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgsp_whatif.c: Replan the cached workload under different settings.
+ *
+ * The query trees are only available if pg_shared_plans.store_query was
+ * enabled when the entries were created.  Each stored query is planned twice
+ * in the calling backend, once with the current settings and once with the
+ * given overrides applied in a dedicated GUC nest level, and the estimated
+ * costs and plan shapes are compared.  The entries whose query was discarded
+ * or found outdated once the relations are locked are skipped.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2021-2023: Julien Rouhaud
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "optimizer/planner.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+
+#include "include/pg_shared_plans.h"
+#include "include/pgsp_epoch.h"
+#include "include/pgsp_fingerprint.h"
+#include "include/pgsp_import.h"
+#include "include/pgsp_index.h"
+
+typedef struct pgspWhatifItem
+{
+	pgspHashKey key;
+	char	   *query;			/* local copy of the serialized Query */
+	dsa_pointer query_ptr;		/* the copied entry's query */
+	int64		discard;		/* the entry's discard counter when copied */
+	uint64		epoch;			/* the entry's epoch when copied */
+} pgspWhatifItem;
+
+PG_FUNCTION_INFO_V1(pg_shared_plans_whatif);
+
+static void pgsp_whatif_parse(ArrayType *settings, List **names,
+							  List **values);
+static void pgsp_whatif_apply(List *names, List *values);
+static PlannedStmt *pgsp_whatif_plan(Query *query);
+static bool pgsp_whatif_item_valid(pgspWhatifItem *item);
+
+/*
+ * Check that the entry the given item was copied from still has the same
+ * query and that it's still valid.  Caller must hold the locks on the query's
+ * relations, so that the pending invalidations have been processed.
+ */
+static bool
+pgsp_whatif_item_valid(pgspWhatifItem *item)
+{
+	pgspEntry  *entry;
+	bool		valid;
+
+	LWLockAcquire(pgsp->lock, LW_SHARED);
+	entry = pgsp_index_lookup(&item->key, pgsp_index_hash(&item->key));
+
+	valid = (entry != NULL && entry->query == item->query_ptr &&
+			 entry->discard == item->discard &&
+			 entry->epoch == item->epoch &&
+			 (pgsp_validation != PGSP_VALIDATION_LAZY ||
+			  pgsp_entry_epoch_valid(entry)));
+	LWLockRelease(pgsp->lock);
+
+	return valid;
+}
+
+/*
+ * Split the given array of "name=value" strings.
+ */
+static void
+pgsp_whatif_parse(ArrayType *settings, List **names, List **values)
+{
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	int			i;
+
+	deconstruct_array(settings, TEXTOID, -1, false, TYPALIGN_INT,
+					  &elems, &nulls, &nelems);
+
+	for (i = 0; i < nelems; i++)
+	{
+		char	   *setting;
+		char	   *sep;
+		char	   *name;
+		char	   *value;
+
+		if (nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("settings must not contain null values")));
+
+		setting = TextDatumGetCString(elems[i]);
+		sep = strchr(setting, '=');
+		if (sep == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid setting \"%s\"", setting),
+					 errhint("Settings must be of the form name=value.")));
+
+		*sep = '\0';
+		name = setting;
+		value = sep + 1;
+
+		/* Ignore whitespace around the name and the value. */
+		while (*name == ' ')
+			name++;
+		while (sep > name && *(sep - 1) == ' ')
+			*(--sep) = '\0';
+		while (*value == ' ')
+			value++;
+		sep = value + strlen(value);
+		while (sep > value && *(sep - 1) == ' ')
+			*(--sep) = '\0';
+
+		*names = lappend(*names, name);
+		*values = lappend(*values, value);
+	}
+}
+
+/*
+ * Apply the given settings.  Caller is responsible for creating a new GUC
+ * nest level first, and for restoring it.
+ */
+static void
+pgsp_whatif_apply(List *names, List *values)
+{
+	ListCell   *lcn,
+			   *lcv;
+
+	forboth(lcn, names, lcv, values)
+	{
+		(void) set_config_option((char *) lfirst(lcn), (char *) lfirst(lcv),
+								 superuser() ? PGC_SUSET : PGC_USERSET,
+								 PGC_S_SESSION, GUC_ACTION_SAVE, true, 0,
+								 false);
+	}
+}
+
+static PlannedStmt *
+pgsp_whatif_plan(Query *query)
+{
+	/* No bound parameters, we want the generic plan. */
+	return standard_planner(query,
+#if PG_VERSION_NUM >= 130000
+							NULL,
+#endif
+							CURSOR_OPT_PARALLEL_OK, NULL);
+}
+
+#define PG_SHARED_PLANS_WHATIF_COLS		7
+Datum
+pg_shared_plans_whatif(PG_FUNCTION_ARGS)
+{
+	ArrayType  *settings = PG_GETARG_ARRAYTYPE_P(0);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	List	   *gucnames = NIL;
+	List	   *gucvalues = NIL;
+	List	   *items = NIL;
+	HASH_SEQ_STATUS hash_seq;
+	pgspEntry  *entry;
+	ListCell   *lc;
+	int			nestlevel;
+
+	if (!pgsp || !pgsp_hash)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_shared_plans must be loaded via shared_preload_libraries")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	pgsp_whatif_parse(settings, &gucnames, &gucvalues);
+
+	/* Report any problem with the settings before doing any real work. */
+	nestlevel = NewGUCNestLevel();
+	pgsp_whatif_apply(gucnames, gucvalues);
+	AtEOXact_GUC(true, nestlevel);
+
+	/* Create or attach to the dsa. */
+	pgsp_attach_dsa();
+
+	/* Switch into long-lived context to construct returned data structures */
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/*
+	 * Copy the stored queries of the current database, as we can't plan
+	 * anything while holding the lock.
+	 */
+	LWLockAcquire(pgsp->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, pgsp_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		pgspWhatifItem *item;
+
+		if (entry->key.dbid != MyDatabaseId ||
+			entry->query == InvalidDsaPointer)
+			continue;
+
+		/* In lazy validation mode, the query may already be outdated. */
+		if (pgsp_validation == PGSP_VALIDATION_LAZY &&
+			!pgsp_entry_epoch_valid(entry))
+			continue;
+
+		item = (pgspWhatifItem *) palloc(sizeof(pgspWhatifItem));
+		item->key = entry->key;
+		item->query = pstrdup(dsa_get_address(pgsp_area, entry->query));
+		item->query_ptr = entry->query;
+		item->discard = entry->discard;
+		item->epoch = entry->epoch;
+		items = lappend(items, item);
+	}
+	LWLockRelease(pgsp->lock);
+
+	foreach(lc, items)
+	{
+		pgspWhatifItem *item = (pgspWhatifItem *) lfirst(lc);
+		Datum		values[PG_SHARED_PLANS_WHATIF_COLS];
+		bool		nulls[PG_SHARED_PLANS_WHATIF_COLS];
+		Query	   *query;
+		PlannedStmt *base;
+		PlannedStmt *whatif;
+		double		base_cost;
+		double		whatif_cost;
+		int			i = 0;
+
+		CHECK_FOR_INTERRUPTS();
+
+		query = (Query *) stringToNode(item->query);
+
+		/*
+		 * One of the query's dependencies may have been modified since it was
+		 * copied, so check that the entry still has the same valid query once
+		 * we hold the same locks as the planner would.
+		 */
+		pgsp_ScanQueryForLocks(query, true);
+
+		if (!pgsp_whatif_item_valid(item))
+		{
+			pgsp_ScanQueryForLocks(query, false);
+			continue;
+		}
+
+		base = pgsp_whatif_plan(copyObject(query));
+
+		nestlevel = NewGUCNestLevel();
+		pgsp_whatif_apply(gucnames, gucvalues);
+		whatif = pgsp_whatif_plan(query);
+		AtEOXact_GUC(true, nestlevel);
+
+		base_cost = pgsp_cached_plan_cost(base, false);
+		whatif_cost = pgsp_cached_plan_cost(whatif, false);
+
+		memset(values, 0, sizeof(values));
+		memset(nulls, 0, sizeof(nulls));
+
+		if (OidIsValid(item->key.userid))
+			values[i++] = ObjectIdGetDatum(item->key.userid);
+		else
+			nulls[i++] = true;
+		values[i++] = Int64GetDatum((int64) item->key.queryid);
+		if (OidIsValid(item->key.constid))
+			values[i++] = ObjectIdGetDatum(item->key.constid);
+		else
+			nulls[i++] = true;
+		values[i++] = Float8GetDatum(base_cost);
+		values[i++] = Float8GetDatum(whatif_cost);
+		values[i++] = Float8GetDatum(whatif_cost - base_cost);
+		values[i++] = BoolGetDatum(pgsp_plan_fingerprint(base) !=
+								   pgsp_plan_fingerprint(whatif));
+
+		Assert(i == PG_SHARED_PLANS_WHATIF_COLS);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+#if PG_VERSION_NUM < 170000
+	/* Should be a no-op anyway. */
+	tuplestore_donestoring(tupstore);
+#endif
+	return (Datum) 0;
+}
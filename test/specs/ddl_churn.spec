@@ -0,0 +1,77 @@
+# Concurrent DDL on the objects a shared plan depends on, while it's being
+# used.  Each DDL changes the result of the query or makes the cached plan
+# unusable, and the plpgsql function raises an error if the query doesn't
+# return the expected value, so a stale plan is visible in the output.
+
+setup
+{
+    CREATE EXTENSION IF NOT EXISTS pg_shared_plans;
+    CREATE TABLE churn (id integer, val integer) PARTITION BY RANGE (id);
+    CREATE TABLE churn_1 PARTITION OF churn FOR VALUES FROM (0) TO (100);
+    CREATE TABLE churn_2 (id integer, val integer);
+    INSERT INTO churn SELECT i, i FROM generate_series(0, 99) i;
+    INSERT INTO churn_2 SELECT i, i FROM generate_series(100, 199) i;
+    CREATE INDEX churn_id_idx ON churn (id);
+    CREATE FUNCTION churn_fn(integer) RETURNS boolean LANGUAGE sql IMMUTABLE
+        AS 'SELECT $1 >= 0';
+    CREATE FUNCTION churn_check(p_id integer, p_expected bigint)
+    RETURNS void LANGUAGE plpgsql AS $$
+    DECLARE
+        v_total bigint;
+    BEGIN
+        SELECT coalesce(sum(val), 0) INTO v_total FROM churn
+        WHERE id = p_id AND churn_fn(id);
+        IF v_total <> p_expected THEN
+            RAISE EXCEPTION 'wrong result for %: % instead of %',
+                p_id, v_total, p_expected;
+        END IF;
+    END;
+    $$;
+}
+
+teardown
+{
+    DROP TABLE churn, churn_2;
+    DROP FUNCTION churn_check(integer, bigint);
+    DROP FUNCTION churn_fn(integer);
+}
+
+session s1
+setup
+{
+    SET plan_cache_mode TO force_custom_plan;
+    SET enable_seqscan = off;
+    SET enable_bitmapscan = off;
+    SET pg_shared_plans.enabled = on;
+    SET pg_shared_plans.threshold = 1;
+    SET pg_shared_plans.min_plan_time = 0;
+}
+step s1_check		{ DO $$ BEGIN PERFORM churn_check(1, 1); END $$; }
+step s1_check_altered	{ DO $$ BEGIN PERFORM churn_check(1, 10); END $$; }
+step s1_check_replaced	{ DO $$ BEGIN PERFORM churn_check(1, 0); END $$; }
+step s1_check_attached	{ DO $$ BEGIN PERFORM churn_check(150, 150); END $$; }
+step s1_check_detached	{ DO $$ BEGIN PERFORM churn_check(150, 0); END $$; }
+
+session s2
+step s2_begin		{ BEGIN; }
+step s2_drop_index	{ DROP INDEX churn_id_idx; }
+step s2_create_index	{ CREATE INDEX churn_id_idx ON churn (id); }
+step s2_alter		{ ALTER TABLE churn ALTER COLUMN val TYPE bigint USING val * 10; }
+step s2_attach		{ ALTER TABLE churn ATTACH PARTITION churn_2 FOR VALUES FROM (100) TO (200); }
+step s2_detach		{ ALTER TABLE churn DETACH PARTITION churn_2; }
+step s2_replace		{ CREATE OR REPLACE FUNCTION churn_fn(integer) RETURNS boolean LANGUAGE sql IMMUTABLE AS 'SELECT $1 < 0'; }
+step s2_commit		{ COMMIT; }
+
+# The cached plan uses the index, the readers wait for its removal and must
+# then use a plan that doesn't.
+permutation s1_check s1_check s2_begin s2_drop_index s1_check s2_commit s1_check s2_create_index s1_check
+
+# The readers wait for the table rewrite and must see the new values.
+permutation s1_check s1_check s2_begin s2_alter s1_check_altered s2_commit s1_check_altered
+
+# The plans must see the attached and detached partitions.
+permutation s1_check s1_check_detached s1_check_detached s2_attach s1_check_attached s1_check_attached s2_detach s1_check_detached
+
+# The readers keep using the old function until the commit, and must then see
+# the new one.
+permutation s1_check s1_check s2_begin s2_replace s1_check s2_commit s1_check_replaced s1_check_replaced
@@ -0,0 +1,40 @@
+--
+-- Test access trace and its simulation
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+
+-- Start from an empty trace
+SELECT pg_shared_plans_trace_reset();
+SET pg_shared_plans.trace = on;
+
+CREATE TABLE trace AS SELECT 1 AS id;
+PREPARE trace_a(int) AS SELECT id FROM trace WHERE id = $1 AND id < 10;
+PREPARE trace_b(int) AS SELECT id FROM trace WHERE id = $1 AND id < 20;
+PREPARE trace_c(int) AS SELECT id FROM trace WHERE id = $1 AND id < 30;
+
+-- Working set of 3 entries, accessed as A B A C A
+EXECUTE trace_a(1);
+EXECUTE trace_b(1);
+EXECUTE trace_a(1);
+EXECUTE trace_c(1);
+EXECUTE trace_a(1);
+
+SET pg_shared_plans.trace = off;
+
+-- With a capacity of 2, lru only evicts B to make room for C, while usage and
+-- lfu evict all the entries at once, so only the second access to A is a hit.
+-- With a capacity of 5 nothing is evicted.
+SELECT policy, capacity, accesses, hits, hit_ratio, evictions,
+    plantime_saved >= 0 AS plantime_saved_ok
+FROM pg_shared_plans_simulate('{2, 5}');
+
+-- Invalid capacities
+SELECT * FROM pg_shared_plans_simulate('{0}');
+
+DEALLOCATE trace_a;
+DEALLOCATE trace_b;
+DEALLOCATE trace_c;
+DROP TABLE trace;
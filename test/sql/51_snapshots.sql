@@ -0,0 +1,59 @@
+--
+-- Test statistics snapshots
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+
+-- Start from an empty cache, so that this test's entry is the only one kept in
+-- the snapshots
+SELECT pg_shared_plans_reset();
+
+CREATE TABLE snapshots AS SELECT 1 AS id;
+PREPARE snapshots(int) AS SELECT * FROM snapshots WHERE id = $1;
+
+-- Take the snapshots ourselves rather than waiting for the background worker.
+-- Any snapshot it takes in between has the same counters as the closest one
+-- taken here, as nothing else is executed.
+SELECT clock_timestamp() AS ts_1 \gset
+SELECT pg_shared_plans_snapshot_take();
+-- Should add the query in shared cache, with its first custom plan
+EXECUTE snapshots(1);
+SELECT clock_timestamp() AS ts_2 \gset
+SELECT pg_shared_plans_snapshot_take();
+-- Should bypass the planner
+EXECUTE snapshots(1);
+EXECUTE snapshots(1);
+SELECT pg_shared_plans_snapshot_take();
+SELECT clock_timestamp() AS ts_3 \gset
+
+-- Activity of the whole interval
+SELECT num_entries, num_plans, bypass, num_custom_plans, discard, hit_ratio
+FROM pg_shared_plans_snapshots_delta(:'ts_1', :'ts_3');
+
+-- The entry wasn't kept in the first snapshot, its counters are used as is
+SELECT bypass, num_custom_plans, discard
+FROM pg_shared_plans_snapshots_entries_delta(:'ts_1', :'ts_3')
+WHERE queryid IN (SELECT queryid
+    FROM pg_shared_plans(false, false, 0, 'snapshots'::regclass));
+
+-- Only the hits happened in the second interval
+SELECT num_entries, num_plans, bypass, num_custom_plans, discard, hit_ratio
+FROM pg_shared_plans_snapshots_delta(:'ts_2', :'ts_3');
+SELECT bypass, num_custom_plans, discard
+FROM pg_shared_plans_snapshots_entries_delta(:'ts_2', :'ts_3')
+WHERE queryid IN (SELECT queryid
+    FROM pg_shared_plans(false, false, 0, 'snapshots'::regclass));
+
+-- The snapshots taken after the entry creation kept it, the background worker
+-- may have taken more of them
+SELECT DISTINCT bypass, num_custom_plans, discard
+FROM pg_shared_plans_snapshots_entries()
+WHERE ts >= :'ts_1' AND ts <= :'ts_3'
+AND queryid IN (SELECT queryid
+    FROM pg_shared_plans(false, false, 0, 'snapshots'::regclass))
+ORDER BY bypass;
+
+DEALLOCATE snapshots;
+DROP TABLE snapshots;
@@ -0,0 +1,38 @@
+--
+-- Test configuration advisor
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+
+SELECT pg_shared_plans_reset();
+
+CREATE TABLE advise AS SELECT 1 AS id;
+PREPARE advise(int) AS SELECT id FROM advise WHERE id = $1;
+
+-- Should add the query in shared cache
+EXECUTE advise(1);
+
+SELECT parameter, recommended, reason
+FROM pg_shared_plans_advise()
+WHERE parameter IN ('pg_shared_plans.max', 'pg_shared_plans.min_plan_time',
+    'pg_shared_plans.threshold');
+
+-- The memory footprint is the allocated size, not counting the plans twice
+SELECT a.setting = pg_size_pretty(i.alloced_size) AS setting_ok,
+    a.recommended = pg_size_pretty(i.alloced_size) AS recommended_ok,
+    a.reason = 'average of ' || pg_size_pretty(i.alloced_size)
+        || ' per cached plan' AS reason_ok
+FROM pg_shared_plans_advise() a, pg_shared_plans_info i
+WHERE a.parameter = 'memory';
+
+SELECT parameter, recommended = setting AS unchanged, reason
+FROM pg_shared_plans_advise()
+WHERE parameter IN ('pg_shared_plans.rdepend_max', 'planning_time_saved');
+
+SELECT rdepend_refused, plantime_rejected
+FROM pg_shared_plans_info;
+
+DEALLOCATE advise;
+DROP TABLE advise;
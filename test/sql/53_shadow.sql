@@ -0,0 +1,33 @@
+--
+-- Test shadow mode
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+SET pg_shared_plans.shadow = on;
+
+CREATE TABLE shadow AS SELECT 1 AS id;
+PREPARE shadow(int) AS SELECT * FROM shadow WHERE id = $1;
+
+-- Should add the query in shared cache
+EXECUTE shadow(1);
+-- Should only count shadow hits
+EXECUTE shadow(1);
+EXECUTE shadow(1);
+
+-- Both plans are the same seq scan, so sharing the plan wouldn't cost more
+SELECT bypass, shadow_hits, shadow_time_saved > 0 AS has_time_saved,
+    shadow_cost_diff
+FROM pg_shared_plans(false, false, 0, 'shadow'::regclass);
+
+SET pg_shared_plans.shadow = off;
+
+-- Should bypass the planner
+EXECUTE shadow(1);
+
+SELECT bypass, shadow_hits
+FROM pg_shared_plans(false, false, 0, 'shadow'::regclass);
+
+DEALLOCATE shadow;
+DROP TABLE shadow;
@@ -0,0 +1,49 @@
+--
+-- Test what-if replanning
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+SET pg_shared_plans.store_query = on;
+
+CREATE TABLE whatif AS SELECT id FROM generate_series(1, 10000) id;
+CREATE INDEX ON whatif (id);
+ANALYZE whatif;
+PREPARE whatif(int) AS SELECT * FROM whatif WHERE id = $1;
+
+-- Should add the query in shared cache
+EXECUTE whatif(1);
+
+SET pg_shared_plans.store_query = off;
+
+-- Same settings, nothing should change
+SELECT w.cost = p.generic_cost AS same_cost, cost_diff, plan_changed
+FROM pg_shared_plans_whatif('{}') w
+JOIN pg_shared_plans(false, false, 0, 'whatif'::regclass) p USING (queryid);
+
+-- Forbidding index usage should change the plan to a seq scan
+SELECT w.whatif_cost = c.relpages * current_setting('seq_page_cost')::float8
+        + c.reltuples * (current_setting('cpu_tuple_cost')::float8
+            + current_setting('cpu_operator_cost')::float8) AS seqscan_cost,
+    w.cost_diff = w.whatif_cost - p.generic_cost AS same_cost_diff,
+    plan_changed
+FROM pg_shared_plans_whatif('{enable_indexscan = off, enable_bitmapscan=off}') w
+JOIN pg_shared_plans(false, false, 0, 'whatif'::regclass) p USING (queryid)
+JOIN pg_class c ON c.oid = 'whatif'::regclass;
+
+-- The overrides shouldn't leak
+SHOW enable_indexscan;
+
+-- Invalid settings
+SELECT * FROM pg_shared_plans_whatif('{enable_indexscan}');
+SELECT * FROM pg_shared_plans_whatif('{not_a_guc=1}');
+
+-- Discarded entries aren't planned anymore
+ALTER TABLE whatif ADD COLUMN val integer;
+SELECT count(*)
+FROM pg_shared_plans_whatif('{}') w
+JOIN pg_shared_plans(false, false, 0, 'whatif'::regclass) p USING (queryid);
+
+DEALLOCATE whatif;
+DROP TABLE whatif;
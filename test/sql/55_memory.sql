@@ -0,0 +1,77 @@
+--
+-- Test shared memory breakdown
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+
+-- Start from an empty cache, so that only this test's entry is accounted for
+SELECT pg_shared_plans_reset();
+
+CREATE TABLE memory AS SELECT 1 AS id;
+PREPARE memory(int) AS SELECT * FROM memory WHERE id = $1;
+
+-- Should add the query in shared cache
+EXECUTE memory(1);
+
+-- The memory breakdown only accounts for the cached entry
+SELECT component, num
+FROM pg_shared_plans_memory()
+WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+ORDER BY component COLLATE "C";
+
+SELECT m.bytes = p.size AS plans_bytes
+FROM pg_shared_plans_memory() m
+JOIN pg_shared_plans(false, false, 0, 'memory'::regclass) p USING (dbid)
+WHERE m.component = 'plans';
+
+SELECT r.bytes = 4 AS relations_bytes, s.bytes = 9 * a.bytes AS slack_bytes
+FROM pg_shared_plans_memory() r
+JOIN pg_shared_plans_memory() a USING (dbid)
+JOIN pg_shared_plans_memory() s USING (dbid)
+WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+AND r.component = 'relations' AND a.component = 'rdepend arrays'
+AND s.component = 'rdepend slack';
+
+SELECT current_setting('pg_shared_plans.max')::int AS max \gset
+
+-- The fixed size structures are sized for the configured maximums
+SELECT component, num = CASE component
+        WHEN 'fixed backends' THEN current_setting('max_connections')::int
+            + current_setting('autovacuum_max_workers')::int + 1
+            + current_setting('max_worker_processes')::int
+            + current_setting('max_wal_senders')::int
+        WHEN 'fixed churn hash' THEN 2 * :max
+        WHEN 'fixed epochs' THEN 4096
+        WHEN 'fixed hash' THEN :max
+        WHEN 'fixed index' THEN 2 ^ ceil(log(2, 2 * :max))
+        WHEN 'fixed slots' THEN 2 * :max
+        WHEN 'fixed snapshots'
+            THEN current_setting('pg_shared_plans.snapshot_max')::int
+    END AS num_ok, bytes >= num AS bytes_ok
+FROM pg_shared_plans_memory()
+WHERE component LIKE 'fixed %'
+ORDER BY component COLLATE "C";
+
+-- Memoized plans and their parameters are accounted for separately
+SET pg_shared_plans.threshold = 5;
+SET pg_shared_plans.memo_size = 2;
+
+-- Should plan and memoize a custom plan
+EXECUTE memory(1);
+
+SELECT component, num
+FROM pg_shared_plans_memory()
+WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+AND component LIKE 'memo %'
+ORDER BY component COLLATE "C";
+
+SELECT m.bytes = p.len AS memo_plans_bytes
+FROM pg_shared_plans_memory() m
+JOIN pg_shared_plans_memo() p USING (dbid)
+WHERE m.component = 'memo plans';
+
+RESET pg_shared_plans.memo_size;
+DEALLOCATE memory;
+DROP TABLE memory;
@@ -0,0 +1,50 @@
+--
+-- Test reverse dependencies report
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+
+CREATE TABLE rdepends AS SELECT 1 AS id;
+PREPARE rdepends(int) AS SELECT * FROM rdepends WHERE id = $1;
+
+-- Should add the query in shared cache
+EXECUTE rdepends(1);
+
+SELECT classid::regclass, num_keys, max_keys, discards, evictions, refused
+FROM pg_shared_plans_rdepends()
+WHERE objid = 'rdepends'::regclass;
+
+-- The reported size is the entry and its whole array, as in the memory
+-- breakdown
+SELECT r.bytes = e.bytes / e.num
+        + r.max_keys * (a.bytes + s.bytes) / (a.num + s.num) AS same_bytes
+FROM pg_shared_plans_rdepends() r
+JOIN pg_shared_plans_memory() e USING (dbid)
+JOIN pg_shared_plans_memory() a USING (dbid)
+JOIN pg_shared_plans_memory() s USING (dbid)
+WHERE r.objid = 'rdepends'::regclass AND e.component = 'rdepend entries'
+AND a.component = 'rdepend arrays' AND s.component = 'rdepend slack';
+
+-- Should discard the plan
+ALTER TABLE rdepends ADD COLUMN val text;
+
+SELECT num_keys, discards, evictions
+FROM pg_shared_plans_rdepends()
+WHERE objid = 'rdepends'::regclass;
+
+-- The counters go away with the last dependent entry, and start from zero if
+-- the reverse dependency is created again
+SELECT pg_shared_plans_reset(0, 0, queryid)
+FROM pg_shared_plans(false, false, 0, 'rdepends'::regclass);
+SELECT count(*)
+FROM pg_shared_plans_rdepends()
+WHERE objid = 'rdepends'::regclass;
+EXECUTE rdepends(1);
+SELECT num_keys, discards, evictions
+FROM pg_shared_plans_rdepends()
+WHERE objid = 'rdepends'::regclass;
+
+DEALLOCATE rdepends;
+DROP TABLE rdepends;
@@ -0,0 +1,33 @@
+--
+-- Test plan fingerprint and plan changes history
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+
+CREATE TABLE plan_changes AS SELECT 1 AS id;
+PREPARE plan_changes(int) AS SELECT id FROM plan_changes WHERE id = $1;
+
+-- Should add the query in shared cache
+EXECUTE plan_changes(1);
+
+SELECT fingerprint != 0 AS has_fingerprint
+FROM pg_shared_plans(false, false, 0, 'plan_changes'::regclass);
+
+-- Should discard the plan
+ALTER TABLE plan_changes ADD COLUMN val text;
+
+-- Should store a new plan, with a different cost as the rows are now
+-- estimated wider
+EXECUTE plan_changes(1);
+
+SELECT c.reason, c.fingerprint = p.fingerprint AS same_fingerprint,
+    c.generic_cost = p.generic_cost AS current_cost
+FROM pg_shared_plans_plan_changes() c
+JOIN pg_shared_plans(false, false, 0, 'plan_changes'::regclass) p
+    USING (queryid)
+ORDER BY c.ts;
+
+DEALLOCATE plan_changes;
+DROP TABLE plan_changes;
@@ -0,0 +1,50 @@
+--
+-- Test entries lifecycle timestamps and hit rate
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+
+CREATE TABLE lifecycle AS SELECT 1 AS id;
+PREPARE lifecycle(int) AS SELECT id FROM lifecycle WHERE id = $1;
+
+-- Should add the query in shared cache
+EXECUTE lifecycle(1);
+
+SELECT created_at < statement_timestamp() AS created_at_ok, last_hit_at,
+    last_discard_at, last_replanned_at, hit_rate
+FROM pg_shared_plans(false, false, 0, 'lifecycle'::regclass);
+SELECT created_at
+FROM pg_shared_plans(false, false, 0, 'lifecycle'::regclass) \gset
+
+-- Should bypass the planner
+EXECUTE lifecycle(1);
+EXECUTE lifecycle(1);
+
+-- The first hit adds 1 / 60 to the hit rate, the second one adds the same to
+-- the slightly decayed rate
+SELECT bypass,
+    last_hit_at > created_at AND last_hit_at < statement_timestamp()
+        AS last_hit_at_ok,
+    hit_rate > 1::float8 / 60 AND hit_rate <= 2::float8 / 60 AS hit_rate_ok
+FROM pg_shared_plans(false, false, 0, 'lifecycle'::regclass);
+
+-- Should discard the plan
+ALTER TABLE lifecycle ADD COLUMN val text;
+
+SELECT last_discard_at > last_hit_at
+        AND last_discard_at < statement_timestamp() AS last_discard_at_ok,
+    last_replanned_at
+FROM pg_shared_plans(false, false, 0, 'lifecycle'::regclass);
+
+-- Should store a new plan in the same entry
+EXECUTE lifecycle(1);
+
+SELECT created_at = :'created_at' AS same_created_at,
+    last_replanned_at > last_discard_at
+        AND last_replanned_at < statement_timestamp() AS last_replanned_at_ok
+FROM pg_shared_plans(false, false, 0, 'lifecycle'::regclass);
+
+DEALLOCATE lifecycle;
+DROP TABLE lifecycle;
@@ -0,0 +1,49 @@
+--
+-- Test normalized query text storage
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+
+CREATE TABLE query_text AS SELECT 1 AS id, 'a' AS val;
+PREPARE query_text_a(int) AS SELECT id FROM query_text WHERE id = $1 AND val = 'a';
+PREPARE query_text_b(int) AS SELECT id FROM query_text WHERE id = $1 AND val = 'b';
+
+-- Should add two entries in shared cache, with the same queryid
+EXECUTE query_text_a(1);
+EXECUTE query_text_b(1);
+
+-- The normalized text should be shared by both entries
+SELECT query, count(*) AS num_entries
+FROM pg_shared_plans
+WHERE query LIKE '%query_text%'
+GROUP BY query;
+
+-- Removing the entries should release the text, and a new entry store it again
+SELECT pg_shared_plans_reset(0, 0, queryid)
+FROM pg_shared_plans
+WHERE query LIKE '%query_text%'
+LIMIT 1;
+SELECT coalesce(sum(num), 0) AS texts_num,
+    coalesce(sum(bytes), 0) AS texts_bytes
+FROM pg_shared_plans_memory()
+WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+AND component = 'query texts' \gset
+EXECUTE query_text_a(1);
+
+SELECT query, count(*) AS num_entries
+FROM pg_shared_plans
+WHERE query LIKE '%query_text%'
+GROUP BY query;
+
+-- Only the new text is accounted, not compressed as it's too short
+SELECT m.num = :texts_num + 1 AS num_ok,
+    m.bytes = :texts_bytes + octet_length(p.query) + 1 AS bytes_ok
+FROM pg_shared_plans_memory() m
+JOIN pg_shared_plans(false, false, 0, 'query_text'::regclass) p USING (dbid)
+WHERE m.component = 'query texts';
+
+DEALLOCATE query_text_a;
+DEALLOCATE query_text_b;
+DROP TABLE query_text;
@@ -0,0 +1,27 @@
+--
+-- Test per-backend statistics
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+
+CREATE TABLE backends AS SELECT 1 AS id;
+PREPARE backends(int) AS SELECT * FROM backends WHERE id = $1;
+
+-- Should add the query in shared cache
+EXECUTE backends(1);
+-- Should bypass the planner, each hit deserializing the whole cached plan
+EXECUTE backends(1);
+EXECUTE backends(1);
+
+SELECT a.pid IS NOT NULL AS has_activity, b.lookups, b.hits, b.misses,
+    b.stores, b.validation_failures, b.hook_time > 0 AS has_hook_time,
+    b.bytes_deserialized = 2 * p.size AS bytes_deserialized_ok
+FROM pg_shared_plans_backends() b
+LEFT JOIN pg_stat_activity a USING (pid),
+pg_shared_plans(false, false, 0, 'backends'::regclass) p
+WHERE b.pid = pg_backend_pid();
+
+DEALLOCATE backends;
+DROP TABLE backends;
@@ -0,0 +1,34 @@
+--
+-- Test the shared cache provenance of the plans
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+
+CREATE TABLE provenance AS SELECT 1 AS id;
+PREPARE provenance(int) AS SELECT * FROM provenance WHERE id = $1;
+
+-- Should add the query in shared cache
+EXECUTE provenance(1);
+-- Should bypass the planner
+EXECUTE provenance(1);
+EXECUTE provenance(1);
+
+-- The cost of the cached plans is lowered by the plancache penalty for a
+-- custom plan, 1000 * cpu_operator_cost for the relation and the planning,
+-- spread over the executions before plancache considers a generic plan, plus
+-- a safety margin
+SELECT n, lookup, stored,
+    cost = CASE lookup
+        WHEN 'hit' THEN original_cost
+            - (1000 * current_setting('cpu_operator_cost')::float8 * 2 * 5 / 4
+               + 0.01)
+        ELSE original_cost
+    END AS cost_ok,
+    lookup_time >= 0 AS has_lookup_time
+FROM pg_shared_plans_provenance()
+ORDER BY n;
+
+DEALLOCATE provenance;
+DROP TABLE provenance;
@@ -0,0 +1,59 @@
+--
+-- Test the detection of queries cached with many different constants
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+SET pg_shared_plans.max_entries_per_query = 2;
+
+CREATE TABLE churn AS SELECT 1 AS id, 1 AS val;
+PREPARE churn_1(int) AS SELECT id FROM churn WHERE id = $1 AND val = 1;
+PREPARE churn_2(int) AS SELECT id FROM churn WHERE id = $1 AND val = 2;
+PREPARE churn_3(int) AS SELECT id FROM churn WHERE id = $1 AND val = 3;
+
+-- Should add two entries in shared cache, with the same queryid
+EXECUTE churn_1(1);
+EXECUTE churn_2(1);
+-- Should be refused
+EXECUTE churn_3(1);
+
+-- The refused constant is still accounted for, and so few constants are counted
+-- exactly
+SELECT distinct_constids, entries, refused
+FROM pg_shared_plans_churn()
+WHERE queryid IN (SELECT queryid
+    FROM pg_shared_plans(false, false, 0, 'churn'::regclass));
+
+SELECT count(*) AS num_entries
+FROM pg_shared_plans(false, false, 0, 'churn'::regclass);
+
+-- Discard the cached plans, the existing entries can still store new ones
+ALTER TABLE churn ADD COLUMN extra integer;
+EXECUTE churn_1(1);
+-- Should use the new plan
+EXECUTE churn_1(1);
+
+SELECT distinct_constids, entries, refused
+FROM pg_shared_plans_churn()
+WHERE queryid IN (SELECT queryid
+    FROM pg_shared_plans(false, false, 0, 'churn'::regclass));
+
+SELECT bypass, discard
+FROM pg_shared_plans(false, false, 0, 'churn'::regclass)
+ORDER BY bypass;
+
+RESET pg_shared_plans.max_entries_per_query;
+
+-- Should now be stored
+EXECUTE churn_3(1);
+
+SELECT distinct_constids, entries, refused
+FROM pg_shared_plans_churn()
+WHERE queryid IN (SELECT queryid
+    FROM pg_shared_plans(false, false, 0, 'churn'::regclass));
+
+DEALLOCATE churn_1;
+DEALLOCATE churn_2;
+DEALLOCATE churn_3;
+DROP TABLE churn;
@@ -0,0 +1,61 @@
+--
+-- Test the builtin query fingerprint
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+SET compute_query_id = off;
+-- The builtin fingerprint can only be enabled at server start
+SHOW pg_shared_plans.builtin_fingerprint;
+
+CREATE TABLE fingerprint AS SELECT 1 AS id, 1 AS val;
+PREPARE fingerprint_1(int) AS SELECT id FROM fingerprint WHERE id = $1 AND val = 1;
+PREPARE fingerprint_2(int) AS SELECT id FROM fingerprint WHERE id = $1 AND val = 2;
+PREPARE fingerprint_3(int) AS SELECT id
+    FROM fingerprint
+    WHERE id = $1 AND val = 1;
+
+-- Should add two entries in shared cache with the same fingerprint, the
+-- constants being only part of the constid
+EXECUTE fingerprint_1(1);
+EXECUTE fingerprint_2(1);
+-- Should use the first entry, the formatting isn't part of the fingerprint
+EXECUTE fingerprint_3(1);
+
+SELECT count(*) AS num_entries, count(DISTINCT queryid) AS num_queryids,
+    count(DISTINCT constid) AS num_constids, sum(bypass) AS bypass
+FROM pg_shared_plans(false, false, 0, 'fingerprint'::regclass);
+
+-- Queries only differing by their constants must never share a plan, whether
+-- the query identifier is our fingerprint or not
+INSERT INTO fingerprint VALUES (1, 2);
+PREPARE fingerprint_5(int) AS SELECT val FROM fingerprint WHERE id = $1 AND val = 1;
+PREPARE fingerprint_6(int) AS SELECT val FROM fingerprint WHERE id = $1 AND val = 2;
+EXECUTE fingerprint_5(1);
+EXECUTE fingerprint_6(1);
+-- Should use the cached plans
+EXECUTE fingerprint_5(1);
+EXECUTE fingerprint_6(1);
+
+SET compute_query_id = on;
+PREPARE fingerprint_7(int) AS SELECT val FROM fingerprint WHERE id = $1 AND val = 1;
+PREPARE fingerprint_8(int) AS SELECT val FROM fingerprint WHERE id = $1 AND val = 2;
+EXECUTE fingerprint_7(1);
+EXECUTE fingerprint_8(1);
+-- Should use the cached plans
+EXECUTE fingerprint_7(1);
+EXECUTE fingerprint_8(1);
+
+SELECT count(*) AS num_entries, count(DISTINCT queryid) AS num_queryids,
+    sum(bypass) AS bypass
+FROM pg_shared_plans(false, false, 0, 'fingerprint'::regclass);
+
+DEALLOCATE fingerprint_1;
+DEALLOCATE fingerprint_2;
+DEALLOCATE fingerprint_3;
+DEALLOCATE fingerprint_5;
+DEALLOCATE fingerprint_6;
+DEALLOCATE fingerprint_7;
+DEALLOCATE fingerprint_8;
+DROP TABLE fingerprint;
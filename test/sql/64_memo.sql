@@ -0,0 +1,49 @@
+--
+-- Test the memoization of custom plans
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 5;
+SET pg_shared_plans.min_plan_time = '0ms';
+SET pg_shared_plans.memo_size = 2;
+
+CREATE TABLE memo AS SELECT 1 AS id;
+PREPARE memo(int) AS SELECT * FROM memo WHERE id = $1;
+
+-- Should add the query in shared cache
+EXECUTE memo(1);
+-- Should memoize the custom plan
+EXECUTE memo(1);
+-- Should use the memoized plan
+EXECUTE memo(1);
+-- Should memoize another custom plan
+EXECUTE memo(2);
+
+-- Both plans only differ by their constant
+SELECT kind, hits, count(*) OVER (PARTITION BY len, cost) AS same_len_cost,
+    count(*) OVER (PARTITION BY params_hash) AS same_hash
+FROM pg_shared_plans_memo()
+WHERE queryid IN (SELECT queryid
+    FROM pg_shared_plans(false, false, 0, 'memo'::regclass))
+ORDER BY hits;
+
+-- Should evict the least recently used memoized plan, the one for 1
+EXECUTE memo(3);
+
+SELECT kind, hits
+FROM pg_shared_plans_memo()
+WHERE queryid IN (SELECT queryid
+    FROM pg_shared_plans(false, false, 0, 'memo'::regclass))
+ORDER BY hits;
+
+-- Should discard the plan and the memoized plans
+ALTER TABLE memo ADD COLUMN val text;
+
+SELECT count(*) AS num_memo
+FROM pg_shared_plans_memo()
+WHERE queryid IN (SELECT queryid
+    FROM pg_shared_plans(false, false, 0, 'memo'::regclass));
+
+RESET pg_shared_plans.memo_size;
+DEALLOCATE memo;
+DROP TABLE memo;
@@ -0,0 +1,46 @@
+--
+-- Test the generic plans restricted to some partitions
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+SET pg_shared_plans.memo_size = 2;
+SET pg_shared_plans.partition_plans = on;
+
+CREATE TABLE part_plans (id integer) PARTITION BY RANGE (id);
+CREATE TABLE part_plans_1 PARTITION OF part_plans FOR VALUES FROM (0) TO (10);
+CREATE TABLE part_plans_2 PARTITION OF part_plans FOR VALUES FROM (10) TO (20);
+INSERT INTO part_plans SELECT generate_series(0, 19);
+PREPARE part_plans(int) AS SELECT id FROM part_plans WHERE id = $1;
+
+-- Should add the query in shared cache
+EXECUTE part_plans(1);
+-- Should use the generic plan and remember the one for part_plans_1
+EXECUTE part_plans(1);
+-- Should use the plan restricted to part_plans_1
+EXECUTE part_plans(2);
+-- Should use the generic plan and remember the one for part_plans_2
+EXECUTE part_plans(15);
+
+-- The restricted plans only scan one partition, so they're smaller and cheaper
+-- than the generic plan
+SELECT m.kind, m.len < p.size AS smaller, m.cost < p.generic_cost AS cheaper,
+    m.hits
+FROM pg_shared_plans_memo() m
+JOIN pg_shared_plans(false, false, 0, 'part_plans'::regclass) p
+    USING (queryid)
+ORDER BY m.hits;
+
+-- Should discard the plan and the memoized plans
+ALTER TABLE part_plans ADD COLUMN val text;
+
+SELECT count(*) AS num_memo
+FROM pg_shared_plans_memo()
+WHERE queryid IN (SELECT queryid
+    FROM pg_shared_plans(false, false, 0, 'part_plans'::regclass));
+
+RESET pg_shared_plans.partition_plans;
+RESET pg_shared_plans.memo_size;
+DEALLOCATE part_plans;
+DROP TABLE part_plans;
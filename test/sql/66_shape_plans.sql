@@ -0,0 +1,38 @@
+--
+-- Test the plans generated for a parameter shape
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 5;
+SET pg_shared_plans.min_plan_time = '0ms';
+SET pg_shared_plans.memo_size = 2;
+SET pg_shared_plans.shape_plans = on;
+
+CREATE TABLE shape AS SELECT generate_series(1, 10) AS id;
+PREPARE shape(int, int[]) AS SELECT count(*) FROM shape
+    WHERE (id = $1 OR $1 IS NULL) AND id = ANY($2);
+
+-- Should add the query in shared cache
+EXECUTE shape(1, '{1, 2}');
+-- Should memoize a plan for a non NULL value and a 2 or 3 elements array
+EXECUTE shape(1, '{1, 2}');
+-- Should use the memoized plan
+EXECUTE shape(2, '{2, 3}');
+-- Should memoize a plan for a NULL value and a 2 or 3 elements array
+EXECUTE shape(NULL, '{1, 2, 3}');
+-- Should use the memoized plan
+EXECUTE shape(NULL, '{4, 5}');
+
+-- The plan for a NULL value doesn't have the optional filter anymore, so it's
+-- smaller and cheaper
+SELECT kind, hits, len < max(len) OVER () AS simplified,
+    cost < max(cost) OVER () AS cheaper
+FROM pg_shared_plans_memo()
+WHERE queryid IN (SELECT queryid
+    FROM pg_shared_plans(false, false, 0, 'shape'::regclass))
+ORDER BY len;
+
+RESET pg_shared_plans.shape_plans;
+RESET pg_shared_plans.memo_size;
+DEALLOCATE shape;
+DROP TABLE shape;
@@ -0,0 +1,36 @@
+--
+-- Test the measured plan cost mode
+--
+SET plan_cache_mode TO force_custom_plan;
+SET pg_shared_plans.enabled = on;
+SET pg_shared_plans.threshold = 1;
+SET pg_shared_plans.min_plan_time = '0ms';
+
+CREATE TABLE plan_cost AS SELECT generate_series(1, 1000) AS id;
+CREATE INDEX ON plan_cost (id);
+ANALYZE plan_cost;
+PREPARE plan_cost(int) AS SELECT count(*) FROM plan_cost WHERE id < $1;
+
+-- Should add the query in shared cache
+EXECUTE plan_cost(0);
+-- Should plan a custom plan, the generic plan is estimated to be more
+-- expensive
+EXECUTE plan_cost(0);
+
+SELECT bypass, num_custom_plans
+FROM pg_shared_plans(false, false, 0, 'plan_cost'::regclass);
+
+-- Make any planning time more expensive than the generic plan
+SET pg_shared_plans.plan_cost_mode = measured;
+SET pg_shared_plans.plantime_cost = 1e9;
+
+-- Should use the shared plan
+EXECUTE plan_cost(0);
+
+SELECT bypass, num_custom_plans
+FROM pg_shared_plans(false, false, 0, 'plan_cost'::regclass);
+
+RESET pg_shared_plans.plantime_cost;
+RESET pg_shared_plans.plan_cost_mode;
+DEALLOCATE plan_cost;
+DROP TABLE plan_cost;